@@ -35,9 +35,8 @@ ensures that only one process has access to the task file at any given time.
 The order of operations is as follows:
 
     - A process opens the task file and obtains an exclusive lock.
-    - tasks are read into a list.
-    - First task is popped off the list.
-    - Truncated list is written back to the file.
+    - First task is read from the file.
+    - Remaining tasks are written back to the file.
     - File is unlocked and closed (other processes can now access it).
     - Task is checked for validity and executed.
 
@@ -45,6 +44,10 @@ Usage:
 
     mpirun -np CORES taskfarmer.py [-h] -f FILE [-v] [-w] [-r]
         [-s SLEEP_TIME] [-m MAX_RETRIES] [-d [DISALLOWED [DISALLOWED ...]]]
+        [-q {rewrite,cursor}] [-o {discard,log,tail}] [-l LOG_DIR] [-t TAIL_SIZE]
+        [-p [PRELOAD [PRELOAD ...]]] [-n PY_MAX_TASKS] [-M PY_MAX_MEMORY]
+        [-L {mpi,env,local}] [-W LOCAL_WORKERS] [-S SLOTS] [-T TIMEOUT]
+        [-g LEDGER]
 
 PyTaskFarmer supports the following short- and long-form command-line
 options.
@@ -60,6 +63,30 @@ options.
                             maximum number of times to retry failed tasks
     -d [DISALLOWED [DISALLOWED ...]], --disallowed [DISALLOWED [DISALLOWED ...]]
                             list of disallowed commands
+    -q {rewrite,cursor}, --queue-backend {rewrite,cursor}
+                            how tasks are removed from the task file
+    -o {discard,log,tail}, --output {discard,log,tail}
+                            how the output of tasks is handled
+    -l LOG_DIR, --log-dir LOG_DIR
+                            directory for per-rank task logs
+    -t TAIL_SIZE, --tail-size TAIL_SIZE
+                            size of the output tail kept for failed tasks (KB)
+    -p [PRELOAD [PRELOAD ...]], --py-preload [PRELOAD [PRELOAD ...]]
+                            modules imported by the Python task worker at start
+    -n PY_MAX_TASKS, --py-max-tasks PY_MAX_TASKS
+                            Python tasks run before the worker is recycled
+    -M PY_MAX_MEMORY, --py-max-memory PY_MAX_MEMORY
+                            worker memory (MB) above which it is recycled
+    -L {mpi,env,local}, --launcher {mpi,env,local}
+                            how the rank of each process is determined
+    -W LOCAL_WORKERS, --local-workers LOCAL_WORKERS
+                            number of processes to run with the local launcher
+    -S SLOTS, --slots SLOTS
+                            number of tasks each process runs at once
+    -T TIMEOUT, --timeout TIMEOUT
+                            time limit for each task (seconds)
+    -g LEDGER, --ledger LEDGER
+                            file to which task completions are appended
 
 Commands from the task file are checked against the "disallowed" list before
 being executed. This avoids undesired consequences if the task file is
@@ -77,6 +104,107 @@ calls "sys.exit()" when the task file is empty.
 The "--retry" and "--max-retries" options allow PyTaskFarmer to retry failed
 tasks up to a maximum number of attempts. The default number of retries is 10.
 
+The "--queue-backend" option selects how tasks are removed from the task file.
+The default, "rewrite", rewrites the task file without its first line, so the
+cost of each dequeue grows with the size of the file. The "cursor" backend
+leaves the task file untouched and records the byte offset of the next
+unclaimed task in a file alongside it (e.g. tasks.txt.offset), so each dequeue
+reads a single line. The task file is truncated once all of its tasks have been
+claimed. The on-disk format and locking (POSIX fcntl record locks on the task
+file) are shared with the C implementation, so both can work the same queue.
+
+The "--output" option controls what happens to the standard output and error
+of each task. By default ("discard") it is thrown away. With "log" it is
+streamed straight to a per-rank log file, e.g. taskfarmer.0003.log, in the
+"--log-dir" directory, with a header line for each task. With "tail" only the
+last TAIL_SIZE KB are kept in memory and printed if the task fails. In all
+cases the memory used by PyTaskFarmer is independent of how much a task prints.
+
+Tasks of the form
+
+    py:MODULE:FUNCTION(ARGUMENTS)
+
+e.g. "py:mypkg.analysis:run(42, output='run42.dat')", are run without
+starting a new interpreter. Instead they are passed to a long-lived worker
+process that keeps modules imported between tasks, which avoids paying the
+interpreter start up and import cost for every task. Arguments must be Python
+literals. A function that returns None or True succeeds, False fails, and an
+integer is used as the exit status. Exceptions are treated as failures, with
+the traceback used as the output tail. Modules listed with "--py-preload" are
+imported when the worker starts. To contain memory leaks the worker is replaced
+after "--py-max-tasks" tasks (default 100) or once its peak memory use exceeds
+"--py-max-memory" MB (by default there is no limit).
+
+Since PyTaskFarmer only uses MPI to find the rank of each process, the
+"--launcher" option allows it to run without importing mpi4py, which can take
+tens of seconds at scale on clusters that don't natively support Python shared
+libraries. The default, "mpi", gets the rank from mpi4py. With "env" the rank
+is taken from the environment variables set by the launcher (Open MPI, MPICH,
+Intel MPI, PMIx, Slurm, and Cray ALPS are recognised), so PyTaskFarmer can be
+started with mpirun, or srun, as usual. With "local" no launcher is needed:
+PyTaskFarmer forks "--local-workers" processes on the current node (default is
+the number of cores), e.g.
+
+    taskfarmer.py -f tasks.txt -L local -W 16
+
+Each process can also keep several tasks running at once using the "--slots"
+option. Tasks are run as asynchronous subprocesses and a slot claims a new
+task from the task file as soon as its previous task finishes. A single
+PyTaskFarmer process per node can then drive all of the node's cores, e.g.
+
+    mpirun -np NODES -npernode 1 taskfarmer.py -f tasks.txt -L env -S 32
+
+which avoids the start up cost and memory of one interpreter per core. Each
+slot has its own Python task worker, and with "--output log" the output of
+tasks running in different slots is interleaved in the log. Tasks that run
+for longer than "--timeout" seconds are killed, along with any processes they
+started, and treated as failed. Shell tasks are launched with the same
+environment variables as the C implementation: TASKFARMER_TASK_ID (the global
+task index, counted in the "TASKS.id" file alongside the task file, as in C),
+TASKFARMER_RANK, TASKFARMER_LOCAL_RANK (the index of the process on its node),
+TASKFARMER_SLOT (the slot index), TASKFARMER_ATTEMPT (the number of previous
+failed attempts, so 0 for the first), TASKFARMER_COPY (always 0), and
+TASKFARMER_NODE (the name of the node).
+
+The "--ledger" option appends a line to a completion ledger as each task
+finishes (after any retries), of the form
+
+    TAG STATUS RANK ELAPSED COMMAND
+
+where TAG is taken from a trailing "#tf:TAG" comment on the task ("-" if
+there isn't one), STATUS is the exit status of the task (128 plus the signal
+number if it was killed, or -1 if it was disallowed), and ELAPSED is the wall
+time in seconds. The format is shared with the C implementation.
+
+This file can also be imported as a module, providing a Farm object that lets
+Python programs submit tasks to a running farm and wait for their results,
+e.g.
+
+    from taskfarmer import Farm
+
+    with Farm('tasks.txt', ledger='tasks.txt.ledger') as farm:
+        futures = farm.map('./simulate --seed {seed}',
+            [{'seed': seed} for seed in range(100)])
+
+        for future in farm.as_completed():
+            result = future.result()
+            print(result.command, result.status, result.elapsed)
+
+Tasks are appended to the task file under its lock, tagged so that their
+completions can be found in the ledger. A background thread follows the ledger
+and resolves the future of each task as soon as its line appears, so the farm
+must be run with "--ledger", and "--wait-on-idle" if tasks are submitted over
+time. The thread is woken by inotify when a process on the same node writes to
+the ledger, and otherwise checks it every "poll_interval" seconds (default 0.5),
+which is how completions written from other nodes of a network file system are
+seen. Both the C and Python farmers can be used. The "queue_backend" and
+"lock_type" given to Farm must match those of the farm: the "rewrite" and
+"cursor" backends lock the task file itself, and "journal" locks its guard file
+(e.g. tasks.txt.guard). The "fcntl" (default) and "ofd" lock types are both
+taken as POSIX record locks, which conflict with open file description locks,
+and "flock" takes a BSD lock. The "gzip" backend and "lockfile" locks aren't
+supported, use taskfarmer-append for those.
+
 As an example, try running the following:
 
     shuf tests/commands.txt | head -n 100 > tasks.txt
@@ -141,16 +269,38 @@ Words of caution:
 
 from __future__ import print_function
 
-from fcntl import flock, LOCK_EX, LOCK_UN
-from mpi4py import MPI
-from subprocess import PIPE, Popen
+from fcntl import lockf, LOCK_EX, LOCK_UN
+from collections import deque
+from concurrent.futures import Future, ThreadPoolExecutor
+from concurrent.futures import as_completed as futures_as_completed
+from subprocess import PIPE, STDOUT, Popen
 
 import argparse
+import itertools
+import ast
+import asyncio
+import ctypes
+import fcntl
+import importlib
+import multiprocessing
+import os
+import re
+import resource
+import select
+import signal
+import socket
 import sys
+import threading
 import time
+import traceback
+
+# environment variables holding the process rank, by launcher
+rank_variables = ['OMPI_COMM_WORLD_RANK', 'PMI_RANK', 'PMIX_RANK',
+    'MV2_COMM_WORLD_RANK', 'SLURM_PROCID', 'ALPS_APP_PE']
 
-# process rank
-rank = MPI.COMM_WORLD.Get_rank()
+# environment variables that hold the index of a process on its node
+local_rank_variables = ['OMPI_COMM_WORLD_LOCAL_RANK', 'MPI_LOCALRANKID',
+    'MV2_COMM_WORLD_LOCAL_RANK', 'SLURM_LOCALID']
 
 # validate positive, non-zero arguments
 class validate_argument(argparse.Action):
@@ -160,31 +310,6 @@ class validate_argument(argparse.Action):
 
         setattr(namespace, self.dest, values)
 
-# create argument parser object
-parser = argparse.ArgumentParser(description=
-    'A simple Python task farmer for running serial tasks with mpirun.')
-
-# parse command-line options
-parser.add_argument('-f','--file', type=str,
-    help='location of task file', required=True)
-parser.add_argument('-v','--verbose', action='store_true',
-    help='enable verbose mode', default=False)
-parser.add_argument('-w','--wait-on-idle', action='store_true',
-    help='wait for more tasks when idle', default=False)
-parser.add_argument('-r','--retry', action='store_true',
-    help='retry failed tasks', default=False)
-parser.add_argument('-s','--sleep-time', action=validate_argument, type=int,
-    help='sleep duration when idle (seconds)', default=300)
-parser.add_argument('-m','--max-retries', action=validate_argument, type=int,
-    help='maximum times to retry failed tasks', default=10)
-parser.add_argument('-d','--disallowed', nargs='*',
-    help='disallowed commands', default=['rm'])
-args = parser.parse_args()
-
-# only attempt to launch tasks once if retry option is unset
-if not args.retry:
-    max_retries = 1
-
 # check if command is valid
 def is_allowed(task):
     # check command isn't empty string
@@ -196,7 +321,7 @@ def is_allowed(task):
         return False, "null character present"
 
     # check command isn't empty
-    if len(task) is 0:
+    if len(task) == 0:
         return False, "task string has zero length"
 
     # check all disallowed commands
@@ -210,89 +335,776 @@ def is_allowed(task):
 
     return True, "no error"
 
-# loop indefinitely
-while True:
+# parse a Python task of the form py:MODULE:FUNCTION(ARGUMENTS)
+def parse_python_task(task):
+    try:
+        _, module, call = task.split(':', 2)
+        node = ast.parse(call.strip(), mode='eval').body
+
+        # a bare function name takes no arguments
+        if not isinstance(node, ast.Call):
+            node = ast.Call(func=node, args=[], keywords=[])
+
+        function = ast.unparse(node.func)
+        positional = [ast.literal_eval(a) for a in node.args]
+        keywords = {k.arg: ast.literal_eval(k.value) for k in node.keywords}
+    except (ValueError, SyntaxError) as e:
+        raise ValueError("invalid Python task: %s (%s)" % (task, e))
+
+    return module, function, positional, keywords
+
+# main loop of the Python task worker
+def python_worker(connection, preload, output):
+    # send output to the log, or discard it
+    os.dup2(output.fileno(), 1)
+    os.dup2(output.fileno(), 2)
+
+    for module in preload:
+        importlib.import_module(module)
+
+    while True:
+        request = connection.recv()
+        if request is None:
+            break
+
+        module, function, positional, keywords = request
+
+        try:
+            target = importlib.import_module(module)
+            for name in function.split('.'):
+                target = getattr(target, name)
+
+            result = target(*positional, **keywords)
+
+            if result is None or result is True:
+                rc = 0
+            elif result is False:
+                rc = 1
+            else:
+                rc = int(result)
+
+            message = ''
+        except SystemExit as e:
+            rc = e.code if isinstance(e.code, int) else 1
+            message = ''
+        except BaseException:
+            rc = 1
+            message = traceback.format_exc()
+
+        sys.stdout.flush()
+        sys.stderr.flush()
+
+        # peak memory use in MB
+        memory = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024
+
+        connection.send((rc, message, memory))
+
+# a long-lived process for running Python tasks, recycled to contain leaks
+class PythonWorker(object):
+    def __init__(self):
+        self.process = None
+
+    def start(self):
+        self.connection, child = multiprocessing.Pipe()
+        context = multiprocessing.get_context('fork')
+        self.process = context.Process(target=python_worker,
+            args=(child, args.py_preload, log))
+        self.process.daemon = True
+        self.process.start()
+        child.close()
+        self.num_tasks = 0
+
+    def stop(self):
+        if self.process is not None:
+            try:
+                self.connection.send(None)
+            except (BrokenPipeError, OSError):
+                pass
+            self.process.join(5)
+            if self.process.is_alive():
+                self.process.kill()
+            self.connection.close()
+            self.process = None
+
+    def kill(self):
+        if self.process is not None:
+            self.process.kill()
+
+    def run(self, task):
+        try:
+            request = parse_python_task(task)
+        except ValueError as e:
+            return 1, str(e).encode()
+
+        if self.process is None:
+            self.start()
+
+        # the worker died while running the task
+        try:
+            self.connection.send(request)
+            rc, message, memory = self.connection.recv()
+        except (EOFError, OSError):
+            self.stop()
+            return 1, b'Python task worker exited unexpectedly'
+
+        self.num_tasks += 1
+
+        # recycle the worker
+        if (self.num_tasks >= args.py_max_tasks or
+            (args.py_max_memory is not None and memory > args.py_max_memory)):
+            self.stop()
+
+        return rc, message.encode()
+
+# run a task, returning its exit status and the tail of its output
+async def run_task(task, task_id, slot, attempt):
+    if args.output == 'log':
+        log.write(("### Rank %04d: %s\n" % (rank, task)).encode())
+        log.flush()
+
+    timed_out = b'Task timed out after %d seconds' % (args.timeout or 0)
+
+    # run Python tasks in this slot's worker process
+    if task.startswith('py:'):
+        run = asyncio.get_running_loop().run_in_executor(None,
+            workers[slot].run, task)
+
+        try:
+            return await asyncio.wait_for(asyncio.shield(run), args.timeout)
+        except asyncio.TimeoutError:
+            workers[slot].kill()
+            await run
+            return 1, timed_out
+
+    # identify the task, process, slot, and attempt to the task
+    env = dict(os.environ, TASKFARMER_TASK_ID=str(task_id),
+        TASKFARMER_RANK=str(rank), TASKFARMER_LOCAL_RANK=str(local_rank),
+        TASKFARMER_SLOT=str(slot), TASKFARMER_ATTEMPT=str(attempt),
+        TASKFARMER_COPY='0', TASKFARMER_NODE=node)
+
+    # output is written directly to the log (or discarded), or piped back
+    output = PIPE if args.output == 'tail' else log
+
+    child = await asyncio.create_subprocess_shell(task, stdout=output,
+        stderr=STDOUT, env=env, start_new_session=True)
+
+    tail = deque()
+    limit = 1024*args.tail_size
+
+    # keep a bounded tail of the merged output
+    async def wait():
+        length = 0
+
+        if output == PIPE:
+            while True:
+                chunk = await child.stdout.read(65536)
+                if not chunk:
+                    break
+
+                tail.append(chunk)
+                length += len(chunk)
+
+                while length - len(tail[0]) >= limit:
+                    length -= len(tail.popleft())
+
+        return await child.wait()
+
+    try:
+        rc = await asyncio.wait_for(wait(), args.timeout)
+    except asyncio.TimeoutError:
+        # kill the shell and anything it started
+        os.killpg(child.pid, signal.SIGKILL)
+        rc = await child.wait()
+        tail.append(b'\n' + timed_out if tail else timed_out)
+
+    return rc, b''.join(tail)[-limit:]
+
+# claim the first task by rewriting the task file without it
+def claim_task_rewrite(f):
+    # read first task and the remaining tasks
+    task = f.readline()
+
+    if not task:
+        return None
+
+    remaining = f.read()
+
+    # rewind to beginning of file and write remaining tasks
+    f.seek(0)
+    f.truncate()
+    f.write(remaining)
+
+    # ensure buffer is flushed before unlocking
+    f.flush()
+
+    return task.rstrip(b'\n').decode()
+
+# read the byte offset of the next unclaimed task
+def read_queue_offset(fd):
+    data = os.pread(fd, 32, 0).split()
+    return int(data[0]) if data else 0
+
+# write the byte offset of the next unclaimed task
+def write_queue_offset(fd, offset):
+    # the offset only shrinks when it is reset
+    if offset == 0:
+        os.ftruncate(fd, 0)
+    os.pwrite(fd, b'%d\n' % offset, 0)
+
+# claim the task at the queue offset and advance the offset
+def claim_task_cursor(f):
+    fd = os.open(offset_file, os.O_RDWR | os.O_CREAT, 0o644)
+
+    try:
+        offset = read_queue_offset(fd)
+        size = os.fstat(f.fileno()).st_size
+
+        # the task file has been truncated
+        if offset > size:
+            offset = 0
+
+        # all tasks have been claimed, reclaim the space
+        if offset == size:
+            if offset > 0:
+                f.truncate(0)
+                write_queue_offset(fd, 0)
+            return None
+
+        # read the next task
+        f.seek(offset)
+        task = f.readline()
+        write_queue_offset(fd, offset + len(task))
+
+        return task.rstrip(b'\n').decode()
+    finally:
+        os.close(fd)
+
+# claim the next global task index from the counter file (as in C)
+def next_task_id():
+    fd = os.open(id_file, os.O_RDWR | os.O_CREAT, 0o644)
+
+    try:
+        data = os.pread(fd, 32, 0).split()
+        task_id = int(data[0]) if data else 0
+
+        # the counter only ever grows in length
+        os.pwrite(fd, b'%d\n' % (task_id + 1), 0)
+
+        return task_id
+    finally:
+        os.close(fd)
+
+# get the rank of this process from the launcher's environment variables
+def environment_rank():
+    for variable in rank_variables:
+        if variable in os.environ:
+            return int(os.environ[variable])
+
+    sys.exit("Error: cannot determine rank from environment, set one of: %s"
+        % ", ".join(rank_variables))
+
+# get the index of this process on its node, assuming a single node if the
+# launcher doesn't say
+def environment_local_rank(process_rank):
+    for variable in local_rank_variables:
+        if variable in os.environ:
+            return int(os.environ[variable])
+
+    return process_rank
+
+# open and lock the task file, and claim the next task and its index
+def claim_next_task():
     # try to open the task file
     try:
-        f = open(args.file, 'r+')
+        f = open(args.file, 'rb+')
     except IOError:
         if rank == 0:
             raise
         else:
-            sys.exit()
+            return None
 
     # lock file
-    flock(f, LOCK_EX)
+    lockf(f, LOCK_EX)
 
-    # read file into task list
-    tasks = f.readlines()
+    # claim the next task
+    try:
+        if args.queue_backend == 'cursor':
+            task = claim_task_cursor(f)
+        else:
+            task = claim_task_rewrite(f)
 
-    # work out number of tasks
-    num_tasks = len(tasks)
+        # the index is assigned under the task file lock
+        return None if task is None else (task, next_task_id())
+    finally:
+        # unlock and close file
+        lockf(f, LOCK_UN)
+        f.close()
 
-    # check that there are tasks to process
-    if num_tasks > 0:
-        # pop first task off task list
-        task = tasks.pop(0).strip('\n')
+# claim and run tasks in one slot until the task file is empty
+async def run_slot(slot, claims):
+    loop = asyncio.get_running_loop()
 
-        # rewind to beginning of file
-        f.seek(0)
-        f.truncate()
+    # loop indefinitely
+    while True:
+        # claims are made one at a time since threads share the file lock
+        claimed = await loop.run_in_executor(claims, claim_next_task)
 
-        # write remaining task list to file
-        f.writelines(tasks)
+        # check that there are tasks to process
+        if claimed is None:
+            if args.wait_on_idle:
+                # sleep for wait period
+                if args.verbose:
+                    print("Rank %04d" %rank, "slot %d" % slot,
+                        "waiting for more tasks")
 
-        # ensure buffer is flushed before unlocking
-        f.flush()
+                await asyncio.sleep(args.sleep_time)
+                continue
+            else:
+                return
 
-        # unlock and close file
-        flock(f, LOCK_UN)
-        f.close()
-
-        # zero attempts
-        attempts = 0
+        task, task_id = claimed
 
         # check that task is allowed
         allowed, error = is_allowed(task)
-        if allowed:
-            if args.verbose:
-                print("Rank %04d" %rank, "launching:", task)
+        if not allowed:
+            print("Warning:", error)
+            record_completion(task, -1, 0)
+            continue
 
-            # attempt to execute task as a subprocess
-            child = Popen(task, shell=True, stdout=PIPE, stderr=PIPE)
-            streamdata = child.communicate()[0]
-            rc = child.returncode
+        if args.verbose:
+            print("Rank %04d" %rank, "launching:", task)
 
-            while attempts < args.max_retries and rc != 0:
-                attempts += 1
-                if args.verbose:
-                    if args.retry:
-                        print("Warning: system command failed:", task,
-                            "(%d/%d)" % (attempts, args.max_retries))
-                    else:
-                        print("Warning: system command failed:", task)
-        else:
-            print("Warning:", error)
+        start = time.time()
 
-    else:
-        if args.wait_on_idle:
-            # sleep for wait period
-            if args.verbose:
-                print("Rank %04d" %rank, "waiting for more tasks")
+        # attempt to execute task as a subprocess, retrying on failure
+        for attempts in range(1, max_retries+1):
+            rc, tail = await run_task(task, task_id, slot, attempts - 1)
 
-            # unlock and close file
-            flock(f, LOCK_UN)
-            f.close()
+            if rc == 0:
+                break
 
-            # sleep
-            time.sleep(args.sleep_time)
-        else:
-            # all tasks launched, clean up and exit
             if args.verbose:
-                print("Task file is empty: Rank %04d" %rank, "exiting")
+                if args.retry:
+                    print("Warning: system command failed:", task,
+                        "(%d/%d)" % (attempts, max_retries))
+                else:
+                    print("Warning: system command failed:", task)
+
+            # report the end of the output for diagnostics
+            if tail:
+                print("Rank %04d" % rank, "output tail:")
+                print(tail.decode(errors='replace'))
+
+        # killed tasks are reported as the shell would
+        record_completion(task, rc if rc >= 0 else 128 - rc, time.time() - start)
+
+# run all of the slots of this process
+async def run_slots():
+    with ThreadPoolExecutor(1) as claims:
+        await asyncio.gather(*(run_slot(slot, claims)
+            for slot in range(args.slots)))
+
+# claim and run tasks until the task file is empty
+def farm(process_rank, process_local_rank, node_name):
+    global rank, local_rank, node, log
+
+    rank = process_rank
+    local_rank = process_local_rank
+    node = node_name
+
+    # where task output goes
+    if args.output == 'log':
+        log = open(os.path.join(args.log_dir, 'taskfarmer.%04d.log' % rank), 'ab')
+    else:
+        log = open(os.devnull, 'wb')
+
+    asyncio.run(run_slots())
+
+    # all tasks launched, clean up and exit
+    if args.verbose:
+        print("Task file is empty: Rank %04d" %rank, "exiting")
+
+    # shut down the Python task workers
+    for worker in workers:
+        worker.stop()
+
+    # exit
+    sys.exit()
 
-            # unlock and close file
-            flock(f, LOCK_UN)
+# the tag of a task, given as a trailing #tf:TAG comment
+def task_tag(task):
+    match = re.search(r'#tf:(\S+)\s*$', task)
+    return match.group(1) if match else None
+
+# append a line for a finished task to the completion ledger
+def record_completion(task, status, elapsed):
+    if args.ledger is None:
+        return
+
+    line = "%s %d %d %.3f %s\n" % (task_tag(task) or '-', status, rank,
+        elapsed, task)
+
+    # a single append, so that lines from different processes don't mix
+    fd = os.open(args.ledger, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o644)
+    try:
+        os.write(fd, line.encode())
+    finally:
+        os.close(fd)
+
+# the outcome of a task, as recorded in the completion ledger
+class TaskResult(object):
+    def __init__(self, tag, status, rank, elapsed, command):
+        self.tag = tag
+        self.status = status
+        self.rank = rank
+        self.elapsed = elapsed
+        self.command = command
+
+    @property
+    def ok(self):
+        return self.status == 0
+
+    def __repr__(self):
+        return "TaskResult(tag=%r, status=%d, rank=%d, elapsed=%.3f, command=%r)" \
+            % (self.tag, self.status, self.rank, self.elapsed, self.command)
+
+# inotify events that show a file in a watched directory has changed
+IN_MODIFY, IN_MOVED_TO, IN_CREATE = 0x2, 0x80, 0x100
+
+# watch a directory for changes, returning an inotify file descriptor (or
+# None if inotify isn't available)
+def watch_directory(path):
+    try:
+        libc = ctypes.CDLL(None, use_errno=True)
+        fd = libc.inotify_init1(os.O_NONBLOCK | os.O_CLOEXEC)
+    except (OSError, AttributeError):
+        return None
+
+    if fd == -1:
+        return None
+
+    if libc.inotify_add_watch(fd, os.fsencode(path),
+            IN_MODIFY | IN_MOVED_TO | IN_CREATE) == -1:
+        os.close(fd)
+        return None
+
+    return fd
+
+# submit tasks to a running farm and wait for their results
+class Farm(object):
+    def __init__(self, task_file, ledger=None, queue_backend='rewrite',
+            lock_type='fcntl', poll_interval=0.5):
+        if queue_backend not in ('rewrite', 'cursor', 'journal'):
+            raise ValueError("unsupported queue backend: %r" % queue_backend)
+        if lock_type not in ('fcntl', 'ofd', 'flock'):
+            raise ValueError("unsupported lock type: %r" % lock_type)
+
+        self.task_file = task_file
+        self.ledger = ledger if ledger is not None else task_file + '.ledger'
+        self.queue_backend = queue_backend
+        self.lock_type = lock_type
+        self.poll_interval = poll_interval
+
+        self.futures = {}
+        self.pending = set()
+        self.num_submitted = 0
+        self.num_failed = 0
+        self.elapsed = 0.0
+        self.lock = threading.Lock()
+
+        # tags are unique to this Farm object
+        self.prefix = '%s.%d.%x' % (socket.gethostname(), os.getpid(), id(self))
+        self.counter = itertools.count()
+
+        # only completions recorded from now on are of interest
+        try:
+            self.position = os.path.getsize(self.ledger)
+        except OSError:
+            self.position = 0
+
+        # woken by changes to the ledger, or by close()
+        self.watch_fd = watch_directory(
+            os.path.dirname(os.path.abspath(self.ledger)))
+        self.wake_fds = os.pipe()
+
+        self.stopped = threading.Event()
+        self.thread = threading.Thread(target=self.follow_ledger)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    # submit a single task, returning a future for its TaskResult
+    def submit(self, command, **meta):
+        return self.submit_many([(command, meta)])[0]
+
+    # submit a task for each set of parameters, formatted into the template
+    def map(self, template, params):
+        tasks = []
+        for p in params:
+            if isinstance(p, dict):
+                tasks.append((template.format(**p), {'params': p}))
+            elif isinstance(p, (tuple, list)):
+                tasks.append((template.format(*p), {'params': p}))
+            else:
+                tasks.append((template.format(p), {'params': p}))
+
+        return self.submit_many(tasks)
+
+    # append tasks to the task file in a single locked write
+    def submit_many(self, tasks):
+        futures = []
+        lines = []
+
+        for command, meta in tasks:
+            if '\n' in command:
+                raise ValueError("task contains a newline: %r" % command)
+
+            tag = '%s.%d' % (self.prefix, next(self.counter))
+
+            future = Future()
+            future.tag = tag
+            future.command = command
+            future.meta = meta
+
+            futures.append(future)
+            lines.append('%s #tf:%s\n' % (command, tag))
+
+        # register the futures first, the tasks may finish very quickly
+        with self.lock:
+            for future in futures:
+                self.futures[future.tag] = future
+                self.pending.add(future)
+            self.num_submitted += len(futures)
+
+        self.append(''.join(lines).encode())
+
+        return futures
+
+    # append to the task file while holding the lock taken by the farm
+    def append(self, data):
+        # the journal backend replaces the task file, so locks a guard file
+        if self.queue_backend == 'journal':
+            lock = os.open(self.task_file + '.guard', os.O_RDWR | os.O_CREAT,
+                0o644)
+        else:
+            lock = os.open(self.task_file, os.O_WRONLY | os.O_CREAT, 0o644)
+
+        try:
+            if self.lock_type == 'flock':
+                fcntl.flock(lock, fcntl.LOCK_EX)
+            else:
+                lockf(lock, LOCK_EX)
+
+            fd = os.open(self.task_file, os.O_WRONLY | os.O_APPEND | os.O_CREAT,
+                0o644)
+            try:
+                os.write(fd, data)
+
+                # journal claims are made durable, so appends are too
+                if self.queue_backend == 'journal':
+                    os.fsync(fd)
+            finally:
+                os.close(fd)
+        finally:
+            # closing the lock descriptor releases the lock
+            os.close(lock)
+
+    # iterate over futures as they complete (by default all pending futures)
+    def as_completed(self, futures=None, timeout=None):
+        if futures is None:
+            with self.lock:
+                futures = list(self.pending)
+
+        return futures_as_completed(futures, timeout)
+
+    # summary of the tasks submitted through this object
+    def stats(self):
+        with self.lock:
+            completed = self.num_submitted - len(self.pending)
+            return {
+                'submitted': self.num_submitted,
+                'completed': completed,
+                'failed': self.num_failed,
+                'pending': len(self.pending),
+                'mean_elapsed': self.elapsed / completed if completed else 0.0,
+            }
+
+    # stop following the ledger
+    def close(self):
+        if self.stopped.is_set():
+            return
+
+        self.stopped.set()
+        os.write(self.wake_fds[1], b'\0')
+        self.thread.join()
+
+        for fd in self.wake_fds:
+            os.close(fd)
+        if self.watch_fd is not None:
+            os.close(self.watch_fd)
+
+    # wait for the ledger to change, or for the poll interval to pass
+    def wait_for_ledger(self):
+        if self.watch_fd is None:
+            self.stopped.wait(self.poll_interval)
+            return
+
+        ready = select.select([self.watch_fd, self.wake_fds[0]], [], [],
+            self.poll_interval)[0]
+
+        # discard the events, the ledger is checked whatever changed
+        if self.watch_fd in ready:
+            try:
+                while os.read(self.watch_fd, 4096):
+                    pass
+            except BlockingIOError:
+                pass
+
+    # resolve the futures of finished tasks until the Farm is closed
+    def follow_ledger(self):
+        self.partial = b''
+
+        while not self.stopped.is_set():
+            self.read_ledger()
+            self.wait_for_ledger()
+
+    # read new ledger lines and resolve the futures of finished tasks
+    def read_ledger(self):
+        try:
+            size = os.path.getsize(self.ledger)
+        except OSError:
+            return
+
+        # the ledger was replaced
+        if size < self.position:
+            self.position = 0
+            self.partial = b''
+
+        if size == self.position:
+            return
+
+        with open(self.ledger, 'rb') as f:
+            f.seek(self.position)
+            data = f.read(size - self.position)
+
+        self.position += len(data)
+        lines = (self.partial + data).split(b'\n')
+        self.partial = lines.pop()
+
+        for line in lines:
+            self.resolve(line.decode(errors='replace'))
+
+    # resolve the future for a single ledger line
+    def resolve(self, line):
+        fields = line.split(' ', 4)
+        if len(fields) < 5:
+            return
+
+        with self.lock:
+            future = self.futures.pop(fields[0], None)
+            if future is None:
+                return
+
+            result = TaskResult(fields[0], int(fields[1]), int(fields[2]),
+                float(fields[3]), future.command)
+
+            self.pending.discard(future)
+            self.elapsed += result.elapsed
+            if not result.ok:
+                self.num_failed += 1
+
+        future.set_result(result)
+
+# parse the command-line and start farming
+def main():
+    global args, max_retries, offset_file, id_file, workers
+
+    # create argument parser object
+    parser = argparse.ArgumentParser(description=
+        'A simple Python task farmer for running serial tasks with mpirun.')
+
+    # parse command-line options
+    parser.add_argument('-f','--file', type=str,
+        help='location of task file', required=True)
+    parser.add_argument('-v','--verbose', action='store_true',
+        help='enable verbose mode', default=False)
+    parser.add_argument('-w','--wait-on-idle', action='store_true',
+        help='wait for more tasks when idle', default=False)
+    parser.add_argument('-r','--retry', action='store_true',
+        help='retry failed tasks', default=False)
+    parser.add_argument('-s','--sleep-time', action=validate_argument, type=int,
+        help='sleep duration when idle (seconds)', default=300)
+    parser.add_argument('-m','--max-retries', action=validate_argument, type=int,
+        help='maximum times to retry failed tasks', default=10)
+    parser.add_argument('-d','--disallowed', nargs='*',
+        help='disallowed commands', default=['rm'])
+    parser.add_argument('-q','--queue-backend', choices=['rewrite','cursor'],
+        help='how tasks are removed from the task file', default='rewrite')
+    parser.add_argument('-o','--output', choices=['discard','log','tail'],
+        help='how the output of tasks is handled', default='discard')
+    parser.add_argument('-l','--log-dir', type=str,
+        help='directory for per-rank task logs', default='.')
+    parser.add_argument('-t','--tail-size', action=validate_argument, type=int,
+        help='size of the output tail kept for failed tasks (KB)', default=64)
+    parser.add_argument('-p','--py-preload', nargs='*',
+        help='modules imported by the Python task worker at start', default=[])
+    parser.add_argument('-n','--py-max-tasks', action=validate_argument, type=int,
+        help='Python tasks run before the worker is recycled', default=100)
+    parser.add_argument('-M','--py-max-memory', action=validate_argument, type=int,
+        help='worker memory (MB) above which it is recycled', default=None)
+    parser.add_argument('-L','--launcher', choices=['mpi','env','local'],
+        help='how the rank of each process is determined', default='mpi')
+    parser.add_argument('-W','--local-workers', action=validate_argument, type=int,
+        help='number of processes to run with the local launcher',
+        default=os.cpu_count())
+    parser.add_argument('-S','--slots', action=validate_argument, type=int,
+        help='number of tasks each process runs at once', default=1)
+    parser.add_argument('-T','--timeout', action=validate_argument, type=int,
+        help='time limit for each task (seconds)', default=None)
+    parser.add_argument('-g','--ledger', type=str,
+        help='file to which task completions are appended', default=None)
+    args = parser.parse_args()
+
+    # only attempt to launch tasks once if retry option is unset
+    max_retries = args.max_retries if args.retry else 1
+
+    # location of the queue offset (cursor backend only)
+    offset_file = args.file + '.offset'
+
+    # location of the global task index counter
+    id_file = args.file + '.id'
+
+    # one worker per slot
+    workers = [PythonWorker() for slot in range(args.slots)]
+
+    # determine the rank of each process and start farming
+    if args.launcher == 'local':
+        # fork one process per worker, the parent only waits
+        context = multiprocessing.get_context('fork')
+        processes = [context.Process(target=farm,
+            args=(i, i, socket.gethostname()))
+            for i in range(args.local_workers)]
+
+        for process in processes:
+            process.start()
+        for process in processes:
+            process.join()
+
+        sys.exit(max(abs(process.exitcode) for process in processes))
+    elif args.launcher == 'env':
+        process_rank = environment_rank()
+        farm(process_rank, environment_local_rank(process_rank),
+            socket.gethostname())
+    else:
+        from mpi4py import MPI
+        node_comm = MPI.COMM_WORLD.Split_type(MPI.COMM_TYPE_SHARED)
+        farm(MPI.COMM_WORLD.Get_rank(), node_comm.Get_rank(),
+            MPI.Get_processor_name())
 
-            # exit
-            sys.exit()
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,6300 @@
+/*
+  Copyright (c) 2013, 2014 Lester Hedges <lester.hedges@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  libtaskfarmer: the scheduling logic of TaskFarmer as a library.
+  See taskfarmer.h for the interface and taskfarmer.c for documentation.
+*/
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <mpi.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "taskfarmer.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// the io_uring engine is built when the kernel headers are available
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// names of the lock types, indexed by lock type
+const char *lock_type_names[] = { "fcntl", "ofd", "flock", "lockfile", NULL };
+
+// the type of lock used for all file locking
+static int file_lock_type = LOCK_TYPE_FCNTL;
+
+// names of the task file formats, indexed by format
+const char *task_format_names[] = { "line", "argv0", NULL };
+
+// the format of the tasks in the task file
+static int task_format = TASK_FORMAT_LINE;
+
+// names of the I/O engines, indexed by I/O engine
+const char *io_engine_names[] = { "sync", "uring", NULL };
+
+#ifdef HAVE_IO_URING
+// the io_uring submission and completion rings of this process (fd is -1 if
+// the engine isn't in use)
+static struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    char *buffers[IO_URING_ENTRIES];    // buffers of asynchronous writes in flight
+} ring = { .fd = -1 };
+#endif
+
+// the file locks held by this process (path is empty if the slot is free), so
+// that lock files can be kept fresh, and locks released if an entry point fails
+static struct
+{
+    char path[1024 + 8];                // path to the locked file
+    int fd;                             // locked file descriptor
+    int lock_fd;                        // lock file descriptor (lockfile lock type, otherwise -1)
+    struct flock fl;
+} held_locks[MAX_HELD_LOCKS];
+static pthread_mutex_t held_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// window holding the fair lock queue (MPI_WIN_NULL if not in use)
+static MPI_Win fair_lock_win = MPI_WIN_NULL;
+static volatile int *fair_lock_state;
+
+// the header of a tombstone file, which is followed by the tombstones
+typedef struct
+{
+    long long num_entries;
+    unsigned long long generation;      // changes each time the file is replaced
+} tombstone_header;
+
+#define TOMBSTONE_ENTRIES(data) ((tombstone *) ((data) + sizeof(tombstone_header)))
+
+// tombstones of the tasks cancelled with taskfarmer-cancel (path is empty if not in use)
+static struct
+{
+    char path[1024 + 8];
+    char *data;                         // contents of the tombstone file
+    tombstone *entries;                 // sorted by hash, then length
+    long long num_entries;
+    unsigned long long generation;      // of the tombstone file that was read (0 if none)
+    double last_check;                  // wall time of the last check for changes
+    bool kill_running;                  // terminate running tasks with TOMBSTONE_SIGNAL
+} tombstones;
+
+// cancellation messages received for tasks other than the one being waited for
+static long long *pending_cancellations = NULL;
+static int num_pending_cancellations = 0;
+
+// shared objects opened by plugin tasks
+static struct
+{
+    char *path;
+    void *handle;
+} *plugin_libraries = NULL;
+static int num_plugin_libraries = 0;
+
+// the best queue backend and lock type for each known file system
+static const struct
+{
+    unsigned long magic;
+    const char *name;
+    const char *queue_backend;
+    const char *lock_type;
+} file_systems[] =
+{
+    { FS_MAGIC_TMPFS,  "tmpfs",  "cursor", "ofd"      },
+    { FS_MAGIC_EXT4,   "ext4",   "cursor", "ofd"      },
+    { FS_MAGIC_XFS,    "xfs",    "cursor", "ofd"      },
+    { FS_MAGIC_NFS,    "nfs",    "cursor", "fcntl"    },
+    { FS_MAGIC_LUSTRE, "lustre", "cursor", "fcntl"    },
+    { FS_MAGIC_GPFS,   "gpfs",   "cursor", "fcntl"    },
+    { FS_MAGIC_BEEGFS, "beegfs", "cursor", "lockfile" },
+    { 0,               NULL,     "rewrite", "fcntl"   }
+};
+
+// where errors return to while an entry point is running (NULL otherwise)
+static jmp_buf *error_return = NULL;
+
+static void release_held_locks(void);
+
+/* Give up after an error
+
+   Within taskfarmer_run() or taskfarmer_benchmark(), control returns to the
+   entry point, which releases this process's file locks and returns
+   TASKFARMER_ERROR, leaving the program embedding the library to decide what
+   to do (other processes may be waiting for this one, so usually
+   MPI_Abort()). Otherwise, e.g. in the standalone tools, the process exits.
+*/
+_Noreturn static void fail(void)
+{
+    if (error_return != NULL) longjmp(*error_return, 1);
+
+    MPI_Finalize();
+    exit(1);
+}
+
+/* Clean up after an error in an entry point
+
+   Only this process's resources are released, since the other processes
+   may be in the middle of collective operations. The fair lock window,
+   node communicator and combining queue, which must be freed collectively,
+   are left alone.
+
+   Arguments:
+
+     queue_backend *queue      pointer to the entry point's queue backend (or NULL)
+*/
+static void clean_up_after_error(queue_backend *queue)
+{
+    error_return = NULL;
+
+    release_held_locks();
+    close_io_engine();
+    close_tombstones();
+
+    if (queue != NULL)
+    {
+        if (queue->inner != NULL) queue = queue->inner;
+        queue->close(queue);
+    }
+}
+
+/* Set the default run-time options
+
+   Arguments:
+
+     taskfarmer_options *options
+                               pointer to run-time options
+*/
+void taskfarmer_default_options(taskfarmer_options *options)
+{
+    memset(options, 0, sizeof(*options));
+
+    options->sleep_time = 300;
+    options->max_retries = 10;
+    strcpy(options->queue_backend, "rewrite");
+    strcpy(options->lock_type, "fcntl");
+    strcpy(options->io_engine, "sync");
+    strcpy(options->format, "line");
+}
+
+/* Claim and run tasks from a task file until it is empty
+
+   Must be called collectively by all processes in MPI_COMM_WORLD. With the
+   "wait_on_idle" option set this function never returns.
+
+   Arguments:
+
+     const taskfarmer_options *options
+                               pointer to run-time options
+
+   Returns:
+
+     int                       0 once the task file is empty, 1 if the
+                               preflight check of the task file failed, or
+                               TASKFARMER_ERROR after an error (see fail())
+*/
+int taskfarmer_run(const taskfarmer_options *options)
+{
+    int state, status;
+    int rank, size;
+    int local_rank, name_length;
+    long long task_id;
+    double start;
+    char node_name[MPI_MAX_PROCESSOR_NAME];
+    MPI_Comm node_comm;
+    jmp_buf error_jump;
+
+    // the queue that tasks are claimed from
+    queue_backend *volatile queue = NULL;
+
+    // return errors to the caller
+    if (setjmp(error_jump))
+    {
+        clean_up_after_error(queue);
+        return TASKFARMER_ERROR;
+    }
+
+    error_return = &error_jump;
+
+    // only attempt to launch tasks once if retry option is unset
+    int max_retries = options->retry ? options->max_retries : 1;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);   // get current process id
+    MPI_Comm_size(MPI_COMM_WORLD, &size);   // get number of processes
+
+    // work out where this process lives
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &local_rank);
+    MPI_Get_processor_name(node_name, &name_length);
+
+    // initialize buffer pointers
+    char *system_command, *display;
+
+    // task environment (registered with putenv, so must outlive this call)
+    static task_environment task_env;
+
+    // resolve "auto" queue backend and lock type for the task file system
+    taskfarmer_options selected = *options;
+    select_queue_strategy(&selected, rank);
+
+    // argv0 records can't be published to the running task registry
+    if (strcmp(selected.format, "argv0") == 0 && selected.speculate > 0)
+    {
+        if (rank == 0) printf("[WARNING]: Speculation isn't supported for argv0 tasks\n");
+        selected.speculate = 0;
+    }
+
+    options = &selected;
+
+    set_lock_type(options->lock_type);
+    set_task_format(options->format);
+    if (options->fair_lock) init_fair_lock();
+
+    if (!set_io_engine(options->io_engine) && rank == 0)
+        printf("[WARNING]: I/O engine %s is unavailable, using plain system calls\n", options->io_engine);
+
+    queue = open_queue_backend(options->queue_backend, options->task_file);
+    queue_task task;
+
+    // let one process per node claim tasks for the others
+    if (options->combine) queue = open_combining_queue(queue, node_comm);
+
+    // compile the disallowed commands into a single automaton
+    command_matcher matcher;
+    build_command_matcher(&matcher, options->disallowed, options->num_disallowed);
+
+    // compressed task files can't be cleaned in place
+    if (options->preflight && strcmp(options->queue_backend, "gzip") == 0)
+    {
+        if (rank == 0) printf("[WARNING]: Preflight isn't supported for compressed task files\n");
+    }
+
+    // nor can argv0 records, which aren't shell commands
+    else if (options->preflight && strcmp(options->format, "argv0") == 0)
+    {
+        if (rank == 0) printf("[WARNING]: Preflight isn't supported for argv0 tasks\n");
+    }
+
+    // validate and clean the task file before any tasks are launched
+    else if (options->preflight && !preflight_task_file(options->task_file, rank, size, options->check_inputs,
+        queue->inner ? queue->inner : queue))
+    {
+        error_return = NULL;
+        free_fair_lock();
+        close_io_engine();
+        queue->close(queue);
+        MPI_Comm_free(&node_comm);
+        free_command_matcher(&matcher);
+        return 1;
+    }
+
+    // location of the running task registry (speculative mode only)
+    char running_file[1024 + 16];
+    snprintf(running_file, sizeof(running_file), "%s.running", options->task_file);
+
+    // clear any records left behind by a previous run
+    if (options->speculate > 0)
+    {
+        if (rank == 0 && unlink(running_file) == -1 && errno != ENOENT)
+        {
+            perror("[ERROR] unlink");
+            fail();
+        }
+
+        // copies of a task each write to their own scratch directory
+        init_scratch_directory(&task_env, options->task_file, rank);
+
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    // export the per-process part of the task environment
+    init_task_environment(&task_env, rank, local_rank, node_name);
+
+    // skip tasks cancelled with taskfarmer-cancel
+    open_tombstones(options->task_file, options->kill_cancelled);
+
+    // loop indefinitely
+    while (true)
+    {
+        // check that there are tasks to process
+        if (queue->claim(queue, 1, &task) == 1)
+        {
+            task_id = task.id;
+            system_command = task.command;
+            display = record_display(system_command);
+
+            // the task has been cancelled since it was added
+            if (consume_tombstone(queue, system_command))
+            {
+                if (options->verbose)
+                    printf("[INFO]: Rank %04d skipping cancelled task: %s\n", rank, display);
+
+                record_completion(options->ledger_file, display, TASK_CANCELLED, rank, 0);
+                queue->complete(queue, task_id, TASK_CANCELLED);
+
+                free(system_command);
+                free(display);
+                continue;
+            }
+
+            // make sure the task is allowed
+            if (!is_allowed(&matcher, display))
+            {
+                printf("[WARNING]: Rank %04d skipping disallowed task: %s\n", rank, display);
+                record_completion(options->ledger_file, display, -1, rank, 0);
+                queue->complete(queue, task_id, -1);
+
+                free(system_command);
+                free(display);
+                continue;
+            }
+
+            // report task launch
+            if (options->verbose)
+                printf("[INFO]: Rank %04d launching: %s\n", rank, display);
+
+            start = wall_time();
+
+            // run the task, publishing it so that idle processes can duplicate it
+            if (options->speculate > 0)
+            {
+                register_running_task(running_file, task_id, rank, system_command);
+                status = execute_task(system_command, task_id, 0, running_file, &task_env,
+                    rank, options->verbose, options->retry, max_retries);
+            }
+            else
+            {
+                status = execute_task(system_command, task_id, 0, NULL, &task_env,
+                    rank, options->verbose, options->retry, max_retries);
+            }
+
+            // a cancelled copy is recorded by the process that completed it
+            if (status >= 0 || status == TASK_CANCELLED)
+            {
+                record_completion(options->ledger_file, display, status, rank, wall_time() - start);
+                queue->complete(queue, task_id, status);
+            }
+
+            // free system command buffers
+            free(system_command);
+            free(display);
+        }
+
+        else
+        {
+            if (options->speculate > 0)
+            {
+                // look for a straggling task to duplicate
+                state = claim_straggler(running_file, rank, options->speculate, &task_id, &system_command);
+
+                if (state == 1)
+                {
+                    if (options->verbose)
+                        printf("[INFO]: Rank %04d duplicating task %lld: %s\n", rank, task_id, system_command);
+
+                    start = wall_time();
+                    status = execute_task(system_command, task_id, 1, running_file, &task_env,
+                        rank, options->verbose, options->retry, max_retries);
+
+                    // the copy finished first, so completes the task for the original
+                    if (status >= 0 || status == TASK_CANCELLED)
+                    {
+                        record_completion(options->ledger_file, system_command, status, rank, wall_time() - start);
+                        queue->complete(queue, task_id, status);
+                    }
+
+                    free(system_command);
+                    continue;
+                }
+
+                // other tasks are still running, check again shortly
+                else if (state == 0)
+                {
+                    progress_sleep(SPECULATE_POLL_TIME);
+                    continue;
+                }
+            }
+
+            if (options->wait_on_idle)
+            {
+                // report process wait
+                if (options->verbose)
+                    printf("[INFO]: Rank %04d waiting for more tasks\n", rank);
+
+                // sleep for wait period
+                progress_sleep(options->sleep_time);
+            }
+
+            else
+            {
+                // report that task file is empty
+                if (options->verbose)
+                    printf("[INFO]: Task file is empty: Rank %04d exiting\n", rank);
+
+                break;
+            }
+        }
+    }
+
+    // clean up
+    error_return = NULL;
+    free_fair_lock();
+    close_io_engine();
+    close_tombstones();
+    queue->close(queue);
+    MPI_Comm_free(&node_comm);
+    free_command_matcher(&matcher);
+
+    return 0;
+}
+
+/* Benchmark and check the current lock type
+
+   Each process repeatedly opens a scratch file, locks it, increments a
+   counter stored in it, then unlocks and closes it, as is done when tasks
+   are claimed. If the lock provides mutual exclusion across all processes
+   (including those on other nodes) no increments are lost. The time taken
+   to acquire the lock is reported.
+
+   Arguments:
+
+     const char *scratch_file  path to scratch file
+     long long num_cycles      number of times each process takes the lock
+
+   Returns:
+
+     bool                      whether no increments were lost
+*/
+static bool benchmark_lock_type(const char *scratch_file, long long num_cycles)
+{
+    int fd, rank;
+    bool correct;
+    ssize_t n;
+    long long i, counter, total_cycles;
+    double start, wait, total_wait = 0, max_wait = 0, sum_wait, longest_wait;
+    char buffer[32];
+    struct flock fl = { .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (rank == 0)
+    {
+        if ((fd = open(scratch_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        {
+            perror("[ERROR] open");
+            fail();
+        }
+        close(fd);
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    for (i=0;i<num_cycles;i++)
+    {
+        if ((fd = open(scratch_file, O_RDWR)) == -1)
+        {
+            perror("[ERROR] open");
+            fail();
+        }
+
+        fl.l_pid = getpid();
+
+        start = wall_time();
+        lock_file(&fl, fd, scratch_file);
+        wait = wall_time() - start;
+
+        total_wait += wait;
+        if (wait > max_wait) max_wait = wait;
+
+        // increment the counter
+        counter = 0;
+        if ((n = pread(fd, buffer, sizeof(buffer) - 1, 0)) > 0)
+        {
+            buffer[n] = '\0';
+            counter = atoll(buffer);
+        }
+
+        n = snprintf(buffer, sizeof(buffer), "%lld\n", counter + 1);
+        if (pwrite(fd, buffer, n, 0) != n)
+        {
+            perror("[ERROR] pwrite");
+            fail();
+        }
+
+        unlock_file(&fl, fd, scratch_file);
+        close(fd);
+    }
+
+    MPI_Reduce(&num_cycles, &total_cycles, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&total_wait, &sum_wait, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&max_wait, &longest_wait, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        fd = open(scratch_file, O_RDONLY);
+        counter = 0;
+
+        if (fd != -1 && (n = pread(fd, buffer, sizeof(buffer) - 1, 0)) > 0)
+        {
+            buffer[n] = '\0';
+            counter = atoll(buffer);
+        }
+
+        if (fd != -1) close(fd);
+
+        correct = (counter == total_cycles);
+
+        printf("[INFO]: Lock %s: mean acquire time %.1f us, max %.1f us, %lld/%lld updates kept (%s)\n",
+            lock_type_names[file_lock_type], 1e6 * sum_wait / total_cycles, 1e6 * longest_wait,
+            counter, total_cycles, correct ? "correct" : "NOT MUTUALLY EXCLUSIVE");
+    }
+
+    MPI_Bcast(&correct, 1, MPI_C_BOOL, 0, MPI_COMM_WORLD);
+
+    return correct;
+}
+
+#ifdef HAVE_ZLIB
+static void compress_task_file(const char*);
+#endif
+
+/* Benchmark and check a queue backend
+
+   The task file is overwritten with options->benchmark synthetic tasks,
+   which all processes then claim as fast as possible, in batches of one to
+   BENCHMARK_MAX_BATCH tasks. The backend passes if every task, and every
+   task index, is claimed exactly once, the queue is then empty, and a
+   requeued task can be claimed again. Each lock type is then benchmarked
+   with benchmark_lock_type(), with the benchmark failing if the selected
+   lock type doesn't provide mutual exclusion. Must be called collectively by
+   all processes in MPI_COMM_WORLD.
+
+   Arguments:
+
+     const taskfarmer_options *options
+                               pointer to run-time options
+
+   Returns:
+
+     int                       0 if the backend passed, 1 if it failed, or
+                               TASKFARMER_ERROR after an error (see fail())
+*/
+int taskfarmer_benchmark(const taskfarmer_options *options)
+{
+    int i, n, rank, size;
+    int failed = 0, num_batches = 0, errors[3];
+    bool allocated;
+    long long *counts, *total_counts = NULL;
+    long long j, index, num_tasks = options->benchmark;
+    long long num_claimed = 0, total_claimed, min_claimed, max_claimed;
+    double start, elapsed, max_elapsed;
+    char scratch_file[1024 + 16];
+    MPI_Comm node_comm;
+    FILE *f;
+    queue_task tasks[BENCHMARK_MAX_BATCH], task;
+    queue_backend *volatile queue = NULL;
+    taskfarmer_options selected = *options;
+    jmp_buf error_jump;
+
+    // return errors to the caller
+    if (setjmp(error_jump))
+    {
+        clean_up_after_error(queue);
+        return TASKFARMER_ERROR;
+    }
+
+    error_return = &error_jump;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    select_queue_strategy(&selected, rank);
+    options = &selected;
+
+    set_lock_type(options->lock_type);
+    if (options->fair_lock) init_fair_lock();
+    set_io_engine(options->io_engine);
+    queue = open_queue_backend(options->queue_backend, options->task_file);
+
+    if (options->combine)
+    {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+        queue = open_combining_queue(queue, node_comm);
+    }
+
+    // write the synthetic tasks and reset the sidecar files
+    if (rank == 0)
+    {
+        if ((f = fopen(options->task_file, "w")) == NULL)
+        {
+            perror("[ERROR] fopen");
+            fail();
+        }
+
+        for (j=0;j<num_tasks;j++) fprintf(f, "task %lld\n", j);
+
+        fclose(f);
+
+#ifdef HAVE_ZLIB
+        if (strcmp(options->queue_backend, "gzip") == 0) compress_task_file(options->task_file);
+#endif
+
+        unlink(queue->id_file);
+        unlink(queue->offset_file);
+        unlink(queue->journal_file);
+        unlink(queue->index_file);
+    }
+
+    // tasks and task indices claimed by this process (totalled on rank 0)
+    counts = calloc(2 * num_tasks, sizeof(long long));
+    if (rank == 0) total_counts = calloc(2 * num_tasks, sizeof(long long));
+
+    // every process gives up if any of them is out of memory
+    allocated = counts != NULL && (rank != 0 || total_counts != NULL);
+    if (!allocated) perror("[ERROR] calloc");
+
+    MPI_Allreduce(MPI_IN_PLACE, &allocated, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD);
+    if (!allocated)
+    {
+        free(counts);
+        free(total_counts);
+        fail();
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+
+    while ((n = queue->claim(queue, 1 + num_batches % BENCHMARK_MAX_BATCH, tasks)) > 0)
+    {
+        for (i=0;i<n;i++)
+        {
+            if (sscanf(tasks[i].command, "task %lld", &index) == 1 && index >= 0 && index < num_tasks)
+                counts[index]++;
+            if (tasks[i].id >= 0 && tasks[i].id < num_tasks)
+                counts[num_tasks + tasks[i].id]++;
+
+            queue->complete(queue, tasks[i].id, 0);
+            free(tasks[i].command);
+        }
+
+        num_claimed += n;
+        num_batches++;
+    }
+
+    elapsed = MPI_Wtime() - start;
+
+    // the counts are reduced in pieces, since MPI counts are ints
+    for (j=0;j<2*num_tasks;j+=n)
+    {
+        n = 2 * num_tasks - j < INT_MAX ? 2 * num_tasks - j : INT_MAX;
+        MPI_Reduce(counts + j, rank == 0 ? total_counts + j : NULL, n, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+    MPI_Reduce(&num_claimed, &total_claimed, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&num_claimed, &min_claimed, 1, MPI_LONG_LONG, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&num_claimed, &max_claimed, 1, MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        printf("[INFO]: Backend %s: %lld tasks claimed by %d processes in %.3f seconds (%.0f tasks/second)\n",
+            queue->name, total_claimed, size, max_elapsed, total_claimed / max_elapsed);
+        printf("[INFO]: Backend %s: tasks claimed per process: min %lld, max %lld\n",
+            queue->name, min_claimed, max_claimed);
+
+        for (j=0;j<num_tasks;j++)
+        {
+            if (total_counts[j] != 1)
+            {
+                printf("[ERROR]: Task %lld claimed %lld times\n", j, total_counts[j]);
+                failed = 1;
+                break;
+            }
+        }
+
+        for (j=0;j<num_tasks;j++)
+        {
+            if (total_counts[num_tasks + j] != 1)
+            {
+                printf("[ERROR]: Task index %lld assigned %lld times\n", j, total_counts[num_tasks + j]);
+                failed = 1;
+                break;
+            }
+        }
+
+        if (total_claimed != num_tasks)
+        {
+            printf("[ERROR]: %lld tasks claimed, expected %lld\n", total_claimed, num_tasks);
+            failed = 1;
+        }
+    }
+
+    // the remaining checks are made by every process, since with "--combine"
+    // tasks are claimed on behalf of all of the processes on a node
+    errors[0] = queue->size(queue) != 0;
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    // a requeued task can be claimed again, by a single process
+    task.id = 0;
+    task.command = "task requeued";
+    if (rank == 0) queue->requeue(queue, &task);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    errors[1] = queue->size(queue) != 1;
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if ((n = queue->claim(queue, 1, tasks)) == 1)
+    {
+        if (strcmp(tasks[0].command, task.command) != 0) errors[1] = 1;
+        free(tasks[0].command);
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, &n, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (n != 1) errors[1] = 1;
+
+    errors[2] = queue->size(queue) != 0 || queue->claim(queue, 1, tasks) != 0;
+
+    MPI_Allreduce(MPI_IN_PLACE, errors, 3, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        if (errors[0])
+        {
+            printf("[ERROR]: Queue is not empty after all tasks were claimed\n");
+            failed = 1;
+        }
+
+        if (errors[1])
+        {
+            printf("[ERROR]: Requeued task could not be claimed\n");
+            failed = 1;
+        }
+
+        if (errors[2])
+        {
+            printf("[ERROR]: Queue is not empty after the requeued task was claimed\n");
+            failed = 1;
+        }
+
+        printf("[INFO]: Backend %s: %s\n", queue->name, failed ? "FAILED" : "passed");
+    }
+
+    MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    // compare all of the lock types on this file system
+    snprintf(scratch_file, sizeof(scratch_file), "%s.lockbench", options->task_file);
+
+    for (i=0;lock_type_names[i]!=NULL;i++)
+    {
+        set_lock_type(lock_type_names[i]);
+
+        // only the selected lock type decides whether the benchmark passes
+        if (!benchmark_lock_type(scratch_file, num_tasks / size > 0 ? num_tasks / size : 1)
+            && strcmp(lock_type_names[i], options->lock_type) == 0)
+            failed = 1;
+    }
+
+    set_lock_type(options->lock_type);
+    if (rank == 0) unlink(scratch_file);
+
+    error_return = NULL;
+    free_fair_lock();
+    close_io_engine();
+
+    queue->close(queue);
+    if (options->combine) MPI_Comm_free(&node_comm);
+    free(counts);
+    free(total_counts);
+
+    return failed;
+}
+
+/* Select the type of lock used for all file locking
+
+   Arguments:
+
+     const char *name          name of the lock type
+
+   Returns:
+
+     bool                      false if the lock type doesn't exist
+*/
+bool set_lock_type(const char *name)
+{
+    int i;
+
+    for (i=0;lock_type_names[i]!=NULL;i++)
+    {
+        if (strcmp(name, lock_type_names[i]) == 0)
+        {
+            file_lock_type = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Check whether a lock type exists
+
+   Arguments:
+
+     const char *name          name of the lock type
+
+   Returns:
+
+     bool                      whether the lock type exists
+*/
+bool valid_lock_type(const char *name)
+{
+    int i;
+
+    for (i=0;lock_type_names[i]!=NULL;i++)
+        if (strcmp(name, lock_type_names[i]) == 0) return true;
+
+    return false;
+}
+
+/* Work out whether a lock file has been abandoned
+
+   A lock file holds the host name and process id of its holder. If the holder
+   is on this host, the lock is abandoned once the process has gone. Otherwise,
+   since the holder touches the lock file every LOCKFILE_TOUCH_INTERVAL, the lock
+   is abandoned once it hasn't been touched for LOCKFILE_STALE_TIME. A lock file
+   that can't be read (e.g. its holder died before writing to it) is judged by
+   its age too.
+
+   Arguments:
+
+     const char *lock_path     path to the lock file
+
+   Returns:
+
+     bool                      whether the lock file has been abandoned
+*/
+static bool lock_file_abandoned(const char *lock_path)
+{
+    int fd, pid;
+    ssize_t length = -1;
+    char owner[512], host[256], holder_host[256];
+    struct stat lock_stats;
+
+    if ((fd = open(lock_path, O_RDONLY)) == -1) return false;
+
+    if (fstat(fd, &lock_stats) == 0) length = read(fd, owner, sizeof(owner) - 1);
+    close(fd);
+
+    if (length == -1) return false;
+    owner[length] = '\0';
+
+    if (gethostname(host, sizeof(host)) == 0
+        && sscanf(owner, "%255s %d", holder_host, &pid) == 2
+        && strcmp(holder_host, host) == 0)
+        return kill(pid, 0) == -1 && errno == ESRCH;
+
+    return time(NULL) - lock_stats.st_mtime > LOCKFILE_STALE_TIME;
+}
+
+/* Remove an abandoned lock file
+
+   Two processes can find the same lock file abandoned, in which case the second
+   to remove it could remove the lock file that the other then created. So lock
+   files are only removed while holding a second lock file (e.g. tasks.txt.lock.break),
+   and are checked again once it is held. The second lock is only held for a
+   moment, so is removed if it is older than LOCKFILE_STALE_TIME.
+
+   Arguments:
+
+     const char *lock_path     path to the lock file
+*/
+static void break_lock_file(const char *lock_path)
+{
+    int fd;
+    char break_path[1024 + 16];
+    struct stat break_stats;
+
+    snprintf(break_path, sizeof(break_path), "%s.break", lock_path);
+
+    if ((fd = open(break_path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1)
+    {
+        if (errno == EEXIST && stat(break_path, &break_stats) == 0
+            && time(NULL) - break_stats.st_mtime > LOCKFILE_STALE_TIME)
+            unlink(break_path);
+
+        return;
+    }
+
+    if (lock_file_abandoned(lock_path)) unlink(lock_path);
+
+    close(fd);
+    unlink(break_path);
+}
+
+// Touch the lock files held by this process, so that they aren't taken to be abandoned
+static void *touch_lock_files(void *arg)
+{
+    int i;
+
+    (void) arg;
+
+    while (true)
+    {
+        sleep(LOCKFILE_TOUCH_INTERVAL);
+
+        pthread_mutex_lock(&held_locks_mutex);
+        for (i=0;i<MAX_HELD_LOCKS;i++)
+            if (held_locks[i].path[0] != '\0' && held_locks[i].lock_fd != -1) futimens(held_locks[i].lock_fd, NULL);
+        pthread_mutex_unlock(&held_locks_mutex);
+    }
+
+    return NULL;
+}
+
+// Start the thread that touches held lock files
+static void start_lock_file_toucher(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, touch_lock_files, NULL) != 0)
+    {
+        fprintf(stderr, "[ERROR] lock: can't start the lock file thread\n");
+        fail();
+    }
+
+    pthread_detach(thread);
+}
+
+/* Take a lock file
+
+   Arguments:
+
+     const char *lock_path     path to the lock file
+
+   Returns:
+
+     int                       lock file descriptor, or -1 on error
+*/
+static int take_lock_file(const char *lock_path)
+{
+    int fd;
+    useconds_t delay = LOCKFILE_MIN_DELAY;
+    char host[256], owner[512];
+    static pthread_once_t toucher = PTHREAD_ONCE_INIT;
+
+    pthread_once(&toucher, start_lock_file_toucher);
+
+    while ((fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1)
+    {
+        if (errno != EEXIST) return -1;
+
+        // remove a lock file left behind by a dead process
+        if (lock_file_abandoned(lock_path))
+        {
+            break_lock_file(lock_path);
+            continue;
+        }
+
+        usleep(delay);
+        if (delay < LOCKFILE_MAX_DELAY) delay *= 2;
+    }
+
+    // record who holds the lock
+    if (gethostname(host, sizeof(host)) == -1) strcpy(host, "unknown");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(owner, sizeof(owner), "%s %d\n", host, (int) getpid());
+
+    if (write(fd, owner, strlen(owner)) != (ssize_t) strlen(owner))
+    {
+        close(fd);
+        unlink(lock_path);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Release a lock file
+
+   The lock file is only removed if it is still the one we created, i.e. it
+   wasn't taken to be abandoned while we held it.
+
+   Arguments:
+
+     const char *lock_path     path to the lock file
+     int fd                    lock file descriptor
+
+   Returns:
+
+     int                       0 on success, -1 on error
+*/
+static int release_lock_file(const char *lock_path, int fd)
+{
+    struct stat held_stats, lock_stats;
+
+    if (fd == -1)
+    {
+        errno = ENOLCK;
+        return -1;
+    }
+
+    if (fstat(fd, &held_stats) == 0 && stat(lock_path, &lock_stats) == 0
+        && held_stats.st_dev == lock_stats.st_dev && held_stats.st_ino == lock_stats.st_ino)
+    {
+        close(fd);
+        return unlink(lock_path);
+    }
+
+    fprintf(stderr, "[WARNING] lock file %s was removed while it was held\n", lock_path);
+    close(fd);
+    return 0;
+}
+
+/* Find the slot of a held lock
+
+   Arguments:
+
+     int fd                    locked file descriptor
+     const char *path          path to the locked file (NULL to find a free slot)
+
+   Returns:
+
+     int                       index of the slot, or -1 if there is none
+*/
+static int find_held_lock(int fd, const char *path)
+{
+    int i;
+
+    for (i=0;i<MAX_HELD_LOCKS;i++)
+    {
+        if (path == NULL ? held_locks[i].path[0] == '\0'
+            : held_locks[i].fd == fd && strcmp(held_locks[i].path, path) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Attempt to acquire a file lock
+
+   The lock is taken with the primitive selected by set_lock_type():
+   POSIX record locks (fcntl, the default), Linux open file description
+   locks (ofd), BSD locks (flock), or a lock file created alongside the
+   locked file with O_EXCL (lockfile). See lock_file_abandoned() for how lock
+   files left behind by dead processes are dealt with. The lock is noted,
+   so that it can be released by release_held_locks().
+
+   Arguments:
+
+     struct flock *fl          pointer to file lock structure
+     int fd                    file descriptor
+     const char *path          path to the locked file
+*/
+void lock_file(struct flock *fl, int fd, const char *path)
+{
+    int slot, lock_fd = -1, result = 0;
+    char lock_path[1024 + 8];
+
+    // wait for our turn
+    if (fair_lock_win != MPI_WIN_NULL) acquire_fair_lock();
+
+    // set to write/exclusive lock
+    fl->l_type = F_WRLCK;
+
+    pthread_mutex_lock(&held_locks_mutex);
+    if ((slot = find_held_lock(fd, NULL)) != -1)
+    {
+        snprintf(held_locks[slot].path, sizeof(held_locks[slot].path), "%s", path);
+        held_locks[slot].fd = fd;
+        held_locks[slot].lock_fd = -1;
+    }
+    pthread_mutex_unlock(&held_locks_mutex);
+
+    if (slot == -1)
+    {
+        errno = ENOLCK;
+        result = -1;
+    }
+
+    else switch (file_lock_type)
+    {
+        case LOCK_TYPE_OFD:
+            // open file description locks must not set a pid
+            fl->l_pid = 0;
+            result = fcntl(fd, F_OFD_SETLKW, fl);
+            break;
+
+        case LOCK_TYPE_FLOCK:
+            result = flock(fd, LOCK_EX);
+            break;
+
+        case LOCK_TYPE_LOCKFILE:
+            snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+            if ((lock_fd = take_lock_file(lock_path)) == -1) result = -1;
+            break;
+
+        default:
+            result = fcntl(fd, F_SETLKW, fl);
+    }
+
+    // try to lock file
+    if (result == -1)
+    {
+        perror("[ERROR] lock");
+        if (slot != -1) held_locks[slot].path[0] = '\0';
+        fail();
+    }
+
+    pthread_mutex_lock(&held_locks_mutex);
+    held_locks[slot].fl = *fl;
+    held_locks[slot].lock_fd = lock_fd;
+    pthread_mutex_unlock(&held_locks_mutex);
+}
+
+/* Attempt to release a file lock
+
+   Arguments:
+
+     struct flock *fl          pointer to file lock structure
+     int fd                    file descriptor
+     const char *path          path to the locked file
+*/
+void unlock_file(struct flock *fl, int fd, const char *path)
+{
+    int slot, lock_fd = -1, result;
+    char lock_path[1024 + 8];
+
+    // set to unlocked
+    fl->l_type = F_UNLCK;
+
+    // forget the lock before its lock file is closed
+    pthread_mutex_lock(&held_locks_mutex);
+    if ((slot = find_held_lock(fd, path)) != -1)
+    {
+        lock_fd = held_locks[slot].lock_fd;
+        held_locks[slot].path[0] = '\0';
+    }
+    pthread_mutex_unlock(&held_locks_mutex);
+
+    switch (file_lock_type)
+    {
+        case LOCK_TYPE_OFD:
+            result = fcntl(fd, F_OFD_SETLK, fl);
+            break;
+
+        case LOCK_TYPE_FLOCK:
+            result = flock(fd, LOCK_UN);
+            break;
+
+        case LOCK_TYPE_LOCKFILE:
+            snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+            result = release_lock_file(lock_path, lock_fd);
+            break;
+
+        default:
+            result = fcntl(fd, F_SETLK, fl);
+    }
+
+    // try to unlock file
+    if (result == -1)
+    {
+        perror("[ERROR] unlock");
+        fail();
+    }
+
+    // hand over to the next process in the queue
+    if (fair_lock_win != MPI_WIN_NULL) release_fair_lock();
+}
+
+// Release every file lock held by this process, e.g. after an error
+static void release_held_locks(void)
+{
+    int i;
+    struct flock fl;
+
+    for (i=0;i<MAX_HELD_LOCKS;i++)
+    {
+        if (held_locks[i].path[0] == '\0') continue;
+
+        fl = held_locks[i].fl;
+        unlock_file(&fl, held_locks[i].fd, held_locks[i].path);
+    }
+}
+
+// Drive MPI progress, so that one-sided operations targeting us complete
+static void mpi_progress(void)
+{
+    int flag;
+
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+}
+
+/* Sleep, while driving MPI progress if the fair lock is in use
+
+   Arguments:
+
+     double seconds            sleep duration (seconds)
+*/
+void progress_sleep(double seconds)
+{
+    double end = wall_time() + seconds;
+
+    if (fair_lock_win == MPI_WIN_NULL)
+    {
+        sleep(seconds);
+        return;
+    }
+
+    while (wall_time() < end)
+    {
+        mpi_progress();
+        usleep(CANCEL_POLL_INTERVAL);
+    }
+}
+
+/* Set up the fair lock
+
+   The fair lock is an MCS queue lock held in an MPI window, which is taken
+   before any file lock. Processes wanting the lock append themselves to a
+   queue whose tail is held by rank 0, then wait for their predecessor to
+   hand the lock over, so it is granted in first-come, first-served order.
+   The file lock is still taken, to exclude processes outside of this run.
+   Must be called collectively by all processes in MPI_COMM_WORLD.
+*/
+void init_fair_lock(void)
+{
+    int *state;
+
+    MPI_Win_allocate(FAIR_LOCK_SIZE * sizeof(int), sizeof(int), MPI_INFO_NULL,
+        MPI_COMM_WORLD, &state, &fair_lock_win);
+
+    fair_lock_state = state;
+    fair_lock_state[FAIR_LOCK_TAIL] = -1;
+    fair_lock_state[FAIR_LOCK_NEXT] = -1;
+    fair_lock_state[FAIR_LOCK_BLOCKED] = 0;
+
+    MPI_Win_lock_all(0, fair_lock_win);
+    MPI_Win_sync(fair_lock_win);
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+/* Free the fair lock
+
+   Must be called collectively by all processes in MPI_COMM_WORLD.
+*/
+void free_fair_lock(void)
+{
+    if (fair_lock_win == MPI_WIN_NULL) return;
+
+    MPI_Win_unlock_all(fair_lock_win);
+    MPI_Win_free(&fair_lock_win);
+}
+
+// Join the fair lock queue and wait for the lock to be handed over
+void acquire_fair_lock(void)
+{
+    int rank, predecessor;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    fair_lock_state[FAIR_LOCK_NEXT] = -1;
+    fair_lock_state[FAIR_LOCK_BLOCKED] = 1;
+    MPI_Win_sync(fair_lock_win);
+
+    // add ourselves to the tail of the queue
+    MPI_Fetch_and_op(&rank, &predecessor, MPI_INT, 0, FAIR_LOCK_TAIL, MPI_REPLACE, fair_lock_win);
+    MPI_Win_flush(0, fair_lock_win);
+
+    if (predecessor == -1) return;
+
+    // tell our predecessor who is next, then wait for it to unblock us
+    MPI_Accumulate(&rank, 1, MPI_INT, predecessor, FAIR_LOCK_NEXT, 1, MPI_INT, MPI_REPLACE, fair_lock_win);
+    MPI_Win_flush(predecessor, fair_lock_win);
+
+    do
+    {
+        mpi_progress();
+        MPI_Win_sync(fair_lock_win);
+    }
+    while (fair_lock_state[FAIR_LOCK_BLOCKED] == 1);
+}
+
+// Hand the fair lock over to the next process in the queue
+void release_fair_lock(void)
+{
+    int rank, tail, next, none = -1, zero = 0;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Win_sync(fair_lock_win);
+
+    if (fair_lock_state[FAIR_LOCK_NEXT] == -1)
+    {
+        // nobody is waiting, empty the queue
+        MPI_Compare_and_swap(&none, &rank, &tail, MPI_INT, 0, FAIR_LOCK_TAIL, fair_lock_win);
+        MPI_Win_flush(0, fair_lock_win);
+
+        if (tail == rank) return;
+
+        // a process is joining the queue, wait for it to tell us who it is
+        do
+        {
+            mpi_progress();
+            MPI_Win_sync(fair_lock_win);
+        }
+        while (fair_lock_state[FAIR_LOCK_NEXT] == -1);
+    }
+
+    next = fair_lock_state[FAIR_LOCK_NEXT];
+
+    MPI_Accumulate(&zero, 1, MPI_INT, next, FAIR_LOCK_BLOCKED, 1, MPI_INT, MPI_REPLACE, fair_lock_win);
+    MPI_Win_flush(next, fair_lock_win);
+}
+
+/* Claim the next global task index
+
+   The counter is stored as plain text in a file alongside the task file
+   and must only be updated while the task file lock is held.
+
+   Arguments:
+
+     int fd                    task index counter file descriptor
+
+   Returns:
+
+     long long                 the claimed task index
+*/
+long long next_task_id(int fd)
+{
+    ssize_t n;
+    long long id = 0;
+    char buffer[32];
+
+    // read current value (an empty file means no tasks have been claimed)
+    if ((n = pread(fd, buffer, sizeof(buffer) - 1, 0)) > 0)
+    {
+        buffer[n] = '\0';
+        id = atoll(buffer);
+    }
+
+    // store the incremented value (the counter only ever grows in length)
+    n = snprintf(buffer, sizeof(buffer), "%lld\n", id + 1);
+    if (pwrite(fd, buffer, n, 0) != n)
+    {
+        perror("[ERROR] pwrite");
+        fail();
+    }
+
+    return id;
+}
+
+/* Export the per-process task environment variables
+
+   The variables are registered with putenv() so that later updates to
+   the buffers are visible to child processes without rebuilding the
+   environment.
+
+   Arguments:
+
+     task_environment *env     pointer to task environment
+     int rank                  process id
+     int local_rank            process id on the local node
+     const char *node          name of the local node
+*/
+void init_task_environment(task_environment *env, int rank, int local_rank, const char *node)
+{
+    snprintf(env->rank, sizeof(env->rank), "TASKFARMER_RANK=%d", rank);
+    snprintf(env->local_rank, sizeof(env->local_rank), "TASKFARMER_LOCAL_RANK=%d", local_rank);
+    snprintf(env->node, sizeof(env->node), "TASKFARMER_NODE=%s", node);
+
+    // a process runs a single task at a time
+    snprintf(env->slot, sizeof(env->slot), "TASKFARMER_SLOT=%d", 0);
+    snprintf(env->copy, sizeof(env->copy), "TASKFARMER_COPY=%d", 0);
+
+    update_task_environment(env, 0, 0);
+
+    putenv(env->task_id);
+    putenv(env->rank);
+    putenv(env->local_rank);
+    putenv(env->slot);
+    putenv(env->attempt);
+    putenv(env->copy);
+    putenv(env->node);
+}
+
+/* Update the per-task environment variables in place
+
+   Arguments:
+
+     task_environment *env     pointer to task environment
+     long long task_id         global task index
+     int attempt               number of previous failed attempts
+*/
+void update_task_environment(task_environment *env, long long task_id, int attempt)
+{
+    snprintf(env->task_id, sizeof(env->task_id), "TASKFARMER_TASK_ID=%lld", task_id);
+    snprintf(env->attempt, sizeof(env->attempt), "TASKFARMER_ATTEMPT=%d", attempt);
+}
+
+// Remove a file or empty directory (for remove_tree)
+static int remove_entry(const char *path, const struct stat *file_stats, int type, struct FTW *ftw)
+{
+    (void) file_stats;
+    (void) type;
+    (void) ftw;
+
+    return remove(path) == -1 && errno != ENOENT ? -1 : 0;
+}
+
+// Remove a directory and everything in it
+static void remove_tree(const char *path)
+{
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT)
+    {
+        perror("[ERROR] remove");
+        fail();
+    }
+}
+
+/* Give each copy of a task its own scratch directory (speculative mode only)
+
+   Each copy runs with TASKFARMER_SCRATCH set to an empty directory of its
+   own, under a directory alongside the task file (e.g. tasks.txt.scratch),
+   so that the two copies of a task don't write over each other. Rank 0
+   removes anything left behind by a previous run, so every process must
+   call this before any tasks are launched, followed by a barrier.
+
+   Arguments:
+
+     task_environment *env     pointer to task environment
+     const char *task_file     path to task file
+     int rank                  process id
+*/
+void init_scratch_directory(task_environment *env, const char *task_file, int rank)
+{
+    char cwd[1024];
+
+    // tasks may change directory, so the path must be absolute
+    if (task_file[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+        snprintf(env->scratch_root, sizeof(env->scratch_root), "%s.scratch", task_file);
+    else
+        snprintf(env->scratch_root, sizeof(env->scratch_root), "%s/%s.scratch", cwd, task_file);
+
+    snprintf(env->scratch, sizeof(env->scratch), "TASKFARMER_SCRATCH=");
+    putenv(env->scratch);
+
+    if (rank == 0)
+    {
+        remove_tree(env->scratch_root);
+
+        if (mkdir(env->scratch_root, 0755) == -1)
+        {
+            perror("[ERROR] mkdir");
+            fail();
+        }
+    }
+}
+
+/* Check for a message cancelling a task
+
+   Messages cancelling other tasks (e.g. one that has just finished here) are
+   kept, rather than dropped, in case the task they refer to is waited for
+   later.
+
+   Arguments:
+
+     long long task_id         global task index
+     bool wait                 whether to block until the message arrives
+
+   Returns:
+
+     bool                      whether the task has been cancelled
+*/
+static bool receive_cancellation(long long task_id, bool wait)
+{
+    int i, flag = 1;
+    long long cancel_id;
+    MPI_Status mpi_status;
+
+    while (true)
+    {
+        for (i=0;i<num_pending_cancellations;i++)
+        {
+            if (pending_cancellations[i] == task_id)
+            {
+                pending_cancellations[i] = pending_cancellations[--num_pending_cancellations];
+                return true;
+            }
+        }
+
+        if (wait) MPI_Probe(MPI_ANY_SOURCE, CANCEL_TAG, MPI_COMM_WORLD, &mpi_status);
+        else MPI_Iprobe(MPI_ANY_SOURCE, CANCEL_TAG, MPI_COMM_WORLD, &flag, &mpi_status);
+
+        if (!flag) return false;
+
+        MPI_Recv(&cancel_id, 1, MPI_LONG_LONG, mpi_status.MPI_SOURCE, CANCEL_TAG,
+            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        pending_cancellations = realloc(pending_cancellations,
+            (num_pending_cancellations + 1) * sizeof(long long));
+        pending_cancellations[num_pending_cancellations++] = cancel_id;
+    }
+}
+
+/* Run a task, retrying on failure if requested
+
+   When a running task registry is passed the task may also be running as a
+   speculative copy on another process. The first copy to finish removes the
+   task from the registry and tells the other process to terminate its copy.
+   A task that is terminated because it was cancelled with taskfarmer-cancel
+   isn't retried. When scratch directories are in use, the directory of a
+   copy that is cancelled is removed, and that of the copy that finishes
+   first is kept as SCRATCH/TASK_ID, unless it is empty.
+
+   Arguments:
+
+     const char *command       system command
+     long long task_id         global task index
+     int copy                  1 if this is a speculative duplicate
+     const char *running_file  path to running task registry (or NULL)
+     task_environment *env     pointer to task environment
+     int rank                  process id
+     bool verbose              whether to report status updates
+     bool retry                whether failed tasks are retried
+     int max_retries           maximum number of attempts
+
+   Returns:
+
+     int                       exit status of the last attempt, -1 if the
+                               task was completed by another process, or
+                               TASK_CANCELLED if it was cancelled
+*/
+int execute_task(const char *command, long long task_id, int copy, const char *running_file,
+    task_environment *env, int rank, bool verbose, bool retry, int max_retries)
+{
+    int other, status = 0;
+    int attempts = 0;
+    bool cancelled = false;
+    double start = wall_time();
+    char copy_dir[1024 + 64], task_dir[1024 + 64];
+
+    snprintf(env->copy, sizeof(env->copy), "TASKFARMER_COPY=%d", copy);
+
+    // give each copy its own scratch directory
+    if (env->scratch_root[0] != '\0')
+    {
+        snprintf(copy_dir, sizeof(copy_dir), "%s/%lld.%d", env->scratch_root, task_id, copy);
+        snprintf(env->scratch, sizeof(env->scratch), "TASKFARMER_SCRATCH=%s", copy_dir);
+
+        if (mkdir(copy_dir, 0755) == -1 && errno != EEXIST)
+        {
+            perror("[ERROR] mkdir");
+            fail();
+        }
+    }
+
+    // retry if task fails
+    while (attempts < max_retries)
+    {
+        update_task_environment(env, task_id, attempts);
+
+        if ((status = launch_task(command, task_id, running_file != NULL, &cancelled)) == 0) break;
+
+        // the other copy of the task has already finished, or the task was cancelled
+        if (cancelled || status == TASK_CANCELLED) break;
+
+        attempts++;
+
+        if (verbose)
+        {
+            if (retry)
+                printf("[WARNING]: system command failed, %s (%d/%d)\n", command, attempts, max_retries);
+            else
+                printf("[WARNING]: system command failed, %s\n", command);
+        }
+    }
+
+    if (running_file != NULL && !cancelled)
+    {
+        other = complete_running_task(running_file, task_id, rank, wall_time() - start);
+
+        // terminate the copy running elsewhere
+        if (other >= 0)
+        {
+            MPI_Send(&task_id, 1, MPI_LONG_LONG, other, CANCEL_TAG, MPI_COMM_WORLD);
+        }
+
+        // we lost the race, consume the cancellation message sent by the winner
+        else if (other == -2)
+        {
+            receive_cancellation(task_id, true);
+            cancelled = true;
+        }
+    }
+
+    // keep the output of the copy that finished first
+    if (env->scratch_root[0] != '\0')
+    {
+        snprintf(task_dir, sizeof(task_dir), "%s/%lld", env->scratch_root, task_id);
+
+        if (cancelled || status == TASK_CANCELLED) remove_tree(copy_dir);
+
+        else if (rmdir(copy_dir) == -1 && rename(copy_dir, task_dir) == -1)
+        {
+            perror("[ERROR] rename");
+            fail();
+        }
+
+        snprintf(env->scratch, sizeof(env->scratch), "TASKFARMER_SCRATCH=");
+    }
+
+    if (cancelled)
+    {
+        if (verbose)
+            printf("[INFO]: Rank %04d cancelled: %s (completed by another process)\n", rank, command);
+    }
+
+    else if (status == TASK_CANCELLED)
+    {
+        if (verbose)
+            printf("[INFO]: Rank %04d cancelled: %s (cancelled with taskfarmer-cancel)\n", rank, command);
+    }
+
+    // task was successful
+    else if (attempts < max_retries)
+    {
+        if (verbose)
+            printf("[INFO]: Rank %04d completed: %s\n", rank, command);
+    }
+
+    if (cancelled) return -1;
+    if (status == TASK_CANCELLED) return TASK_CANCELLED;
+
+    // killed tasks are reported as the shell would
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+
+    return WEXITSTATUS(status);
+}
+
+/* Start an argv0 task record without a shell
+
+   The argument and environment arrays point into the record and the
+   environment, and are kept between calls, so nothing is copied or
+   tokenized. Environment fields replace variables of the same name.
+
+   Arguments:
+
+     const char *record        claimed argv0 task record
+     bool new_group            whether to run the task in its own process group
+
+   Returns:
+
+     pid_t                     process id of the task, or -1 if it couldn't
+                               be started (a warning is printed)
+*/
+static pid_t spawn_argv_task(const char *record, bool new_group)
+{
+    int i, j, status, num_args = 0, num_env = 0;
+    size_t length;
+    pid_t pid;
+    const char *field;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    extern char **environ;
+
+    static int capacity = 0;
+    static char **args = NULL, **env = NULL;
+
+    // make room for every field, and the whole environment
+    for (i=0;environ[i]!=NULL;i++);
+    for (field = record, j = 0; *field != '\0'; field += strlen(field) + 1) j++;
+
+    if (i + j + 1 > capacity)
+    {
+        capacity = 2 * (i + j + 1);
+        args = realloc(args, capacity * sizeof(char *));
+        env = realloc(env, capacity * sizeof(char *));
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attributes);
+
+    for (field = record; *field != '\0'; field += strlen(field) + 1)
+    {
+        if (field[0] != ARGV0_TAG)
+        {
+            args[num_args++] = (char *) field;
+            continue;
+        }
+
+        switch (field[1])
+        {
+            case ARGV0_ENV:
+                env[num_env++] = (char *) field + 2;
+                break;
+            case ARGV0_STDIN:
+                posix_spawn_file_actions_addopen(&actions, 0, field + 2, O_RDONLY, 0);
+                break;
+            case ARGV0_STDOUT:
+                posix_spawn_file_actions_addopen(&actions, 1, field + 2, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                break;
+            case ARGV0_APPEND:
+                posix_spawn_file_actions_addopen(&actions, 1, field + 2, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                break;
+            case ARGV0_STDERR:
+                posix_spawn_file_actions_addopen(&actions, 2, field + 2, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                break;
+            default:
+                printf("[WARNING]: Ignoring unknown field tag 0x%02x\n", (unsigned char) field[1]);
+        }
+    }
+
+    args[num_args] = NULL;
+
+    // inherit the rest of the environment
+    for (i=0, j=num_env;environ[i]!=NULL;i++)
+    {
+        int k;
+
+        length = strcspn(environ[i], "=");
+
+        for (k=0;k<num_env;k++)
+            if (strncmp(env[k], environ[i], length) == 0 && env[k][length] == '=') break;
+
+        if (k == num_env) env[j++] = environ[i];
+    }
+
+    env[j] = NULL;
+
+    if (new_group)
+    {
+        posix_spawnattr_setpgroup(&attributes, 0);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    }
+
+    if (num_args == 0) status = EINVAL;
+    else status = posix_spawnp(&pid, args[0], &actions, &attributes, args, env);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    if (status != 0)
+    {
+        printf("[WARNING]: Can't start %s: %s\n", num_args ? args[0] : "empty task", strerror(status));
+        return -1;
+    }
+
+    return pid;
+}
+
+/* Launch a system command and wait for it to finish
+
+   In speculative mode the command is run in its own process group and the
+   process keeps polling for cancellation messages while it waits, so that
+   the task can be terminated if a duplicate finishes first. The same
+   polling is used when the fair lock is in use, so that other processes can
+   make progress on it, and when running tasks can be cancelled with
+   "taskfarmer-cancel --signal", so that their tombstones can be checked for
+   (see find_tombstone()). Plugin tasks are run in-process by run_plugin_task()
+   and can't be cancelled. Records in the argv0 format are started directly
+   by spawn_argv_task(), without the shell.
+
+   Arguments:
+
+     const char *command       system command, or argv0 task record
+     long long task_id         global task index
+     bool speculative          whether the task can be cancelled
+     bool *cancelled           set if the task was cancelled
+
+   Returns:
+
+     int                       exit status of the command, or TASK_CANCELLED
+                               if it was terminated by its tombstone
+*/
+int launch_task(const char *command, long long task_id, bool speculative, bool *cancelled)
+{
+    int status;
+    pid_t pid;
+    bool withdrawn = false;
+    double kill_time = 0, start = wall_time();
+    const tombstone *stone;
+
+    // plugin tasks are run in-process
+    if (task_format == TASK_FORMAT_LINE && strncmp(command, PLUGIN_PREFIX, strlen(PLUGIN_PREFIX)) == 0)
+        return run_plugin_task(command);
+
+    // the fair lock needs MPI progress while we wait, so poll as for speculation
+    if (!speculative && fair_lock_win == MPI_WIN_NULL && !tombstones.kill_running)
+    {
+        if (task_format == TASK_FORMAT_LINE) return system(command);
+
+        if ((pid = spawn_argv_task(command, false)) == -1) return 127 << 8;
+
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+        return status;
+    }
+
+    if (task_format == TASK_FORMAT_ARGV0)
+    {
+        if ((pid = spawn_argv_task(command, true)) == -1) return 127 << 8;
+    }
+
+    else if ((pid = fork()) == -1)
+    {
+        perror("[ERROR] fork");
+        fail();
+    }
+
+    // child: run the command through the shell, as system() would
+    if (pid == 0)
+    {
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+
+    setpgid(pid, pid);
+
+    while (waitpid(pid, &status, WNOHANG) == 0)
+    {
+        if (!*cancelled && !withdrawn)
+        {
+            if (receive_cancellation(task_id, false))
+            {
+                kill(-pid, SIGTERM);
+                kill_time = wall_time();
+                *cancelled = true;
+            }
+
+            // the task was cancelled with "taskfarmer-cancel --signal" after it started
+            stone = tombstones.kill_running ? find_tombstone(command) : NULL;
+
+            if (!*cancelled && stone != NULL && (stone->flags & TOMBSTONE_SIGNAL) && start < stone->time)
+            {
+                kill(-pid, SIGTERM);
+                kill_time = wall_time();
+                withdrawn = true;
+            }
+        }
+
+        // task is ignoring SIGTERM
+        else if (wall_time() - kill_time > CANCEL_GRACE_TIME)
+        {
+            kill(-pid, SIGKILL);
+        }
+
+        usleep(CANCEL_POLL_INTERVAL);
+    }
+
+    return withdrawn ? TASK_CANCELLED : status;
+}
+
+// Return the wall-clock time in seconds
+double wall_time(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+/* Read the entire contents of a locked file
+
+   Arguments:
+
+     int fd                    file descriptor
+     off_t *size               pointer to file size variable
+
+   Returns:
+
+     char *                    null terminated buffer (caller must free)
+*/
+char *read_locked_file(int fd, off_t *size)
+{
+    char *buffer;
+    struct stat file_stats;
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    *size = file_stats.st_size;
+    buffer = calloc(1+file_stats.st_size, sizeof(char));
+
+    if (pread(fd, buffer, file_stats.st_size, 0) != file_stats.st_size)
+    {
+        perror("[ERROR] pread");
+        fail();
+    }
+
+    return buffer;
+}
+
+/* Replace the entire contents of a locked file
+
+   Arguments:
+
+     int fd                    file descriptor
+     const char *buffer        new file contents
+     size_t size               size of buffer
+*/
+void write_locked_file(int fd, const char *buffer, size_t size)
+{
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, buffer, size, 0) != (ssize_t) size)
+    {
+        perror("[ERROR] write");
+        fail();
+    }
+}
+
+/* Add a task to the running task registry
+
+   Each running task is recorded on a line of the form
+
+     R TASK_ID RANK COPY_RANK START_TIME COMMAND
+
+   where COPY_RANK is -1 until an idle process duplicates the task.
+
+   Arguments:
+
+     const char *running_file  path to running task registry
+     long long task_id         global task index
+     int rank                  process id
+     const char *command       system command
+*/
+void register_running_task(const char *running_file, long long task_id, int rank, const char *command)
+{
+    int fd, n;
+    char *line;
+    struct flock fl = { .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+    if ((fd = open(running_file, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    lock_file(&fl, fd, running_file);
+
+    n = asprintf(&line, "R %lld %d -1 %.3f %s\n", task_id, rank, wall_time(), command);
+    if (n < 0 || write(fd, line, n) != n)
+    {
+        perror("[ERROR] write");
+        fail();
+    }
+
+    unlock_file(&fl, fd, running_file);
+    close(fd);
+    free(line);
+}
+
+/* Remove a completed task from the running task registry
+
+   The run time of the task is recorded on a line of the form "D RUN_TIME",
+   with only the most recent SPECULATE_SAMPLES run times being kept.
+
+   Arguments:
+
+     const char *running_file  path to running task registry
+     long long task_id         global task index
+     int rank                  process id
+     double run_time           run time of the task (seconds)
+
+   Returns:
+
+     int                       rank running the other copy of the task,
+                               -1 if there is no other copy, or -2 if
+                               the other copy has already completed
+*/
+int complete_running_task(const char *running_file, long long task_id, int rank, double run_time)
+{
+    int fd, owner, copy;
+    int other = -2;
+    int samples = 0, skip;
+    long long id;
+    off_t size;
+    size_t length = 0;
+    char *buffer, *output, *line, *next;
+    struct flock fl = { .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+    if ((fd = open(running_file, O_RDWR | O_CREAT, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    lock_file(&fl, fd, running_file);
+
+    buffer = read_locked_file(fd, &size);
+    output = calloc(size + 64, sizeof(char));
+
+    // count run time samples
+    for (line = buffer; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        if (line[0] == 'D') samples++;
+    }
+    skip = samples - (SPECULATE_SAMPLES - 1);
+
+    // copy all other records, dropping the oldest samples
+    for (line = buffer; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+
+        if (line[0] == 'R' && sscanf(line, "R %lld %d %d", &id, &owner, &copy) == 3 && id == task_id)
+        {
+            other = (owner == rank) ? copy : owner;
+            continue;
+        }
+
+        if (line[0] == 'D' && skip-- > 0) continue;
+
+        memcpy(output + length, line, next - line);
+        length += next - line;
+    }
+
+    // only the first copy to finish reports a run time
+    if (other != -2)
+        length += sprintf(output + length, "D %.3f\n", run_time);
+
+    write_locked_file(fd, output, length);
+
+    unlock_file(&fl, fd, running_file);
+    close(fd);
+    free(buffer);
+    free(output);
+
+    return other;
+}
+
+// Comparison function for sorting run times
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Claim a straggling task from the running task registry
+
+   A task is considered to be a straggler if it has been running for more
+   than FACTOR times its predicted run time (see predicted_run_time()), or
+   if it has none, the median run time of the recently completed tasks, and
+   hasn't already been duplicated. The longest running straggler is chosen.
+
+   Arguments:
+
+     const char *running_file  path to running task registry
+     int rank                  process id
+     double factor             speculation factor
+     long long *task_id        pointer to task index of claimed task
+     char **command            pointer to command of claimed task (caller must free)
+
+   Returns:
+
+     int                       1 if a task was claimed, 0 if there are tasks
+                               running but none are stragglers, -1 if no
+                               tasks are running
+*/
+int claim_straggler(const char *running_file, int rank, double factor, long long *task_id, char **command)
+{
+    int fd, owner, copy, offset;
+    int samples = 0, running = 0;
+    long long id, best_id = -1;
+    off_t size;
+    size_t length = 0;
+    double start, now = wall_time(), elapsed, predicted, median = 0, best = 0;
+    double *run_times;
+    char *buffer, *output, *line, *next;
+    struct flock fl = { .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+    if ((fd = open(running_file, O_RDWR | O_CREAT, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    lock_file(&fl, fd, running_file);
+
+    buffer = read_locked_file(fd, &size);
+    run_times = malloc((size / 2 + 1) * sizeof(double));
+
+    // collect run time samples and count running tasks
+    for (line = buffer; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+
+        if (line[0] == 'D' && sscanf(line, "D %lf", &run_times[samples]) == 1) samples++;
+        else if (line[0] == 'R') running++;
+    }
+
+    if (samples > 0)
+    {
+        qsort(run_times, samples, sizeof(double), compare_doubles);
+        median = run_times[samples/2];
+    }
+
+    // find the longest running task that hasn't been duplicated
+    for (line = buffer; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+
+        if (line[0] == 'R'
+            && sscanf(line, "R %lld %d %d %lf %n", &id, &owner, &copy, &start, &offset) == 4
+            && copy == -1 && owner != rank)
+        {
+            elapsed = now - start;
+
+            // tasks without a prediction can't be judged until some have completed
+            if ((predicted = predicted_run_time(line + offset, next - line - offset)) <= 0)
+            {
+                if (samples == 0) continue;
+                predicted = median;
+            }
+
+            if (elapsed > factor*predicted && elapsed > best)
+            {
+                best = elapsed;
+                best_id = id;
+            }
+        }
+    }
+
+    if (best_id != -1)
+    {
+        output = calloc(size + 64, sizeof(char));
+
+        // mark the chosen task as duplicated by this process
+        for (line = buffer; *line; line = next)
+        {
+            next = strchr(line, '\n');
+            next = next ? next + 1 : line + strlen(line);
+
+            if (line[0] == 'R'
+                && sscanf(line, "R %lld %d %d %lf %n", &id, &owner, &copy, &start, &offset) == 4
+                && id == best_id)
+            {
+                *task_id = id;
+                *command = strndup(line + offset, next - line - offset - (next[-1] == '\n'));
+                length += sprintf(output + length, "R %lld %d %d %.3f %s\n", id, owner, rank, start, *command);
+                continue;
+            }
+
+            memcpy(output + length, line, next - line);
+            length += next - line;
+        }
+
+        write_locked_file(fd, output, length);
+        free(output);
+    }
+
+    unlock_file(&fl, fd, running_file);
+    close(fd);
+    free(buffer);
+    free(run_times);
+
+    if (best_id != -1) return 1;
+    else if (running > 0) return 0;
+    else return -1;
+}
+
+/* Find the predicted run time of a task
+
+   The prediction is given in a trailing comment of the task, e.g.
+   "# runtime=3600", as for taskfarmer-sim.
+
+   Arguments:
+
+     const char *command       system command
+     size_t length             length of command
+
+   Returns:
+
+     double                    predicted run time (seconds), or 0 if there
+                               is none
+*/
+double predicted_run_time(const char *command, size_t length)
+{
+    const char *comment, *annotation;
+    size_t n = strlen(RUNTIME_ANNOTATION);
+
+    if ((comment = memrchr(command, '#', length)) == NULL) return 0;
+
+    annotation = memmem(comment, command + length - comment, RUNTIME_ANNOTATION, n);
+
+    return annotation ? atof(annotation + n) : 0;
+}
+
+// record used to find duplicate tasks
+typedef struct
+{
+    unsigned long long hash;
+    long long length;
+    long long index;
+    int rank;
+} task_hash;
+
+// Comparison function for sorting task hashes (ties are broken by file order)
+static int compare_task_hashes(const void *a, const void *b)
+{
+    const task_hash *x = a, *y = b;
+
+    if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+    if (x->length != y->length) return (x->length > y->length) - (x->length < y->length);
+    if (x->rank != y->rank) return (x->rank > y->rank) - (x->rank < y->rank);
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Comparison function for sorting pointers to task hashes
+static int compare_task_hash_pointers(const void *a, const void *b)
+{
+    return compare_task_hashes(*(task_hash * const *) a, *(task_hash * const *) b);
+}
+
+/* Send task hash records to their destination processes
+
+   Arguments:
+
+     task_hash *records        array of records
+     long long num_records     number of records
+     int *destinations         destination process of each record
+     int size                  number of processes
+     long long *num_received   pointer to number of records received
+
+   Returns:
+
+     task_hash *               array of received records (caller must free)
+*/
+static task_hash *exchange_task_hashes(task_hash *records, long long num_records,
+    int *destinations, int size, long long *num_received)
+{
+    int i;
+    long long n;
+    int *send_counts = calloc(size, sizeof(int));
+    int *send_displs = calloc(size, sizeof(int));
+    int *recv_counts = calloc(size, sizeof(int));
+    int *recv_displs = calloc(size, sizeof(int));
+    int *fill = calloc(size, sizeof(int));
+    task_hash *sorted = malloc((num_records + 1) * sizeof(task_hash));
+    task_hash *received;
+
+    // group records by destination
+    for (n = 0; n < num_records; n++)
+        send_counts[destinations[n]] += sizeof(task_hash);
+
+    for (i = 1; i < size; i++)
+        send_displs[i] = send_displs[i-1] + send_counts[i-1];
+
+    for (n = 0; n < num_records; n++)
+    {
+        i = destinations[n];
+        sorted[send_displs[i]/sizeof(task_hash) + fill[i]++] = records[n];
+    }
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (i = 1; i < size; i++)
+        recv_displs[i] = recv_displs[i-1] + recv_counts[i-1];
+
+    *num_received = (recv_displs[size-1] + recv_counts[size-1]) / sizeof(task_hash);
+    received = malloc((*num_received + 1) * sizeof(task_hash));
+
+    MPI_Alltoallv(sorted, send_counts, send_displs, MPI_BYTE,
+        received, recv_counts, recv_displs, MPI_BYTE, MPI_COMM_WORLD);
+
+    free(send_counts);
+    free(send_displs);
+    free(recv_counts);
+    free(recv_displs);
+    free(fill);
+    free(sorted);
+
+    return received;
+}
+
+// size of a task line record sent between processes, keeping records aligned
+#define TASK_LINE_SIZE(length) (sizeof(task_hash) + (((length) + 7) & ~7LL))
+
+/* Send the lines named by task hash records to the processes that own the
+   hashes, so that lines with equal hashes can be compared byte for byte
+
+   Arguments:
+
+     task_hash *requests       array of records for lines held by this process
+     long long num_requests    number of records
+     char **lines              start of each line held by this process, by index
+     int size                  number of processes
+     long long *num_received   pointer to number of records received
+
+   Returns:
+
+     char *                    received records, each a task_hash followed by
+                               the line (caller must free)
+*/
+static char *exchange_task_lines(task_hash *requests, long long num_requests, char **lines,
+    int size, long long *num_received)
+{
+    int i;
+    long long n;
+    int *send_counts = calloc(size, sizeof(int));
+    int *send_displs = calloc(size, sizeof(int));
+    int *recv_counts = calloc(size, sizeof(int));
+    int *recv_displs = calloc(size, sizeof(int));
+    int *fill = calloc(size, sizeof(int));
+    char *sorted, *received, *record;
+
+    // group records by destination
+    for (n = 0; n < num_requests; n++)
+        send_counts[requests[n].hash % size] += TASK_LINE_SIZE(requests[n].length);
+
+    for (i = 1; i < size; i++)
+        send_displs[i] = send_displs[i-1] + send_counts[i-1];
+
+    sorted = malloc(send_displs[size-1] + send_counts[size-1] + 1);
+
+    for (n = 0; n < num_requests; n++)
+    {
+        i = requests[n].hash % size;
+        record = sorted + send_displs[i] + fill[i];
+        memcpy(record, &requests[n], sizeof(task_hash));
+        memcpy(record + sizeof(task_hash), lines[requests[n].index], requests[n].length);
+        fill[i] += TASK_LINE_SIZE(requests[n].length);
+    }
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (i = 1; i < size; i++)
+        recv_displs[i] = recv_displs[i-1] + recv_counts[i-1];
+
+    received = malloc(recv_displs[size-1] + recv_counts[size-1] + 1);
+
+    MPI_Alltoallv(sorted, send_counts, send_displs, MPI_BYTE,
+        received, recv_counts, recv_displs, MPI_BYTE, MPI_COMM_WORLD);
+
+    // count the records
+    *num_received = 0;
+    for (record = received; record < received + recv_displs[size-1] + recv_counts[size-1]; (*num_received)++)
+        record += TASK_LINE_SIZE(((task_hash *) record)->length);
+
+    free(send_counts);
+    free(send_displs);
+    free(recv_counts);
+    free(recv_displs);
+    free(fill);
+    free(sorted);
+
+    return received;
+}
+
+static char *take_journal(queue_backend*, int);
+
+/* Validate and clean the task file in parallel
+
+   The task file is divided into equal byte ranges and each process handles
+   the lines that start within its range. Duplicates are found by sending a
+   hash of each line to the process that owns that hash, which then fetches
+   the lines whose hashes match and compares them. The cleaned task
+   file is written back in place while rank 0 holds the task file lock.
+   Any macro header is left in place, and tasks are checked with their
+   macros expanded.
+
+   Arguments:
+
+     const char *task_file     path to task file
+     int rank                  process id
+     int size                  number of processes
+     bool check_inputs         whether to check that input files exist
+     queue_backend *queue      queue backend, used to skip claimed tasks (or NULL)
+
+   Returns:
+
+     bool                      whether the task file is free of errors
+*/
+bool preflight_task_file(const char *task_file, int rank, int size, bool check_inputs,
+    queue_backend *queue)
+{
+    int i, fd;
+    int *destinations;
+    off_t start, end, length, capacity;
+    ssize_t n;
+    size_t line_length, output_length = 0;
+    long long counts[6] = { 0 }, totals[6];
+    long long num_lines = 0, first_line = 0, index, offset = 0, total, base = 0;
+    long long num_hashes = 0, num_received, num_duplicates = 0, num_candidates = 0, group, j;
+    char previous = '\n';
+    char *buffer, *begin, *line, *next, *keep, *expanded, *candidates, *record;
+    char **lines;
+    const char *error;
+    struct stat file_stats;
+    struct flock fl;
+    task_hash *hashes, *received, *duplicates;
+    task_hash **members;
+    macro_table macros = { 0 };
+
+    // line states
+    enum { DROP, KEEP, KEEP_DOS };
+
+    // counters
+    enum { TASKS, BLANK, COMMENTS, DOS, DUPLICATES, ERRORS };
+
+    if ((fd = open(task_file, O_RDWR)) == -1)
+    {
+        perror("[ERROR] open");
+        return false;
+    }
+
+    // stop anyone else from modifying the file while it is checked
+    if (rank == 0)
+    {
+        // the journal backend serialises claims on its guard file
+        if (queue != NULL && queue->take == take_journal) lock_task_file(queue, &fl);
+        else
+        {
+            fl.l_whence = SEEK_SET;
+            fl.l_start = 0;
+            fl.l_len = 0;
+            fl.l_pid = getpid();
+            lock_file(&fl, fd, task_file);
+        }
+
+        // only check tasks that haven't been claimed
+        if (queue != NULL) base = claimed_offset(queue, fd);
+    }
+
+    MPI_Bcast(&base, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    if (base > file_stats.st_size) base = 0;
+
+    // the macro header is left as it is
+    if (base < load_macro_header(&macros, fd)) base = macros.header_length;
+
+    start = base + ((file_stats.st_size - base) * rank) / size;
+    end = base + ((file_stats.st_size - base) * (rank + 1)) / size;
+
+    // a line belongs to the process whose range contains its first character
+    if (start > base && pread(fd, &previous, 1, start - 1) != 1)
+    {
+        perror("[ERROR] pread");
+        fail();
+    }
+
+    // read the range, then extend it to the end of the last line
+    capacity = end - start + 65536;
+    buffer = malloc(capacity + 1);
+    length = 0;
+
+    do
+    {
+        if (length == capacity)
+        {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity + 1);
+        }
+
+        if ((n = pread(fd, buffer + length, capacity - length, start + length)) == -1)
+        {
+            perror("[ERROR] pread");
+            fail();
+        }
+
+        length += n;
+    }
+    while (n > 0 && (length < end - start
+        || memchr(buffer + end - start, '\n', length - (end - start)) == NULL));
+
+    buffer[length] = '\0';
+
+    // skip the partial line owned by the previous process
+    begin = buffer;
+    if (previous != '\n')
+    {
+        begin = memchr(buffer, '\n', length);
+        begin = begin ? begin + 1 : buffer + length;
+    }
+
+    // count the lines so that global line numbers can be reported
+    for (line = begin; line < buffer + (end - start) && line < buffer + length; num_lines++)
+    {
+        line = memchr(line, '\n', buffer + length - line);
+        line = line ? line + 1 : buffer + length;
+    }
+
+    MPI_Exscan(&num_lines, &first_line, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) first_line = 0;
+
+    keep = malloc(num_lines + 1);
+    lines = malloc((num_lines + 1) * sizeof(char *));
+    hashes = malloc((num_lines + 1) * sizeof(task_hash));
+    destinations = malloc((num_lines + 1) * sizeof(int));
+
+    // check each line
+    for (index = 0, line = begin; index < num_lines; index++, line = next)
+    {
+        next = memchr(line, '\n', buffer + length - line);
+        line_length = next ? next - line : buffer + length - line;
+        next = next ? next + 1 : buffer + length;
+
+        keep[index] = KEEP;
+        lines[index] = line;
+
+        // DOS line ending
+        if (line_length > 0 && line[line_length - 1] == '\r')
+        {
+            keep[index] = KEEP_DOS;
+            line_length--;
+            counts[DOS]++;
+        }
+
+        // blank and comment lines
+        for (i = 0; i < (int) line_length && (line[i] == ' ' || line[i] == '\t'); i++);
+
+        if (i == (int) line_length || line[i] == '#')
+        {
+            keep[index] = DROP;
+            counts[i == (int) line_length ? BLANK : COMMENTS]++;
+            continue;
+        }
+
+        counts[TASKS]++;
+
+        // check tasks as they will be run
+        if (macros.num_macros > 0 && memmem(line, line_length, MACRO_OPEN, strlen(MACRO_OPEN)) != NULL)
+        {
+            expanded = expand_macros(&macros, strndup(line, line_length));
+            error = check_task(expanded, strlen(expanded), check_inputs);
+            free(expanded);
+        }
+        else error = check_task(line, line_length, check_inputs);
+
+        if (error != NULL)
+        {
+            if (counts[ERRORS]++ < 10)
+                fprintf(stderr, "[ERROR]: Task file line %lld: %s\n", first_line + index + 1, error);
+        }
+
+        hashes[num_hashes].hash = hash_task(line, line_length);
+        hashes[num_hashes].length = line_length;
+        hashes[num_hashes].index = index;
+        hashes[num_hashes].rank = rank;
+        destinations[num_hashes] = hashes[num_hashes].hash % size;
+        num_hashes++;
+    }
+
+    // send each hash to the process that owns it
+    received = exchange_task_hashes(hashes, num_hashes, destinations, size, &num_received);
+    qsort(received, num_received, sizeof(task_hash), compare_task_hashes);
+
+    // lines whose hash and length match another line may be duplicates
+    duplicates = malloc((num_received + 1) * sizeof(task_hash));
+    destinations = realloc(destinations, (num_received + 1) * sizeof(int));
+
+    for (index = 0; index < num_received; index = j)
+    {
+        for (j = index + 1; j < num_received && received[j].hash == received[index].hash
+            && received[j].length == received[index].length; j++);
+
+        if (j - index == 1) continue;
+
+        for (; index < j; index++)
+        {
+            duplicates[num_candidates] = received[index];
+            destinations[num_candidates] = received[index].rank;
+            num_candidates++;
+        }
+    }
+
+    // fetch the candidates from the processes that own the lines
+    free(received);
+    received = exchange_task_hashes(duplicates, num_candidates, destinations, size, &num_received);
+    candidates = exchange_task_lines(received, num_received, lines, size, &num_candidates);
+
+    members = malloc((num_candidates + 1) * sizeof(task_hash *));
+    for (index = 0, record = candidates; index < num_candidates; index++)
+    {
+        members[index] = (task_hash *) record;
+        record += TASK_LINE_SIZE(members[index]->length);
+    }
+
+    qsort(members, num_candidates, sizeof(task_hash *), compare_task_hash_pointers);
+
+    // all but the first occurrence of each line are duplicates
+    for (group = 0; group < num_candidates; group = index)
+    {
+        for (index = group + 1; index < num_candidates && members[index]->hash == members[group]->hash
+            && members[index]->length == members[group]->length; index++)
+        {
+            // compare with the earlier lines of the group that were kept
+            for (j = group; j < index; j++)
+            {
+                if (members[j] != NULL && memcmp(members[j] + 1, members[index] + 1, members[index]->length) == 0)
+                    break;
+            }
+
+            if (j < index)
+            {
+                duplicates[num_duplicates] = *members[index];
+                destinations[num_duplicates] = members[index]->rank;
+                num_duplicates++;
+                members[index] = NULL;
+            }
+        }
+    }
+
+    // return the duplicates to the processes that own the lines
+    free(received);
+    received = exchange_task_hashes(duplicates, num_duplicates, destinations, size, &num_received);
+
+    for (index = 0; index < num_received; index++)
+    {
+        keep[received[index].index] = DROP;
+        counts[DUPLICATES]++;
+        counts[TASKS]--;
+    }
+
+    MPI_Allreduce(counts, totals, 6, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        printf("[INFO]: Preflight: %lld tasks, removed %lld blank, %lld comment and %lld duplicate lines, "
+            "converted %lld DOS line endings, found %lld errors\n",
+            totals[TASKS], totals[BLANK], totals[COMMENTS], totals[DUPLICATES], totals[DOS], totals[ERRORS]);
+    }
+
+    // rewrite the task file if anything needs cleaning
+    if (totals[ERRORS] == 0 && totals[BLANK] + totals[COMMENTS] + totals[DUPLICATES] + totals[DOS] > 0)
+    {
+        // compact the lines that are kept
+        for (index = 0, line = begin; index < num_lines; index++, line = next)
+        {
+            next = memchr(line, '\n', buffer + length - line);
+            line_length = next ? next - line + 1 : buffer + length - line;
+            next = next ? next + 1 : buffer + length;
+
+            if (keep[index] == KEEP_DOS)
+            {
+                line_length -= (line[line_length - 1] == '\n') + 1;
+                memmove(buffer + output_length, line, line_length);
+                output_length += line_length;
+                buffer[output_length++] = '\n';
+            }
+
+            else if (keep[index] == KEEP)
+            {
+                memmove(buffer + output_length, line, line_length);
+                output_length += line_length;
+            }
+        }
+
+        total = output_length;
+        MPI_Exscan(&total, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if (rank == 0) offset = 0;
+        MPI_Allreduce(MPI_IN_PLACE, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+        offset += base;
+        total += base;
+
+        // all reads are complete, so the file can be overwritten in place
+        if (pwrite(fd, buffer, output_length, offset) != (ssize_t) output_length)
+        {
+            perror("[ERROR] pwrite");
+            fail();
+        }
+
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        if (rank == 0 && ftruncate(fd, total) == -1)
+        {
+            perror("[ERROR] ftruncate");
+            fail();
+        }
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        if (queue != NULL && queue->take == take_journal) unlock_task_file(queue, &fl, fd);
+        else unlock_file(&fl, fd, task_file);
+    }
+    close(fd);
+
+    free(buffer);
+    free(keep);
+    free(lines);
+    free(hashes);
+    free(destinations);
+    free(received);
+    free(duplicates);
+    free(candidates);
+    free(members);
+    free_macro_table(&macros);
+
+    return totals[ERRORS] == 0;
+}
+
+/* Check a task for syntax errors and missing input files
+
+   Arguments:
+
+     const char *task          task string
+     size_t length             length of task string
+     bool check_inputs         whether to check that input files exist
+
+   Returns:
+
+     const char *              description of the error, or NULL
+*/
+const char *check_task(const char *task, size_t length, bool check_inputs)
+{
+    size_t i, j;
+    bool single = false, quoted = false;
+    char path[4096];
+    struct stat file_stats;
+
+    for (i = 0; i < length; i++)
+    {
+        if (task[i] == '\0') return "null character";
+
+        if (single)
+        {
+            if (task[i] == '\'') single = false;
+            continue;
+        }
+
+        if (task[i] == '\\')
+        {
+            if (++i == length) return "trailing line continuation";
+            continue;
+        }
+
+        if (task[i] == '"') quoted = !quoted;
+        else if (task[i] == '\'' && !quoted) single = true;
+
+        // an unquoted word starting with a hash starts a comment
+        else if (task[i] == '#' && !quoted && (i == 0 || strchr(" \t;|&()<>", task[i-1]) != NULL)) break;
+
+        // standard input redirection (but not a here document or process substitution)
+        else if (check_inputs && !quoted && task[i] == '<' && i + 1 < length
+            && task[i+1] != '<' && task[i+1] != '(' && task[i+1] != '&'
+            && (i == 0 || task[i-1] != '<'))
+        {
+            for (j = i + 1; j < length && (task[j] == ' ' || task[j] == '\t'); j++);
+            for (i = j; i < length && strchr(" \t;|&<>()", task[i]) == NULL; i++);
+
+            if (i > j && i - j < sizeof(path) && memchr(task + j, '$', i - j) == NULL
+                && memchr(task + j, '\'', i - j) == NULL && memchr(task + j, '"', i - j) == NULL)
+            {
+                memcpy(path, task + j, i - j);
+                path[i - j] = '\0';
+
+                if (stat(path, &file_stats) == -1) return "missing input file";
+            }
+
+            i--;
+        }
+    }
+
+    if (single || quoted) return "unterminated quote";
+
+    return NULL;
+}
+
+/* Hash a task string (64-bit FNV-1a)
+
+   Arguments:
+
+     const char *task          task string
+     size_t length             length of task string
+
+   Returns:
+
+     unsigned long long        hash value
+*/
+unsigned long long hash_task(const char *task, size_t length)
+{
+    size_t i;
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) task[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Map a character onto the alphabet used for command matching
+static unsigned char fold_character(unsigned char c)
+{
+    // word separators are treated as a space
+    if (c == '\t' || c == ';' || c == '|' || c == '&' || c == '(' || c == ')') return ' ';
+
+    return c;
+}
+
+/* Compile a list of commands into an Aho-Corasick automaton
+
+   Each command is matched as a separate word, i.e. the pattern " CMD " is
+   searched for in the task with a space added to either end.
+
+   Arguments:
+
+     command_matcher *matcher  pointer to command matcher
+     char **commands           array of commands
+     int num_commands          number of commands
+*/
+void build_command_matcher(command_matcher *matcher, char **commands, int num_commands)
+{
+    int i, c, state, head = 0, tail = 0, capacity = 1;
+    int *fail, *queue;
+    char *pattern, *p;
+
+    // the number of states is bounded by the total pattern length
+    for (i=0;i<num_commands;i++)
+        capacity += strlen(commands[i]) + 2;
+
+    matcher->next = malloc(capacity * sizeof(*matcher->next));
+    matcher->match = calloc(capacity, sizeof(bool));
+    matcher->num_states = 1;
+    memset(matcher->next[0], -1, sizeof(*matcher->next));
+
+    // build the trie
+    for (i=0;i<num_commands;i++)
+    {
+        state = 0;
+        pattern = malloc(strlen(commands[i]) + 3);
+        sprintf(pattern, " %s ", commands[i]);
+
+        for (p = pattern; *p; p++)
+        {
+            c = fold_character(*p);
+
+            if (matcher->next[state][c] == -1)
+            {
+                memset(matcher->next[matcher->num_states], -1, sizeof(*matcher->next));
+                matcher->next[state][c] = matcher->num_states++;
+            }
+
+            state = matcher->next[state][c];
+        }
+
+        matcher->match[state] = true;
+        free(pattern);
+    }
+
+    // breadth-first construction of failure links, completing the transition table
+    fail = calloc(matcher->num_states, sizeof(int));
+    queue = malloc(matcher->num_states * sizeof(int));
+
+    for (c=0;c<256;c++)
+    {
+        if (matcher->next[0][c] == -1) matcher->next[0][c] = 0;
+        else
+        {
+            fail[matcher->next[0][c]] = 0;
+            queue[tail++] = matcher->next[0][c];
+        }
+    }
+
+    while (head < tail)
+    {
+        state = queue[head++];
+        matcher->match[state] |= matcher->match[fail[state]];
+
+        for (c=0;c<256;c++)
+        {
+            if (matcher->next[state][c] == -1)
+            {
+                matcher->next[state][c] = matcher->next[fail[state]][c];
+            }
+            else
+            {
+                fail[matcher->next[state][c]] = matcher->next[fail[state]][c];
+                queue[tail++] = matcher->next[state][c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+}
+
+/* Release the memory held by a command matcher
+
+   Arguments:
+
+     command_matcher *matcher  pointer to command matcher
+*/
+void free_command_matcher(command_matcher *matcher)
+{
+    free(matcher->next);
+    free(matcher->match);
+}
+
+/* Check whether a task is free of disallowed commands
+
+   Arguments:
+
+     const command_matcher *matcher
+                               pointer to command matcher
+     const char *task          task string
+
+   Returns:
+
+     bool                      whether the task is allowed
+*/
+bool is_allowed(const command_matcher *matcher, const char *task)
+{
+    int state;
+
+    if (matcher->num_states == 1) return true;
+
+    // leading space
+    state = matcher->next[0][' '];
+
+    for (; *task; task++)
+    {
+        state = matcher->next[state][fold_character(*task)];
+        if (matcher->match[state]) return false;
+    }
+
+    // trailing space
+    return !matcher->match[matcher->next[state][' ']];
+}
+
+/* Select the format of the tasks in the task file
+
+   In the "line" format each task is a line, run with the shell. In the
+   "argv0" format each task is a record of NUL terminated fields, ended by
+   an extra NUL, and is run directly with posix_spawnp(). Fields starting
+   with ARGV0_TAG and a tag character set the environment and redirections,
+   and the others are the arguments, starting with the program.
+
+   Arguments:
+
+     const char *name          name of the format
+
+   Returns:
+
+     bool                      false if the format doesn't exist
+*/
+bool set_task_format(const char *name)
+{
+    int i;
+
+    for (i=0;task_format_names[i]!=NULL;i++)
+    {
+        if (strcmp(name, task_format_names[i]) == 0)
+        {
+            task_format = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Check whether a task file format exists
+
+   Arguments:
+
+     const char *name          name of the format
+
+   Returns:
+
+     bool                      whether the format exists
+*/
+bool valid_task_format(const char *name)
+{
+    int i;
+
+    for (i=0;task_format_names[i]!=NULL;i++)
+        if (strcmp(name, task_format_names[i]) == 0) return true;
+
+    return false;
+}
+
+// Length of the terminator of a task record in the task file
+static size_t terminator_length(void)
+{
+    return task_format == TASK_FORMAT_ARGV0 ? 2 : 1;
+}
+
+/* Find the end of the task record at the start of a buffer
+
+   Arguments:
+
+     const char *buffer        start of record
+     size_t length             bytes available
+
+   Returns:
+
+     const char *              start of the record terminator, or NULL if
+                               the record isn't complete
+*/
+static const char *find_record_end(const char *buffer, size_t length)
+{
+    const char *p;
+
+    if (task_format == TASK_FORMAT_LINE) return memchr(buffer, '\n', length);
+
+    for (p = buffer; (p = memchr(p, '\0', buffer + length - p)) != NULL; p++)
+        if (p + 1 < buffer + length && p[1] == '\0') return p;
+
+    return NULL;
+}
+
+// Count the task records in a buffer, including an unterminated last record
+static long long count_records(const char *buffer, size_t length)
+{
+    long long count = 0;
+    const char *p, *end;
+
+    for (p = buffer; p < buffer + length; count++)
+    {
+        end = find_record_end(p, buffer + length - p);
+        p = end ? end + terminator_length() : buffer + length;
+    }
+
+    return count;
+}
+
+// Copy a task record, which is terminated by two NULs in memory whatever the format
+static char *copy_record(const char *record, size_t length)
+{
+    char *copy = malloc(length + 2);
+
+    memcpy(copy, record, length);
+    copy[length] = copy[length + 1] = '\0';
+
+    return copy;
+}
+
+/* Find the length of a claimed task record, without its terminator
+
+   Arguments:
+
+     const char *record        claimed task
+
+   Returns:
+
+     size_t                    length of the record
+*/
+size_t record_length(const char *record)
+{
+    const char *p = record;
+
+    if (task_format == TASK_FORMAT_LINE) return strlen(record);
+
+    while (*p != '\0') p += strlen(p) + 1;
+
+    return p == record ? 0 : (size_t) (p - record - 1);
+}
+
+/* Render a claimed task record as a single line, for messages and the ledger
+
+   Fields of argv0 records are separated by spaces, and redirections are
+   written as they would be for the shell, although nothing is quoted.
+
+   Arguments:
+
+     const char *record        claimed task
+
+   Returns:
+
+     char *                    printable task (caller must free)
+*/
+char *record_display(const char *record)
+{
+    size_t length = record_length(record);
+    char *display = malloc(length + 2 * (length / 2 + 1) + 1), *out = display;
+    const char *field;
+
+    if (task_format == TASK_FORMAT_LINE) return strcpy(display, record);
+
+    for (field = record; *field != '\0'; field += strlen(field) + 1)
+    {
+        if (out != display) *out++ = ' ';
+
+        if (field[0] == ARGV0_TAG && field[1] != '\0')
+        {
+            if (field[1] == ARGV0_STDIN) out = stpcpy(out, "<");
+            else if (field[1] == ARGV0_STDOUT) out = stpcpy(out, ">");
+            else if (field[1] == ARGV0_APPEND) out = stpcpy(out, ">>");
+            else if (field[1] == ARGV0_STDERR) out = stpcpy(out, "2>");
+
+            out = stpcpy(out, field + 2);
+        }
+        else out = stpcpy(out, field);
+    }
+
+    *out = '\0';
+
+    return display;
+}
+
+static void clear_macros(macro_table*);
+
+/* Parse the macro definitions at the start of a task file
+
+   The header is the run of "@def NAME=VALUE" lines at the start of the task
+   file. It is kept in place as tasks are claimed, so that every process can
+   read it, and each "@{NAME}" in a task is replaced by VALUE once the task
+   has been claimed. Macros aren't used with the argv0 format.
+
+   Arguments:
+
+     macro_table *macros       pointer to macro table (replaced)
+     const char *buffer        start of the task file
+     size_t length             size of buffer
+
+   Returns:
+
+     off_t                     byte length of the header
+*/
+off_t parse_macro_header(macro_table *macros, const char *buffer, size_t length)
+{
+    size_t prefix = strlen(MACRO_PREFIX);
+    const char *line = buffer, *end = buffer + length, *next, *stop, *equals;
+
+    clear_macros(macros);
+    macros->loaded = true;
+
+    if (task_format != TASK_FORMAT_LINE) return 0;
+
+    while (line < end)
+    {
+        // the buffer may end part way through the prefix of a definition
+        if ((size_t) (end - line) < prefix)
+        {
+            if (memcmp(line, MACRO_PREFIX, end - line) == 0) line = end;
+            break;
+        }
+
+        if (memcmp(line, MACRO_PREFIX, prefix) != 0) break;
+
+        next = memchr(line, '\n', end - line);
+        stop = next ? next : end;
+        if (stop > line && stop[-1] == '\r') stop--;
+
+        // lines without a value define nothing, but are still part of the header
+        if ((equals = memchr(line + prefix, '=', stop - line - prefix)) != NULL)
+        {
+            macros->names = realloc(macros->names, (macros->num_macros + 1) * sizeof(char *));
+            macros->values = realloc(macros->values, (macros->num_macros + 1) * sizeof(char *));
+            macros->names[macros->num_macros] = strndup(line + prefix, equals - line - prefix);
+            macros->values[macros->num_macros] = strndup(equals + 1, stop - equals - 1);
+            macros->num_macros++;
+        }
+
+        macros->header_lines++;
+        line = next ? next + 1 : end;
+    }
+
+    macros->header_length = line - buffer;
+
+    return macros->header_length;
+}
+
+/* Read the macro definitions at the start of a task file
+
+   Arguments:
+
+     macro_table *macros       pointer to macro table (replaced)
+     int fd                    locked task file descriptor
+
+   Returns:
+
+     off_t                     byte length of the header
+*/
+off_t load_macro_header(macro_table *macros, int fd)
+{
+    ssize_t n;
+    size_t length = 0, capacity = 4096;
+    char *buffer = malloc(capacity);
+
+    // read until the first task, or the end of the file
+    while (true)
+    {
+        if ((n = pread(fd, buffer + length, capacity - length, length)) == -1)
+        {
+            perror("[ERROR] pread");
+            fail();
+        }
+
+        length += n;
+
+        if (parse_macro_header(macros, buffer, length) < (off_t) length || n == 0) break;
+
+        if (length == capacity)
+        {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+
+    free(buffer);
+
+    return macros->header_length;
+}
+
+// Find a macro by name, returning its index (or -1)
+static int find_macro(const macro_table *macros, const char *name, size_t length)
+{
+    int i;
+
+    for (i=0;i<macros->num_macros;i++)
+        if (strncmp(macros->names[i], name, length) == 0 && macros->names[i][length] == '\0') return i;
+
+    return -1;
+}
+
+// Append to the expansion buffer of a macro table, growing it if needed
+static void append_expansion(macro_table *macros, size_t *length, const char *text, size_t n)
+{
+    // room is kept for the record terminator
+    if (*length + n + 2 > macros->expansion_size)
+    {
+        macros->expansion_size = 2 * (*length + n + 2);
+        if ((macros->expansion = realloc(macros->expansion, macros->expansion_size)) == NULL)
+        {
+            perror("[ERROR] realloc");
+            fail();
+        }
+    }
+
+    memcpy(macros->expansion + *length, text, n);
+    *length += n;
+}
+
+// Write a task with its macro references replaced to the expansion buffer, returning its length
+static size_t substitute_macros(macro_table *macros, const char *command)
+{
+    int i;
+    size_t n, length = 0, open = strlen(MACRO_OPEN);
+    const char *reference, *close;
+
+    while ((reference = strstr(command, MACRO_OPEN)) != NULL)
+    {
+        close = strchr(reference + open, MACRO_CLOSE);
+        i = close ? find_macro(macros, reference + open, close - reference - open) : -1;
+
+        // copy up to the reference, or past its opening if it isn't a macro
+        n = (i == -1 ? reference + open : reference) - command;
+        append_expansion(macros, &length, command, n);
+        command += n;
+
+        if (i != -1)
+        {
+            append_expansion(macros, &length, macros->values[i], strlen(macros->values[i]));
+            command = close + 1;
+        }
+    }
+
+    append_expansion(macros, &length, command, strlen(command));
+    macros->expansion[length] = '\0';
+    macros->expansion[length + 1] = '\0';
+
+    return length;
+}
+
+/* Replace the macro references in a claimed task
+
+   References to undefined macros are left as they are, and values aren't
+   expanded again. The task is expanded into a buffer kept by the macro
+   table, which only grows, and copied back over the claimed task, whose
+   allocation is usually large enough (or can be extended in place), so
+   claims don't allocate a new string for every task.
+
+   Arguments:
+
+     macro_table *macros       pointer to macro table
+     char *command             claimed task (reallocated if it is replaced)
+
+   Returns:
+
+     char *                    expanded task (caller must free)
+*/
+char *expand_macros(macro_table *macros, char *command)
+{
+    size_t length;
+    char *expanded;
+
+    if (macros->num_macros == 0 || strstr(command, MACRO_OPEN) == NULL) return command;
+
+    length = substitute_macros(macros, command);
+
+    if ((expanded = realloc(command, length + 2)) == NULL)
+    {
+        perror("[ERROR] realloc");
+        fail();
+    }
+
+    return memcpy(expanded, macros->expansion, length + 2);
+}
+
+// Release the macros of a macro table, keeping its expansion buffer
+static void clear_macros(macro_table *macros)
+{
+    int i;
+    char *expansion = macros->expansion;
+    size_t expansion_size = macros->expansion_size;
+
+    for (i=0;i<macros->num_macros;i++)
+    {
+        free(macros->names[i]);
+        free(macros->values[i]);
+    }
+
+    free(macros->names);
+    free(macros->values);
+    memset(macros, 0, sizeof(macro_table));
+
+    macros->expansion = expansion;
+    macros->expansion_size = expansion_size;
+}
+
+// Release the macros and expansion buffer of a macro table, leaving it empty
+void free_macro_table(macro_table *macros)
+{
+    clear_macros(macros);
+    free(macros->expansion);
+
+    macros->expansion = NULL;
+    macros->expansion_size = 0;
+}
+
+/* Claim the first task by rewriting the task file without it
+
+   Any macro header is kept at the start of the file, and reparsed, since
+   the whole file is read anyway.
+
+   Arguments:
+
+     int fd                    locked task file descriptor
+     macro_table *macros       pointer to macro table (or NULL to ignore macros)
+
+   Returns:
+
+     char *                    claimed task (caller must free), or NULL if
+                               the task file is empty
+*/
+char *claim_task_rewrite(int fd, macro_table *macros)
+{
+    off_t size, header;
+    size_t length, claimed;
+    char *buffer, *task, *newline, *command;
+
+    // read task file into buffer
+    buffer = read_locked_file(fd, &size);
+    header = macros ? parse_macro_header(macros, buffer, size) : 0;
+
+    if (size == header)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    // read first task
+    task = buffer + header;
+    newline = (char *) find_record_end(task, size - header);
+    length = newline ? newline - task : size - header;
+    command = copy_record(task, length);
+
+    // write the header and remaining tasks back to the file
+    claimed = newline ? length + terminator_length() : length;
+    memmove(task, task + claimed, size - header - claimed);
+    write_locked_file(fd, buffer, size - claimed);
+
+    free(buffer);
+
+    return command;
+}
+
+static char *read_task_at(int, long long, long long*);
+
+/* Claim the task at the queue offset and advance the offset
+
+   Any macro header is read when the queue is started from the beginning of
+   the task file (or hasn't been read yet), and is kept when the task file is
+   truncated.
+
+   Arguments:
+
+     int fd                    locked task file descriptor
+     int offset_fd             queue offset file descriptor
+     macro_table *macros       pointer to macro table (or NULL to ignore macros)
+
+   Returns:
+
+     char *                    claimed task (caller must free), or NULL if
+                               all tasks have been claimed
+*/
+char *claim_task_cursor(int fd, int offset_fd, macro_table *macros)
+{
+    long long offset, next, header = 0;
+    char *command;
+    struct stat file_stats;
+
+    offset = read_queue_offset(offset_fd);
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    // the task file has been truncated
+    if (offset > file_stats.st_size) offset = 0;
+
+    if (macros != NULL)
+    {
+        if (offset == 0 || !macros->loaded) load_macro_header(macros, fd);
+        header = macros->header_length;
+    }
+
+    if (offset < header) offset = header;
+
+    // all tasks have been claimed, reclaim the space
+    if (offset >= file_stats.st_size)
+    {
+        if (offset > header)
+        {
+            if (ftruncate(fd, header) == -1)
+            {
+                perror("[ERROR] ftruncate");
+                fail();
+            }
+
+            write_queue_offset(offset_fd, header);
+        }
+
+        return NULL;
+    }
+
+    command = read_task_at(fd, offset, &next);
+    write_queue_offset(offset_fd, next);
+
+    return command;
+}
+
+/* Read the task that starts at a byte offset of the task file
+
+   Arguments:
+
+     int fd                    locked task file descriptor
+     long long offset          byte offset of the start of the task
+     long long *next           set to the byte offset of the following task
+
+   Returns:
+
+     char *                    task (caller must free)
+*/
+static char *read_task_at(int fd, long long offset, long long *next)
+{
+    ssize_t n;
+    size_t length = 0, capacity = 4096;
+    char *command, *newline = NULL;
+
+    // read up to the end of the next task
+    command = malloc(capacity + 2);
+
+    while (newline == NULL)
+    {
+        if (length == capacity)
+        {
+            capacity *= 2;
+            command = realloc(command, capacity + 2);
+        }
+
+        if ((n = pread(fd, command + length, capacity - length, offset + length)) == -1)
+        {
+            perror("[ERROR] pread");
+            fail();
+        }
+
+        if (n == 0) break;
+
+        // a terminator may straddle the previous read
+        newline = (char *) find_record_end(command + (length > 0 ? length - 1 : 0), n + (length > 0));
+        length += n;
+    }
+
+    if (newline) length = newline - command;
+    command[length] = command[length + 1] = '\0';
+
+    *next = offset + length + (newline != NULL ? terminator_length() : 0);
+
+    return command;
+}
+
+/* Read the queue offset
+
+   The offset is stored as a decimal number followed by a newline. An empty
+   file corresponds to an offset of zero.
+
+   Arguments:
+
+     int fd                    queue offset file descriptor
+
+   Returns:
+
+     long long                 byte offset of the next unclaimed task
+*/
+long long read_queue_offset(int fd)
+{
+    ssize_t n;
+    char buffer[32];
+
+    if ((n = pread(fd, buffer, sizeof(buffer) - 1, 0)) <= 0) return 0;
+
+    buffer[n] = '\0';
+
+    return atoll(buffer);
+}
+
+/* Write the queue offset
+
+   Arguments:
+
+     int fd                    queue offset file descriptor
+     long long offset          byte offset of the next unclaimed task
+*/
+void write_queue_offset(int fd, long long offset)
+{
+    int n;
+    char buffer[32];
+
+    n = snprintf(buffer, sizeof(buffer), "%lld\n", offset);
+
+    // the offset only shrinks when it is reset
+    if ((offset == 0 && ftruncate(fd, 0) == -1) || pwrite(fd, buffer, n, 0) != n)
+    {
+        perror("[ERROR] pwrite");
+        fail();
+    }
+}
+
+/* Select the engine used for queue and ledger I/O
+
+   With "uring", writes that must be synced are linked to their fdatasync()
+   and issued with a single system call, and ledger appends are issued
+   asynchronously, from an io_uring owned by this process. Otherwise plain
+   system calls are used.
+
+   Arguments:
+
+     const char *name          name of the I/O engine
+
+   Returns:
+
+     bool                      false if the engine doesn't exist or isn't
+                               supported, in which case plain system calls
+                               are used
+*/
+bool set_io_engine(const char *name)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+
+    close_io_engine();
+
+    if (strcmp(name, "uring") != 0) return strcmp(name, "sync") == 0;
+
+    memset(&params, 0, sizeof(params));
+
+    // io_uring may be missing from the kernel, or blocked by a seccomp filter
+    if ((ring.fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params)) == -1) return false;
+
+    ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_map_size > ring.sq_map_size) ring.sq_map_size = ring.cq_map_size;
+        ring.cq_map_size = 0;
+    }
+
+    ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_map = ring.cq_map_size == 0 ? ring.sq_map : mmap(NULL, ring.cq_map_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQES);
+
+    if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+        perror("[ERROR] mmap");
+        fail();
+    }
+
+    ring.sq_head = (unsigned *) ((char *) ring.sq_map + params.sq_off.head);
+    ring.sq_tail = (unsigned *) ((char *) ring.sq_map + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) ((char *) ring.sq_map + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) ((char *) ring.sq_map + params.sq_off.array);
+    ring.cq_head = (unsigned *) ((char *) ring.cq_map + params.cq_off.head);
+    ring.cq_tail = (unsigned *) ((char *) ring.cq_map + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) ((char *) ring.cq_map + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_map + params.cq_off.cqes);
+
+    return true;
+#else
+    return strcmp(name, "sync") == 0;
+#endif
+}
+
+/* Check whether an I/O engine exists
+
+   Arguments:
+
+     const char *name          name of the I/O engine
+
+   Returns:
+
+     bool                      whether the I/O engine exists
+*/
+bool valid_io_engine(const char *name)
+{
+    int i;
+
+    for (i=0;io_engine_names[i]!=NULL;i++)
+        if (strcmp(name, io_engine_names[i]) == 0) return true;
+
+    return false;
+}
+
+#ifdef HAVE_IO_URING
+/* Reap the completed io_uring requests
+
+   Asynchronous writes are identified by the index of their buffer, which is
+   freed. Other requests store their result.
+
+   Arguments:
+
+     ssize_t *results          results of synchronous requests, by index
+
+   Returns:
+
+     int                       number of synchronous requests completed
+*/
+static int reap_completions(ssize_t *results)
+{
+    int num_completed = 0;
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    for (;head!=tail;head++)
+    {
+        cqe = &ring.cqes[head & *ring.cq_mask];
+
+        if (cqe->user_data < IO_URING_ENTRIES)
+        {
+            if (cqe->res < 0)
+                fprintf(stderr, "[WARNING]: Asynchronous write failed: %s\n", strerror(-cqe->res));
+
+            free(ring.buffers[cqe->user_data]);
+            ring.buffers[cqe->user_data] = NULL;
+        }
+        else
+        {
+            results[cqe->user_data - IO_URING_ENTRIES] = cqe->res;
+            num_completed++;
+        }
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    return num_completed;
+}
+
+// Add a request to the io_uring submission queue
+static void queue_request(int op, int fd, const void *buffer, size_t length, off_t offset,
+    int flags, unsigned long long user_data)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+
+    if (op == IORING_OP_FSYNC) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit the queued io_uring requests and wait for the synchronous ones
+
+   Arguments:
+
+     int num_submit            number of queued requests
+     int num_wait              number of synchronous requests to wait for
+     ssize_t *results          results of synchronous requests, by index
+*/
+static void submit_requests(int num_submit, int num_wait, ssize_t *results)
+{
+    int n;
+
+    while (true)
+    {
+        num_wait -= reap_completions(results);
+
+        if (num_submit == 0 && num_wait <= 0) return;
+
+        n = syscall(__NR_io_uring_enter, ring.fd, num_submit, num_wait > 0 ? 1 : 0,
+            num_wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+
+            perror("[ERROR] io_uring_enter");
+            fail();
+        }
+
+        num_submit -= n;
+    }
+}
+#endif
+
+/* Write to a file and flush the data to disk
+
+   With the io_uring engine the write and fdatasync() are linked and issued
+   with one system call.
+
+   Arguments:
+
+     int fd                    file descriptor
+     const void *buffer        data to write
+     size_t length             size of buffer
+     off_t offset              file offset, or -1 for the current position
+
+   Returns:
+
+     bool                      whether the data was written in full and synced
+*/
+static bool write_and_sync(int fd, const void *buffer, size_t length, off_t offset)
+{
+#ifdef HAVE_IO_URING
+    ssize_t results[2];
+
+    if (ring.fd != -1)
+    {
+        queue_request(IORING_OP_WRITE, fd, buffer, length, offset, IOSQE_IO_LINK, IO_URING_ENTRIES);
+        queue_request(IORING_OP_FSYNC, fd, NULL, 0, 0, 0, IO_URING_ENTRIES + 1);
+        submit_requests(2, 2, results);
+
+        if (results[0] < 0) errno = -results[0];
+        else if (results[1] < 0) errno = -results[1];
+
+        return results[0] == (ssize_t) length && results[1] == 0;
+    }
+#endif
+
+    if (offset == -1) return write(fd, buffer, length) == (ssize_t) length && fdatasync(fd) == 0;
+
+    return pwrite(fd, buffer, length, offset) == (ssize_t) length && fdatasync(fd) == 0;
+}
+
+/* Append to a file without waiting for the write
+
+   With the io_uring engine the write completes in the background, and
+   failures are reported as warnings. Otherwise the data is written before
+   returning. The file may be closed straight away.
+
+   Arguments:
+
+     int fd                    file descriptor (opened with O_APPEND)
+     char *buffer              data to write (freed once written)
+     size_t length             size of buffer
+
+   Returns:
+
+     bool                      false if the write failed
+*/
+static bool append_async(int fd, char *buffer, size_t length)
+{
+    bool written;
+
+#ifdef HAVE_IO_URING
+    int slot;
+
+    if (ring.fd != -1)
+    {
+        // wait for a buffer slot if too many writes are in flight
+        while (true)
+        {
+            for (slot=0;slot<IO_URING_ENTRIES && ring.buffers[slot]!=NULL;slot++);
+            if (slot < IO_URING_ENTRIES) break;
+
+            if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+                && errno != EINTR)
+            {
+                perror("[ERROR] io_uring_enter");
+                fail();
+            }
+
+            reap_completions(NULL);
+        }
+
+        ring.buffers[slot] = buffer;
+        queue_request(IORING_OP_WRITE, fd, buffer, length, -1, 0, slot);
+        submit_requests(1, 0, NULL);
+
+        return true;
+    }
+#endif
+
+    written = write(fd, buffer, length) == (ssize_t) length;
+    free(buffer);
+
+    return written;
+}
+
+// Wait for any asynchronous writes, and release the io_uring
+void close_io_engine(void)
+{
+#ifdef HAVE_IO_URING
+    int slot;
+
+    if (ring.fd == -1) return;
+
+    for (slot=0;slot<IO_URING_ENTRIES;slot++)
+    {
+        while (ring.buffers[slot] != NULL)
+        {
+            if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+                && errno != EINTR) break;
+
+            reap_completions(NULL);
+        }
+    }
+
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_map_size);
+    munmap(ring.sq_map, ring.sq_map_size);
+    close(ring.fd);
+
+    ring.fd = -1;
+#endif
+}
+
+/* Check whether a queue backend exists
+
+   Arguments:
+
+     const char *name          name of the queue backend
+
+   Returns:
+
+     bool                      whether the backend exists
+*/
+bool valid_queue_backend(const char *name)
+{
+#ifdef HAVE_ZLIB
+    if (strcmp(name, "gzip") == 0) return true;
+#endif
+
+    return strcmp(name, "rewrite") == 0 || strcmp(name, "cursor") == 0 || strcmp(name, "journal") == 0;
+}
+
+/* Choose the queue backend and lock type to suit the task file system
+
+   Options set to "auto" are replaced by the best choice for the type of
+   file system holding the task file, as reported by statfs(). The local
+   file systems get the cursor backend with open file description locks.
+   NFS, Lustre and GPFS get the cursor backend, which avoids rewriting the
+   task file over the network, with POSIX locks, which they support across
+   nodes. BeeGFS only honours POSIX locks within a node unless global locks
+   are enabled, so gets lock files. Unknown file systems get the defaults.
+   Compressed task files always get the gzip backend.
+   The choice is made by the root process, printed, and broadcast, so all
+   processes agree. Must be called collectively.
+
+   Arguments:
+
+     taskfarmer_options *options    pointer to options to update
+     int rank                       rank of this process
+*/
+void select_queue_strategy(taskfarmer_options *options, int rank)
+{
+    int i = 0;
+    char path[1024], *slash;
+    struct statfs file_system;
+
+    bool auto_backend = strcmp(options->queue_backend, "auto") == 0;
+    bool auto_lock = strcmp(options->lock_type, "auto") == 0;
+
+    if (!auto_backend && !auto_lock) return;
+
+    if (rank == 0)
+    {
+        // the task file may not exist yet, so fall back to its directory
+        if (statfs(options->task_file, &file_system) == -1)
+        {
+            snprintf(path, sizeof(path), "%s", options->task_file);
+
+            if ((slash = strrchr(path, '/')) == NULL) strcpy(path, ".");
+            else if (slash == path) slash[1] = '\0';
+            else slash[0] = '\0';
+
+            // the task file can't be opened either, which is reported later
+            if (statfs(path, &file_system) == -1) file_system.f_type = 0;
+        }
+
+        while (file_systems[i].name != NULL
+            && file_systems[i].magic != ((unsigned long) file_system.f_type & 0xffffffff)) i++;
+
+        if (auto_backend) strcpy(options->queue_backend, file_systems[i].queue_backend);
+        if (auto_lock) strcpy(options->lock_type, file_systems[i].lock_type);
+
+#ifdef HAVE_ZLIB
+        // compressed task files can only be read by the gzip backend
+        int fd;
+        unsigned char magic[2];
+
+        if (auto_backend && (fd = open(options->task_file, O_RDONLY)) != -1)
+        {
+            if (pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+                strcpy(options->queue_backend, "gzip");
+
+            close(fd);
+        }
+#endif
+
+        if (file_systems[i].name != NULL)
+            printf("[INFO]: Task file is on %s, using the %s queue backend and %s locks\n",
+                file_systems[i].name, options->queue_backend, options->lock_type);
+        else
+            printf("[INFO]: Task file is on an unknown file system (0x%lx), using the %s queue backend and %s locks\n",
+                (unsigned long) file_system.f_type, options->queue_backend, options->lock_type);
+    }
+
+    MPI_Bcast(options->queue_backend, sizeof(options->queue_backend), MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(options->lock_type, sizeof(options->lock_type), MPI_CHAR, 0, MPI_COMM_WORLD);
+}
+
+// Take a task from the locked task file for the rewrite backend
+static char *take_rewrite(queue_backend *queue, int fd)
+{
+    return claim_task_rewrite(fd, &queue->macros);
+}
+
+// Check whether the file at a path is no longer the one open on a descriptor
+static bool queue_file_replaced(int fd, const char *path)
+{
+    struct stat path_stats, fd_stats;
+
+    return stat(path, &path_stats) == -1 || fstat(fd, &fd_stats) == -1
+        || path_stats.st_dev != fd_stats.st_dev || path_stats.st_ino != fd_stats.st_ino;
+}
+
+/* Reuse the descriptor of a queue file, reopening it if the file was replaced
+
+   Opening and closing the queue files for every claim costs two metadata
+   server round trips per file on parallel file systems, so the descriptors
+   are kept open. A stat() of the path is compared with an fstat() of the
+   descriptor to catch files that have been replaced (e.g. by an editor
+   saving a new copy) or removed since they were opened.
+
+   Arguments:
+
+     int *fd                   pointer to descriptor (-1 if not yet open)
+     const char *path          path to queue file
+     int flags                 flags passed to open()
+
+   Returns:
+
+     int                       open file descriptor
+*/
+static int reopen_queue_file(int *fd, const char *path, int flags)
+{
+    if (*fd != -1)
+    {
+        if (!queue_file_replaced(*fd, path)) return *fd;
+        close(*fd);
+    }
+
+    if ((*fd = open(path, flags, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    return *fd;
+}
+
+// Take a task from the locked task file for the cursor backend
+static char *take_cursor(queue_backend *queue, int fd)
+{
+    return claim_task_cursor(fd, reopen_queue_file(&queue->offset_fd, queue->offset_file, O_RDWR | O_CREAT),
+        &queue->macros);
+}
+
+/* Read the offset of the first unclaimed task from the claim journal
+
+   The journal is appended to with a record of the form "INODE OFFSET" each
+   time tasks are claimed, and only the last record counts. If it refers to
+   another inode, the task file has been replaced since (by compaction, or by
+   the user) and none of it has been claimed. A record torn by a crash is cut
+   off, so that the next record starts on a new line.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+
+   Returns:
+
+     long long                 byte offset of the next unclaimed task
+*/
+static long long read_journal_head(queue_backend *queue, int fd)
+{
+    int journal_fd;
+    ssize_t n;
+    unsigned long long inode;
+    long long offset;
+    char buffer[128], *end, *record;
+    struct stat file_stats, journal_stats;
+
+    journal_fd = reopen_queue_file(&queue->journal_fd, queue->journal_file, O_RDWR | O_CREAT | O_APPEND);
+
+    if (fstat(fd, &file_stats) == -1 || fstat(journal_fd, &journal_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    if (journal_stats.st_size == 0) return 0;
+
+    // records are much shorter than the buffer, so it holds at least one
+    n = journal_stats.st_size < (off_t) sizeof(buffer) - 1 ? journal_stats.st_size : (ssize_t) sizeof(buffer) - 1;
+
+    if (pread(journal_fd, buffer, n, journal_stats.st_size - n) != n)
+    {
+        perror("[ERROR] pread");
+        fail();
+    }
+
+    if (buffer[n - 1] != '\n')
+    {
+        end = memrchr(buffer, '\n', n);
+
+        if (ftruncate(journal_fd, journal_stats.st_size - n + (end ? end - buffer + 1 : 0)) == -1)
+        {
+            perror("[ERROR] ftruncate");
+            fail();
+        }
+
+        if (end == NULL) return 0;
+        n = end - buffer + 1;
+    }
+
+    // find the start of the last record
+    buffer[n - 1] = '\0';
+    record = memrchr(buffer, '\n', n - 1);
+    record = record ? record + 1 : buffer;
+
+    if (sscanf(record, "%llu %lld", &inode, &offset) != 2
+        || inode != (unsigned long long) file_stats.st_ino || offset > file_stats.st_size)
+        return 0;
+
+    return offset;
+}
+
+// Flush the directory holding a file, so that a rename() is durable
+static void sync_directory(const char *path)
+{
+    int fd;
+    char directory[1024], *slash;
+
+    snprintf(directory, sizeof(directory), "%s", path);
+
+    if ((slash = strrchr(directory, '/')) == NULL) strcpy(directory, ".");
+    else if (slash == directory) slash[1] = '\0';
+    else slash[0] = '\0';
+
+    if ((fd = open(directory, O_RDONLY)) == -1 || fsync(fd) == -1)
+    {
+        perror("[ERROR] fsync");
+        fail();
+    }
+
+    close(fd);
+}
+
+/* Write a file in full to a temporary file and rename it into place
+
+   Arguments:
+
+     const char *path          path to file
+     const char *buffer        new file contents
+     size_t size               size of buffer
+     mode_t mode               permissions of the new file
+
+   Returns:
+
+     ino_t                     inode of the new file
+*/
+static ino_t replace_file(const char *path, const char *buffer, size_t size, mode_t mode)
+{
+    int fd;
+    char tmp_file[1024 + 16];
+    struct stat file_stats;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", path);
+
+    if ((fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, mode)) == -1 || !write_and_sync(fd, buffer, size, 0)
+        || fstat(fd, &file_stats) == -1 || close(fd) == -1 || rename(tmp_file, path) == -1)
+    {
+        perror("[ERROR] replace");
+        fail();
+    }
+
+    return file_stats.st_ino;
+}
+
+/* Replace the task file with its header and unclaimed tasks and start a new journal
+
+   The task file is replaced before the journal, and the directory is synced
+   in between, so after a crash either the old journal refers to the old
+   task file, or it refers to the wrong inode and the new task file is read
+   from the start. Both are correct. The guard file is held throughout, so
+   no other process can claim from the new task file before its journal has
+   been started.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+*/
+static void compact_task_file(queue_backend *queue, int fd)
+{
+    int n;
+    off_t size, header;
+    char *buffer, record[64];
+    struct stat file_stats;
+    ino_t inode;
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    buffer = read_locked_file(fd, &size);
+    header = queue->macros.header_length;
+    memmove(buffer + header, buffer + queue->journal_head, size - queue->journal_head);
+    inode = replace_file(queue->task_file, buffer, header + size - queue->journal_head, file_stats.st_mode & 0777);
+    free(buffer);
+
+    sync_directory(queue->task_file);
+
+    n = snprintf(record, sizeof(record), "%llu 0\n", (unsigned long long) inode);
+    replace_file(queue->journal_file, record, n, 0644);
+}
+
+/* Make the claims made under the current lock durable
+
+   A single record, and a single fdatasync(), covers every task claimed under
+   the lock, which with "--combine" is a task for each waiting process on the
+   node. The task file is compacted instead once enough of it, or all of it,
+   has been claimed, or the journal has grown too large.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+     int num_claimed           number of tasks claimed under the lock
+*/
+static void commit_journal(queue_backend *queue, int fd, int num_claimed)
+{
+    int n;
+    long long head = queue->journal_head, claimed = head - queue->macros.header_length;
+    char record[64];
+    struct stat file_stats;
+
+    if (head == -1) return;
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    if ((head == file_stats.st_size && claimed > 0)
+        || (claimed >= JOURNAL_COMPACT_SIZE && claimed >= file_stats.st_size - head)
+        || lseek(queue->journal_fd, 0, SEEK_END) >= JOURNAL_MAX_SIZE)
+    {
+        compact_task_file(queue, fd);
+        return;
+    }
+
+    if (num_claimed == 0) return;
+
+    n = snprintf(record, sizeof(record), "%llu %lld\n", (unsigned long long) file_stats.st_ino, head);
+
+    if (!write_and_sync(queue->journal_fd, record, n, -1))
+    {
+        perror("[ERROR] journal");
+        fail();
+    }
+}
+
+// Take a task from the locked task file for the journal backend
+static char *take_journal(queue_backend *queue, int fd)
+{
+    struct stat file_stats;
+
+    if (queue->journal_head == -1) queue->journal_head = read_journal_head(queue, fd);
+
+    // read any macro header when starting from the beginning of the file
+    if (queue->journal_head == 0 || !queue->macros.loaded) load_macro_header(&queue->macros, fd);
+    if (queue->journal_head < queue->macros.header_length) queue->journal_head = queue->macros.header_length;
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    if (queue->journal_head >= file_stats.st_size) return NULL;
+
+    return read_task_at(fd, queue->journal_head, &queue->journal_head);
+}
+
+#ifdef HAVE_ZLIB
+// a gzip member of the task file, holding whole lines
+typedef struct
+{
+    off_t offset;                       // byte offset of the member
+    off_t length;                       // compressed length
+    long long first_line;               // index of the first line
+    long long num_lines;                // number of lines
+} gzip_frame;
+
+// frame index and decompressed frame cache of a process (gzip backend)
+typedef struct
+{
+    gzip_frame *frames;
+    long long num_frames, capacity;
+    off_t indexed_size;                 // bytes of the task file in the index
+    off_t index_length;                 // bytes of the index file read
+    long long cached_frame;             // frame held in text (-1 if none)
+    char *text;                         // decompressed frame
+    size_t text_length;
+    long long next_line;                // line that starts at text + next_position
+    size_t next_position;
+} gzip_state;
+
+// Add a frame to the in-memory frame index
+static void add_gzip_frame(gzip_state *state, off_t offset, off_t length, long long num_lines)
+{
+    gzip_frame *frame;
+
+    if (state->num_frames == state->capacity)
+    {
+        state->capacity = state->capacity ? 2 * state->capacity : 1024;
+        state->frames = realloc(state->frames, state->capacity * sizeof(gzip_frame));
+    }
+
+    frame = &state->frames[state->num_frames++];
+    frame->offset = offset;
+    frame->length = length;
+    frame->first_line = state->num_frames > 1 ? frame[-1].first_line + frame[-1].num_lines : 0;
+    frame->num_lines = num_lines;
+
+    state->indexed_size = offset + length;
+}
+
+/* Decompress a gzip member of the task file
+
+   The compressed member is read GZIP_READ_SIZE bytes at a time.
+
+   Arguments:
+
+     int fd                         task file descriptor
+     off_t offset                   byte offset of the member
+     off_t input_length             compressed length of the member
+     size_t *length                 set to the decompressed length
+
+   Returns:
+
+     char *                         decompressed member (caller must free),
+                                    or NULL if it can't be read or is corrupt
+*/
+static char *inflate_gzip_member(int fd, off_t offset, off_t input_length, size_t *length)
+{
+    int status = Z_OK;
+    size_t capacity = 4 * GZIP_FRAME_SIZE, block;
+    off_t end = offset + input_length;
+    char *output;
+    unsigned char *input;
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+
+    // window bits of 16 + MAX_WBITS only accept a gzip header
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) return NULL;
+
+    input = malloc(GZIP_READ_SIZE);
+    output = malloc(capacity + 1);
+
+    while (status == Z_OK)
+    {
+        if (stream.avail_in == 0)
+        {
+            block = end - offset < GZIP_READ_SIZE ? end - offset : GZIP_READ_SIZE;
+
+            if (block == 0 || pread(fd, input, block, offset) != (ssize_t) block) break;
+
+            offset += block;
+            stream.next_in = input;
+            stream.avail_in = block;
+        }
+
+        if (stream.total_out == capacity)
+        {
+            capacity *= 2;
+            output = realloc(output, capacity + 1);
+        }
+
+        stream.next_out = (unsigned char *) output + stream.total_out;
+        stream.avail_out = capacity - stream.total_out;
+
+        status = inflate(&stream, Z_NO_FLUSH);
+    }
+
+    *length = stream.total_out;
+    inflateEnd(&stream);
+    free(input);
+
+    if (status != Z_STREAM_END)
+    {
+        free(output);
+        return NULL;
+    }
+
+    output[*length] = '\0';
+
+    return output;
+}
+
+/* Count the task records ended in a block of decompressed tasks
+
+   Records can be split across blocks, so the state of the count is carried
+   from one block to the next.
+
+   Arguments:
+
+     const char *block         decompressed tasks
+     size_t length             size of block
+     bool *partial             whether a record has been started but not
+                               ended (updated)
+     bool *zero                whether the last byte was an unpaired NUL
+                               (argv0 format only, updated)
+
+   Returns:
+
+     long long                 number of records ended in the block
+*/
+static long long count_record_ends(const char *block, size_t length, bool *partial, bool *zero)
+{
+    long long count = 0;
+    const char *p, *end = block + length;
+
+    if (length == 0) return 0;
+
+    if (task_format == TASK_FORMAT_LINE)
+    {
+        for (p = block; (p = memchr(p, '\n', end - p)) != NULL; p++) count++;
+        *partial = end[-1] != '\n';
+
+        return count;
+    }
+
+    for (p = block; p < end; p++)
+    {
+        if (*p == '\0' && *zero)
+        {
+            count++;
+            *zero = *partial = false;
+        }
+        else
+        {
+            *zero = *p == '\0';
+            *partial = true;
+        }
+    }
+
+    return count;
+}
+
+/* Index the gzip members of the task file beyond the end of the index
+
+   The members are streamed through buffers of GZIP_READ_SIZE bytes, counting
+   the records in each, so memory use doesn't depend on the size of the task
+   file, or of its members. A record is written to the index file for each.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+     int index_fd              index file descriptor (opened with O_APPEND)
+     off_t size                size of the task file
+*/
+static void index_gzip_members(queue_backend *queue, int fd, int index_fd, off_t size)
+{
+    int status = Z_OK;
+    bool partial = false, zero = false;
+    off_t offset;
+    size_t length, block;
+    long long num_lines = 0;
+    char *output, record[96];
+    unsigned char *input;
+    z_stream stream;
+    gzip_state *state = queue->data;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+    {
+        fprintf(stderr, "[ERROR]: inflateInit2 failed\n");
+        fail();
+    }
+
+    input = malloc(GZIP_READ_SIZE);
+    output = malloc(GZIP_READ_SIZE);
+
+    for (offset = state->indexed_size; state->indexed_size < size;)
+    {
+        if (stream.avail_in == 0)
+        {
+            block = size - offset < GZIP_READ_SIZE ? size - offset : GZIP_READ_SIZE;
+
+            // a truncated last member reads as corrupt
+            if (block == 0) status = Z_DATA_ERROR;
+            else if (pread(fd, input, block, offset) != (ssize_t) block)
+            {
+                perror("[ERROR] pread");
+                fail();
+            }
+
+            offset += block;
+            stream.next_in = input;
+            stream.avail_in = block;
+        }
+
+        stream.next_out = (unsigned char *) output;
+        stream.avail_out = GZIP_READ_SIZE;
+
+        if (stream.avail_in > 0) status = inflate(&stream, Z_NO_FLUSH);
+
+        if (status != Z_OK && status != Z_STREAM_END)
+        {
+            fprintf(stderr, "[ERROR]: Task file %s is not a gzip file, or is corrupt at byte %lld\n",
+                queue->task_file, (long long) state->indexed_size);
+            fail();
+        }
+
+        num_lines += count_record_ends(output, GZIP_READ_SIZE - stream.avail_out, &partial, &zero);
+
+        if (status == Z_STREAM_END)
+        {
+            if (partial) num_lines++;
+
+            length = snprintf(record, sizeof(record), "%lld %lld %lld\n",
+                (long long) state->indexed_size, (long long) stream.total_in, num_lines);
+
+            if (write(index_fd, record, length) != (ssize_t) length)
+            {
+                perror("[ERROR] write");
+                fail();
+            }
+
+            add_gzip_frame(state, state->indexed_size, stream.total_in, num_lines);
+            state->index_length += length;
+
+            // start the next member with the input that is left
+            num_lines = 0;
+            partial = zero = false;
+            inflateReset(&stream);
+        }
+    }
+
+    inflateEnd(&stream);
+    free(input);
+    free(output);
+}
+
+/* Bring the frame index up to date with the task file
+
+   The index is kept in the index file (e.g. tasks.txt.gz.idx), which holds
+   a line "OFFSET LENGTH LINES" for each gzip member. Records added by other
+   processes are read, then members beyond the end of the index, appended
+   since it was written (or all of them, the first time the task file is
+   used), are indexed by index_gzip_members(). The task file lock must be
+   held.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+*/
+static void update_gzip_index(queue_backend *queue, int fd)
+{
+    int index_fd;
+    bool replaced;
+    size_t length;
+    long long num_lines, frame_offset, frame_length;
+    char *buffer, *line, *next;
+    struct stat file_stats, index_stats;
+    gzip_state *state = queue->data;
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    // the task file hasn't changed since the index was last read
+    if (file_stats.st_size == state->indexed_size) return;
+
+    if ((index_fd = open(queue->index_file, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1
+        || fstat(index_fd, &index_stats) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    // the task file has shrunk, so it has been replaced and the index is stale
+    replaced = file_stats.st_size < state->indexed_size;
+
+    if (replaced || index_stats.st_size < state->index_length)
+    {
+        state->num_frames = state->indexed_size = state->index_length = 0;
+        state->cached_frame = -1;
+
+        if (replaced && ftruncate(index_fd, 0) == -1)
+        {
+            perror("[ERROR] ftruncate");
+            fail();
+        }
+
+        index_stats.st_size = 0;
+    }
+
+    // read the records written by other processes, dropping a torn last record
+    if (index_stats.st_size > state->index_length)
+    {
+        length = index_stats.st_size - state->index_length;
+        buffer = malloc(length);
+
+        if (pread(index_fd, buffer, length, state->index_length) != (ssize_t) length)
+        {
+            perror("[ERROR] pread");
+            fail();
+        }
+
+        for (line = buffer; (next = memchr(line, '\n', buffer + length - line)) != NULL; line = next + 1)
+        {
+            if (sscanf(line, "%lld %lld %lld", &frame_offset, &frame_length, &num_lines) != 3
+                || frame_offset != state->indexed_size || frame_offset + frame_length > file_stats.st_size)
+                break;
+
+            add_gzip_frame(state, frame_offset, frame_length, num_lines);
+            state->index_length += next + 1 - line;
+        }
+
+        if (line != buffer + length && ftruncate(index_fd, state->index_length) == -1)
+        {
+            perror("[ERROR] ftruncate");
+            fail();
+        }
+
+        free(buffer);
+    }
+
+    // index any new members
+    if (file_stats.st_size > state->indexed_size) index_gzip_members(queue, fd, index_fd, file_stats.st_size);
+
+    close(index_fd);
+}
+
+// Total number of lines in the indexed task file
+static long long gzip_num_lines(gzip_state *state)
+{
+    if (state->num_frames == 0) return 0;
+
+    return state->frames[state->num_frames - 1].first_line + state->frames[state->num_frames - 1].num_lines;
+}
+
+// Decompress a frame of a compressed task file into the frame cache, unless it is already there
+static void read_gzip_frame(queue_backend *queue, int fd, long long index)
+{
+    size_t length;
+    gzip_state *state = queue->data;
+    gzip_frame *frame = &state->frames[index];
+
+    if (state->cached_frame == index) return;
+
+    free(state->text);
+
+    if ((state->text = inflate_gzip_member(fd, frame->offset, frame->length, &length)) == NULL)
+    {
+        fprintf(stderr, "[ERROR]: Can't read frame %lld of task file %s\n", index, queue->task_file);
+        fail();
+    }
+
+    state->cached_frame = index;
+    state->text_length = length;
+    state->next_line = frame->first_line;
+    state->next_position = 0;
+}
+
+// Read the macro header of a compressed task file, which must be held by the first frame
+static void load_gzip_header(queue_backend *queue, int fd)
+{
+    gzip_state *state = queue->data;
+
+    if (state->num_frames == 0) return;
+
+    read_gzip_frame(queue, fd, 0);
+    parse_macro_header(&queue->macros, state->text, state->text_length);
+}
+
+/* Claim the next line of a compressed task file
+
+   The line number of the next unclaimed task is stored in the offset file.
+   Only the frame holding it is read and decompressed, and it is kept, so
+   consecutive claims by the same process decompress each frame once.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+
+   Returns:
+
+     char *                    claimed task (caller must free), or NULL if
+                               all tasks have been claimed
+*/
+static char *take_gzip(queue_backend *queue, int fd)
+{
+    int offset_fd;
+    long long line, low, high, middle;
+    char *start, *end;
+    gzip_frame *frame;
+    gzip_state *state = queue->data;
+
+    update_gzip_index(queue, fd);
+
+    offset_fd = reopen_queue_file(&queue->offset_fd, queue->offset_file, O_RDWR | O_CREAT);
+    line = read_queue_offset(offset_fd);
+
+    // read any macro header when starting from the first line
+    if (line == 0 || !queue->macros.loaded) load_gzip_header(queue, fd);
+    if (line < queue->macros.header_lines) line = queue->macros.header_lines;
+
+    if (line >= gzip_num_lines(state)) return NULL;
+
+    // find the frame holding the line
+    for (low = 0, high = state->num_frames - 1; low < high;)
+    {
+        middle = (low + high + 1) / 2;
+        if (state->frames[middle].first_line <= line) low = middle;
+        else high = middle - 1;
+    }
+
+    frame = &state->frames[low];
+    read_gzip_frame(queue, fd, low);
+
+    // another process claimed the lines in between, so count from the start
+    if (state->next_line > line)
+    {
+        state->next_line = frame->first_line;
+        state->next_position = 0;
+    }
+
+    start = state->text + state->next_position;
+
+    for (;state->next_line<line;state->next_line++)
+    {
+        end = (char *) find_record_end(start, state->text + state->text_length - start);
+        start = end ? end + terminator_length() : state->text + state->text_length;
+    }
+
+    end = (char *) find_record_end(start, state->text + state->text_length - start);
+    if (end == NULL) end = state->text + state->text_length;
+
+    state->next_line = line + 1;
+    state->next_position = (end < state->text + state->text_length ? end + terminator_length() : end) - state->text;
+
+    write_queue_offset(offset_fd, line + 1);
+
+    return copy_record(start, end - start);
+}
+
+/* Compress some tasks as a single gzip member, adding it to a buffer
+
+   Arguments:
+
+     const char *text          whole tasks
+     size_t length             size of text
+     unsigned char **output    pointer to compressed buffer (grown as needed)
+     size_t *output_length     pointer to size of compressed buffer
+*/
+static void deflate_gzip_member(const char *text, size_t length, unsigned char **output, size_t *output_length)
+{
+    z_stream stream;
+    size_t capacity;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "[ERROR]: deflateInit2 failed\n");
+        fail();
+    }
+
+    capacity = deflateBound(&stream, length);
+    *output = realloc(*output, *output_length + capacity);
+
+    stream.next_in = (unsigned char *) text;
+    stream.avail_in = length;
+    stream.next_out = *output + *output_length;
+    stream.avail_out = capacity;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    {
+        fprintf(stderr, "[ERROR]: deflate failed\n");
+        fail();
+    }
+
+    *output_length += stream.total_out;
+
+    deflateEnd(&stream);
+}
+
+/* Compress tasks as frames of about GZIP_FRAME_SIZE bytes, each ending on a task boundary
+
+   Arguments:
+
+     const char *text          whole tasks
+     size_t length             size of text
+     size_t *output_length     pointer to size of compressed tasks
+
+   Returns:
+
+     char *                    compressed tasks (caller must free)
+*/
+static char *deflate_gzip_frames(const char *text, size_t length, size_t *output_length)
+{
+    size_t start, end;
+    const char *boundary;
+    unsigned char *output = NULL;
+
+    *output_length = 0;
+
+    for (start = 0; start < length; start = end)
+    {
+        end = start + GZIP_FRAME_SIZE < length ? start + GZIP_FRAME_SIZE : length;
+        boundary = find_record_end(text + end - 1, length - end + 1);
+        end = boundary ? boundary - text + terminator_length() : length;
+
+        deflate_gzip_member(text + start, end - start, &output, output_length);
+    }
+
+    return (char *) output;
+}
+
+/* Compress a task file in place, as frames of about GZIP_FRAME_SIZE bytes
+
+   Arguments:
+
+     const char *task_file     path to task file
+*/
+static void compress_task_file(const char *task_file)
+{
+    int fd;
+    off_t size;
+    size_t length;
+    char *buffer, *output;
+
+    if ((fd = open(task_file, O_RDONLY)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    buffer = read_locked_file(fd, &size);
+    close(fd);
+
+    output = deflate_gzip_frames(buffer, size, &length);
+
+    // the compressed file is synced before it replaces the task file
+    replace_file(task_file, output, length, 0644);
+
+    free(buffer);
+    free(output);
+}
+#endif
+
+/* Find how much of the task file has already been claimed
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int fd                    locked task file descriptor
+
+   Returns:
+
+     long long                 byte offset of the first unclaimed task
+*/
+long long claimed_offset(queue_backend *queue, int fd)
+{
+    if (queue->take == take_cursor)
+        return read_queue_offset(reopen_queue_file(&queue->offset_fd, queue->offset_file, O_RDWR | O_CREAT));
+
+    if (queue->take == take_journal) return read_journal_head(queue, fd);
+
+#ifdef HAVE_ZLIB
+    // only meaningful as a line number for compressed task files
+    if (queue->take == take_gzip)
+        return read_queue_offset(reopen_queue_file(&queue->offset_fd, queue->offset_file, O_RDWR | O_CREAT));
+#endif
+
+    return 0;
+}
+
+/* Lock the task file, returning the file descriptor
+
+   The journal backend replaces the task file and the journal when it
+   compacts them, and a lock held on the old task file doesn't exclude a
+   process that opens the new one, so its claims are serialised by locking a
+   guard file alongside the task file (e.g. tasks.txt.guard) instead, which
+   is never replaced.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     struct flock *fl          pointer to file lock structure
+
+   Returns:
+
+     int                       task file descriptor
+*/
+int lock_task_file(queue_backend *queue, struct flock *fl)
+{
+    int fd;
+
+    fl->l_whence = SEEK_SET;
+    fl->l_start = 0;
+    fl->l_len = 0;
+    fl->l_pid = getpid();
+
+    // the task file can't be replaced by another process once the guard is held
+    if (queue->take == take_journal)
+    {
+        fd = reopen_queue_file(&queue->guard_fd, queue->guard_file, O_RDWR | O_CREAT);
+        lock_file(fl, fd, queue->guard_file);
+
+        return reopen_queue_file(&queue->task_fd, queue->task_file, O_RDWR);
+    }
+
+    fd = reopen_queue_file(&queue->task_fd, queue->task_file, O_RDWR);
+    lock_file(fl, fd, queue->task_file);
+
+    return fd;
+}
+
+// Unlock the task file, which is left open for the next claim
+void unlock_task_file(queue_backend *queue, struct flock *fl, int fd)
+{
+    if (queue->take == take_journal) unlock_file(fl, queue->guard_fd, queue->guard_file);
+    else unlock_file(fl, fd, queue->task_file);
+}
+
+/* Claim tasks from the task file
+
+   All of the tasks are claimed, and assigned global indices, under a single
+   acquisition of the task file lock. Macros are expanded after it has been
+   released.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     int n                     maximum number of tasks to claim
+     queue_task *tasks         array of at least n tasks to fill
+
+   Returns:
+
+     int                       number of tasks claimed
+*/
+static int file_queue_claim(queue_backend *queue, int n, queue_task *tasks)
+{
+    int i, fd, num_claimed;
+    struct flock fl;
+
+    fd = lock_task_file(queue, &fl);
+    queue->journal_head = -1;
+
+    for (i=0;i<n;i++)
+    {
+        if ((tasks[i].command = queue->take(queue, fd)) == NULL) break;
+        tasks[i].id = next_task_id(reopen_queue_file(&queue->id_fd, queue->id_file, O_RDWR | O_CREAT));
+    }
+
+    num_claimed = i;
+
+    if (queue->take == take_journal) commit_journal(queue, fd, num_claimed);
+
+    unlock_task_file(queue, &fl, fd);
+
+    // expand macros once the lock has been released
+    for (i=0;i<num_claimed;i++) tasks[i].command = expand_macros(&queue->macros, tasks[i].command);
+
+    return num_claimed;
+}
+
+// The task file backends don't track tasks once they are claimed
+static void file_queue_complete(queue_backend *queue, long long task_id, int status)
+{
+    (void) queue;
+    (void) task_id;
+    (void) status;
+}
+
+/* Return a claimed task to the end of the task file
+
+   The task is given a new index when it is claimed again.
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     const queue_task *task    pointer to claimed task
+*/
+static void file_queue_requeue(queue_backend *queue, const queue_task *task)
+{
+    size_t n;
+    char *line;
+
+    // the record with its terminator, a newline or a second NUL
+    n = record_length(task->command);
+    line = copy_record(task->command, n);
+    if (task_format == TASK_FORMAT_LINE) line[n] = '\n';
+    n += terminator_length();
+
+    append_tasks(queue, line, n);
+
+    free(line);
+}
+
+/* Append tasks to the end of the task file with a single locked write
+
+   Everything that can be done without the lock, such as compressing the
+   tasks for a compressed task file, is done before the task file is
+   locked, so the lock is only held for the write (and, with the journal
+   backend, its fdatasync()). A newline is written first if the task file
+   doesn't end with one, so that the first task isn't joined to the last.
+
+   Arguments:
+
+     queue_backend *queue      pointer to task file queue backend
+     const char *tasks         whole tasks, each with its terminator
+     size_t length             size of tasks
+*/
+void append_tasks(queue_backend *queue, const char *tasks, size_t length)
+{
+    int fd;
+    off_t size;
+    size_t n = length;
+    bool compressed = false;
+    char *buffer = (char *) tasks, last = '\n';
+    struct flock fl;
+
+    if (length == 0) return;
+
+#ifdef HAVE_ZLIB
+    // compressed task files can only be appended to with new members
+    if (queue->take == take_gzip)
+    {
+        buffer = deflate_gzip_frames(tasks, length, &n);
+        compressed = true;
+    }
+#endif
+
+    fd = lock_task_file(queue, &fl);
+    size = lseek(fd, 0, SEEK_END);
+
+    if (task_format == TASK_FORMAT_LINE && !compressed && size > 0 && pread(fd, &last, 1, size - 1) == 1
+        && last != '\n' && pwrite(fd, "\n", 1, size++) != 1)
+    {
+        perror("[ERROR] write");
+        fail();
+    }
+
+    if (queue->take == take_journal ? !write_and_sync(fd, buffer, n, size)
+        : pwrite(fd, buffer, n, size) != (ssize_t) n)
+    {
+        perror("[ERROR] write");
+        fail();
+    }
+
+    unlock_task_file(queue, &fl, fd);
+
+    if (compressed) free(buffer);
+}
+
+/* Count the unclaimed tasks in the task file
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+
+   Returns:
+
+     long long                 number of unclaimed tasks
+*/
+static long long file_queue_size(queue_backend *queue)
+{
+    int fd;
+    off_t size, offset = 0;
+    long long count = 0;
+    char *buffer;
+    struct flock fl;
+
+    fd = lock_task_file(queue, &fl);
+    buffer = read_locked_file(fd, &size);
+
+    // skip tasks that have already been claimed, and the header
+    offset = claimed_offset(queue, fd);
+    if (offset > size) offset = 0;
+    if (offset < parse_macro_header(&queue->macros, buffer, size)) offset = queue->macros.header_length;
+
+    unlock_task_file(queue, &fl, fd);
+
+    count = count_records(buffer + offset, size - offset);
+
+    free(buffer);
+
+    return count;
+}
+
+#ifdef HAVE_ZLIB
+// Count the unclaimed tasks in a compressed task file
+static long long gzip_queue_size(queue_backend *queue)
+{
+    int fd;
+    long long count, claimed;
+    struct flock fl;
+
+    fd = lock_task_file(queue, &fl);
+    update_gzip_index(queue, fd);
+    if (!queue->macros.loaded) load_gzip_header(queue, fd);
+
+    // the header lines aren't tasks
+    claimed = claimed_offset(queue, fd);
+    if (claimed < queue->macros.header_lines) claimed = queue->macros.header_lines;
+    count = gzip_num_lines(queue->data) - claimed;
+
+    unlock_task_file(queue, &fl, fd);
+
+    return count > 0 ? count : 0;
+}
+#endif
+
+/* Read the tasks held by the task file, e.g. to choose tasks to cancel
+
+   Claimed tasks are kept in the task file by all but the rewrite backend,
+   until it is truncated or compacted, and are returned along with the
+   unclaimed tasks. The caller must hold the task file lock (see
+   lock_task_file()), so that it can act on the tasks, e.g. add tombstones
+   for them, before any more are claimed. Any macro header is loaded into the
+   macro table of the queue, but isn't returned. Compressed task files are
+   decompressed in full.
+
+   Arguments:
+
+     queue_backend *queue      pointer to task file queue backend
+     int fd                    task file descriptor (from lock_task_file())
+     size_t *length            set to the size of the tasks
+     size_t *pending           set to the offset of the first unclaimed task
+
+   Returns:
+
+     char *                    tasks, in the order they were or will be
+                               claimed (caller must free)
+*/
+char *read_queued_tasks(queue_backend *queue, int fd, size_t *length, size_t *pending)
+{
+    off_t size, offset;
+    char *buffer;
+
+#ifdef HAVE_ZLIB
+    long long i, j, line;
+    const char *start, *end, *text_end;
+    gzip_frame *frame;
+    gzip_state *state = queue->data;
+
+    if (queue->take == take_gzip)
+    {
+        update_gzip_index(queue, fd);
+        if (!queue->macros.loaded) load_gzip_header(queue, fd);
+
+        line = claimed_offset(queue, fd);
+        if (line < queue->macros.header_lines) line = queue->macros.header_lines;
+
+        buffer = malloc(1);
+        *length = *pending = 0;
+
+        // join the frames, leaving out the header lines
+        for (i=0;i<state->num_frames;i++)
+        {
+            frame = &state->frames[i];
+
+            read_gzip_frame(queue, fd, i);
+            start = state->text;
+            text_end = state->text + state->text_length;
+
+            for (j=frame->first_line;j<queue->macros.header_lines && j<frame->first_line+frame->num_lines;j++)
+            {
+                end = find_record_end(start, text_end - start);
+                start = end ? end + terminator_length() : text_end;
+            }
+
+            buffer = realloc(buffer, *length + (text_end - start) + 1);
+            memcpy(buffer + *length, start, text_end - start);
+
+            // find the first unclaimed line, if it is in this frame
+            for (end=start;j<line && j<frame->first_line+frame->num_lines;j++)
+            {
+                end = find_record_end(end, text_end - end);
+                end = end ? end + terminator_length() : text_end;
+            }
+
+            if (j <= line) *pending = *length + (end - start);
+            *length += text_end - start;
+        }
+
+        buffer[*length] = '\0';
+
+        return buffer;
+    }
+#endif
+
+    buffer = read_locked_file(fd, &size);
+
+    // skip the header, noting where the unclaimed tasks start
+    offset = claimed_offset(queue, fd);
+    if (offset > size) offset = 0;
+    parse_macro_header(&queue->macros, buffer, size);
+    if (offset < queue->macros.header_length) offset = queue->macros.header_length;
+
+    memmove(buffer, buffer + queue->macros.header_length, size - queue->macros.header_length);
+    *length = size - queue->macros.header_length;
+    *pending = offset - queue->macros.header_length;
+    buffer[*length] = '\0';
+
+    return buffer;
+}
+
+// Release a task file backend
+static void file_queue_close(queue_backend *queue)
+{
+    if (queue->task_fd != -1) close(queue->task_fd);
+    if (queue->id_fd != -1) close(queue->id_fd);
+    if (queue->offset_fd != -1) close(queue->offset_fd);
+    if (queue->journal_fd != -1) close(queue->journal_fd);
+    if (queue->guard_fd != -1) close(queue->guard_fd);
+
+    free_macro_table(&queue->macros);
+
+#ifdef HAVE_ZLIB
+    if (queue->take == take_gzip)
+    {
+        free(((gzip_state *) queue->data)->frames);
+        free(((gzip_state *) queue->data)->text);
+        free(queue->data);
+    }
+#endif
+
+    free(queue);
+}
+
+/* Open a queue backend
+
+   Arguments:
+
+     const char *name          name of the queue backend
+     const char *task_file     path to the task file
+
+   Returns:
+
+     queue_backend *           pointer to queue backend (release with its
+                               close function), or NULL if the backend
+                               doesn't exist
+*/
+queue_backend *open_queue_backend(const char *name, const char *task_file)
+{
+    queue_backend *queue;
+
+    if (!valid_queue_backend(name)) return NULL;
+
+    queue = calloc(1, sizeof(queue_backend));
+
+    queue->claim = file_queue_claim;
+    queue->complete = file_queue_complete;
+    queue->requeue = file_queue_requeue;
+    queue->size = file_queue_size;
+    queue->close = file_queue_close;
+
+    if (strcmp(name, "cursor") == 0)
+    {
+        queue->name = "cursor";
+        queue->take = take_cursor;
+    }
+    else if (strcmp(name, "journal") == 0)
+    {
+        queue->name = "journal";
+        queue->take = take_journal;
+    }
+#ifdef HAVE_ZLIB
+    else if (strcmp(name, "gzip") == 0)
+    {
+        queue->name = "gzip";
+        queue->take = take_gzip;
+        queue->size = gzip_queue_size;
+        queue->data = calloc(1, sizeof(gzip_state));
+        ((gzip_state *) queue->data)->cached_frame = -1;
+    }
+#endif
+    else
+    {
+        queue->name = "rewrite";
+        queue->take = take_rewrite;
+    }
+
+    snprintf(queue->task_file, sizeof(queue->task_file), "%s", task_file);
+    snprintf(queue->id_file, sizeof(queue->id_file), "%s.id", task_file);
+    snprintf(queue->offset_file, sizeof(queue->offset_file), "%s.offset", task_file);
+    snprintf(queue->journal_file, sizeof(queue->journal_file), "%s.journal", task_file);
+    snprintf(queue->index_file, sizeof(queue->index_file), "%s.idx", task_file);
+    snprintf(queue->guard_file, sizeof(queue->guard_file), "%s.guard", task_file);
+
+    queue->task_fd = -1;
+    queue->id_fd = -1;
+    queue->offset_fd = -1;
+    queue->journal_fd = -1;
+    queue->guard_fd = -1;
+
+    return queue;
+}
+
+// state of a node's claim requests, in shared memory
+typedef struct
+{
+    volatile int state;                 // COMBINE_IDLE, ...
+    long long id;                       // index of the task handed over
+    size_t length;                      // bytes of a task handed over in parts
+    char command[COMBINE_COMMAND_SIZE]; // task (or part of a task) handed over
+} combine_slot;
+
+// request states
+enum { COMBINE_IDLE, COMBINE_PENDING, COMBINE_SERVED, COMBINE_EMPTY, COMBINE_PART, COMBINE_PART_TAKEN };
+
+// flat combining state of a process
+typedef struct
+{
+    MPI_Win win;
+    int num_slots;                      // number of processes on the node
+    int local_rank;                     // index of our slot
+    volatile int *combiner;             // set while a process is combining
+    combine_slot *slots;
+    queue_task own;                     // task claimed for ourselves while combining
+} combine_state;
+
+/* Hand a task that is too long for a slot over in parts
+
+   Each part but the last is marked COMBINE_PART, and we wait for the
+   requesting process, which is polling its slot, to take it.
+
+   Arguments:
+
+     combine_slot *slot        slot of the requesting process
+     const char *command       task to hand over
+     size_t length             length of the task, with its terminator
+*/
+static void hand_over_parts(combine_slot *slot, const char *command, size_t length)
+{
+    size_t offset;
+
+    slot->length = length;
+
+    for (offset = 0; length - offset > COMBINE_COMMAND_SIZE; offset += COMBINE_COMMAND_SIZE)
+    {
+        memcpy(slot->command, command + offset, COMBINE_COMMAND_SIZE);
+        __sync_synchronize();
+        slot->state = COMBINE_PART;
+
+        while (slot->state == COMBINE_PART) usleep(COMBINE_POLL_INTERVAL);
+        __sync_synchronize();
+    }
+
+    memcpy(slot->command, command + offset, length - offset);
+    __sync_synchronize();
+    slot->state = COMBINE_SERVED;
+}
+
+/* Serve every pending request on the node with a single claim
+
+   Called by the process that holds the combiner flag. Our own request is
+   served directly, and tasks that are too long for a slot are handed over
+   in parts.
+
+   Arguments:
+
+     queue_backend *queue      pointer to combining queue backend
+*/
+static void combine_requests(queue_backend *queue)
+{
+    int i, n = 0, num_claimed;
+    int *pending;
+    size_t length;
+    queue_task *tasks;
+    combine_state *state = queue->data;
+
+    pending = malloc(state->num_slots * sizeof(int));
+    tasks = malloc(state->num_slots * sizeof(queue_task));
+
+    __sync_synchronize();
+
+    for (i=0;i<state->num_slots;i++)
+        if (state->slots[i].state == COMBINE_PENDING) pending[n++] = i;
+
+    num_claimed = n ? queue->inner->claim(queue->inner, n, tasks) : 0;
+
+    for (i=0;i<n;i++)
+    {
+        combine_slot *slot = &state->slots[pending[i]];
+
+        if (i >= num_claimed)
+        {
+            slot->state = COMBINE_EMPTY;
+            continue;
+        }
+
+        if (pending[i] == state->local_rank)
+        {
+            state->own = tasks[i];
+            slot->state = COMBINE_SERVED;
+            continue;
+        }
+
+        slot->id = tasks[i].id;
+
+        if ((length = record_length(tasks[i].command)) + 2 <= COMBINE_COMMAND_SIZE)
+        {
+            memcpy(slot->command, tasks[i].command, length + 2);
+
+            // publish the task before marking the request as served
+            __sync_synchronize();
+            slot->state = COMBINE_SERVED;
+        }
+        else hand_over_parts(slot, tasks[i].command, length + 2);
+
+        free(tasks[i].command);
+    }
+
+    free(pending);
+    free(tasks);
+}
+
+/* Claim tasks through the node's combiner
+
+   Each task is requested by posting to our slot in node shared memory.
+   Whichever process on the node first takes the combiner flag claims tasks
+   for every pending request at once, so that only one process per node
+   takes the task file lock at a time, and hands them out. There is no
+   dedicated combiner: a process waiting for a task combines whenever the
+   flag is free.
+
+   Arguments:
+
+     queue_backend *queue      pointer to combining queue backend
+     int n                     maximum number of tasks to claim
+     queue_task *tasks         array of at least n tasks to fill
+
+   Returns:
+
+     int                       number of tasks claimed
+*/
+static int combining_queue_claim(queue_backend *queue, int n, queue_task *tasks)
+{
+    int i, request;
+    size_t received;
+    char *parts;
+    combine_state *state = queue->data;
+    combine_slot *slot = &state->slots[state->local_rank];
+
+    for (i=0;i<n;i++)
+    {
+        parts = NULL;
+        received = 0;
+        state->own.command = NULL;
+
+        slot->state = COMBINE_PENDING;
+        __sync_synchronize();
+
+        while ((request = slot->state) != COMBINE_SERVED && request != COMBINE_EMPTY)
+        {
+            __sync_synchronize();
+
+            // take the next part of a long task
+            if (request == COMBINE_PART)
+            {
+                if (parts == NULL) parts = malloc(slot->length);
+                memcpy(parts + received, slot->command, COMBINE_COMMAND_SIZE);
+                received += COMBINE_COMMAND_SIZE;
+
+                __sync_synchronize();
+                slot->state = COMBINE_PART_TAKEN;
+            }
+            else if (request == COMBINE_PENDING && __sync_bool_compare_and_swap(state->combiner, 0, 1))
+            {
+                combine_requests(queue);
+                __sync_synchronize();
+                *state->combiner = 0;
+            }
+            else usleep(COMBINE_POLL_INTERVAL);
+        }
+
+        __sync_synchronize();
+
+        if (request == COMBINE_EMPTY)
+        {
+            slot->state = COMBINE_IDLE;
+            break;
+        }
+
+        // our own request was served while we were combining
+        if (state->own.command != NULL) tasks[i] = state->own;
+
+        else if (parts != NULL)
+        {
+            memcpy(parts + received, slot->command, slot->length - received);
+            tasks[i].id = slot->id;
+            tasks[i].command = parts;
+        }
+
+        else
+        {
+            tasks[i].id = slot->id;
+            tasks[i].command = copy_record(slot->command, record_length(slot->command));
+        }
+
+        slot->state = COMBINE_IDLE;
+    }
+
+    return i;
+}
+
+// Pass completions straight through to the wrapped backend
+static void combining_queue_complete(queue_backend *queue, long long task_id, int status)
+{
+    queue->inner->complete(queue->inner, task_id, status);
+}
+
+// Pass requeued tasks straight through to the wrapped backend
+static void combining_queue_requeue(queue_backend *queue, const queue_task *task)
+{
+    queue->inner->requeue(queue->inner, task);
+}
+
+// Count the unclaimed tasks in the wrapped backend
+static long long combining_queue_size(queue_backend *queue)
+{
+    return queue->inner->size(queue->inner);
+}
+
+/* Release a combining backend and the backend it wraps
+
+   Must be called collectively by all processes on the node.
+
+   Arguments:
+
+     queue_backend *queue      pointer to combining queue backend
+*/
+static void combining_queue_close(queue_backend *queue)
+{
+    combine_state *state = queue->data;
+
+    MPI_Win_free(&state->win);
+    queue->inner->close(queue->inner);
+    free(state);
+    free(queue);
+}
+
+/* Wrap a queue backend so that the claims of each node are combined
+
+   Must be called collectively by all processes on the node.
+
+   Arguments:
+
+     queue_backend *inner      pointer to queue backend to wrap
+     MPI_Comm node_comm        communicator of the processes on this node
+
+   Returns:
+
+     queue_backend *           pointer to combining queue backend
+*/
+queue_backend *open_combining_queue(queue_backend *inner, MPI_Comm node_comm)
+{
+    int disp_unit;
+    MPI_Aint size;
+    char *base;
+    queue_backend *queue;
+    combine_state *state;
+
+    queue = malloc(sizeof(queue_backend));
+    state = calloc(1, sizeof(combine_state));
+
+    // share the names of the files used by the wrapped backend
+    *queue = *inner;
+    queue->inner = inner;
+    queue->data = state;
+
+    queue->claim = combining_queue_claim;
+    queue->complete = combining_queue_complete;
+    queue->requeue = combining_queue_requeue;
+    queue->size = combining_queue_size;
+    queue->close = combining_queue_close;
+
+    MPI_Comm_size(node_comm, &state->num_slots);
+    MPI_Comm_rank(node_comm, &state->local_rank);
+
+    // the first process holds the combiner flag and all of the slots
+    size = (state->local_rank == 0) ? sizeof(combine_slot) * (state->num_slots + 1) : 0;
+    MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node_comm, &base, &state->win);
+    MPI_Win_shared_query(state->win, 0, &size, &disp_unit, &base);
+
+    // the combiner flag lives in the first slot, which is otherwise unused
+    state->combiner = (volatile int *) base;
+    state->slots = (combine_slot *) base + 1;
+
+    if (state->local_rank == 0)
+    {
+        memset(base, 0, size);
+        __sync_synchronize();
+    }
+
+    MPI_Barrier(node_comm);
+
+    return queue;
+}
+
+/* Find the tag of a task, given as a trailing "#tf:TAG" comment
+
+   Arguments:
+
+     const char *command       system command
+     const char **tag          set to the start of the tag
+
+   Returns:
+
+     size_t                    length of the tag (0 if there is none)
+*/
+size_t task_tag(const char *command, const char **tag)
+{
+    size_t length;
+    const char *p, *last = NULL;
+
+    for (p = command; (p = strstr(p, "#tf:")) != NULL; p++) last = p;
+
+    if (last == NULL) return 0;
+
+    last += 4;
+    length = strcspn(last, " \t\r\n");
+
+    // the tag must end the line
+    if (length == 0 || last[length + strspn(last + length, " \t\r\n")] != '\0') return 0;
+
+    *tag = last;
+
+    return length;
+}
+
+/* Append a line for a finished task to the completion ledger
+
+   Each task is recorded on a line of the form
+
+     TAG STATUS RANK ELAPSED COMMAND
+
+   which is shared with the Python implementation. The line is added with
+   a single append so that lines written by different processes don't mix.
+
+   Arguments:
+
+     const char *ledger_file   path to completion ledger (empty to disable)
+     const char *command       system command
+     int status                exit status of the task (-1 if disallowed)
+     int rank                  process id
+     double elapsed            wall time taken by the task (seconds)
+*/
+void record_completion(const char *ledger_file, const char *command, int status, int rank, double elapsed)
+{
+    int fd, n;
+    char *line;
+    const char *tag = "-";
+    size_t length;
+
+    if (ledger_file[0] == '\0') return;
+
+    if ((length = task_tag(command, &tag)) == 0) length = 1;
+
+    if ((fd = open(ledger_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        fail();
+    }
+
+    // the line is freed once it has been written
+    n = asprintf(&line, "%.*s %d %d %.3f %s\n", (int) length, tag, status, rank, elapsed, command);
+    if (n < 0 || !append_async(fd, line, n))
+    {
+        perror("[ERROR] write");
+        fail();
+    }
+
+    close(fd);
+}
+
+/* Start watching the tombstone file of a task file for cancelled tasks
+
+   Tombstones are added to the tombstone file (e.g. tasks.txt.cancel) by
+   taskfarmer-cancel. Each one holds a copy of the record of a cancelled task
+   (after macro expansion), its hash and length, and the number of pending
+   copies of the task that are still to be skipped.
+
+   Arguments:
+
+     const char *task_file     path to task file
+     bool kill_running         whether running tasks with TOMBSTONE_SIGNAL set
+                               are terminated (see launch_task())
+*/
+void open_tombstones(const char *task_file, bool kill_running)
+{
+    snprintf(tombstones.path, sizeof(tombstones.path), "%s.cancel", task_file);
+    tombstones.kill_running = kill_running;
+    tombstones.last_check = -TOMBSTONE_CHECK_INTERVAL;
+    tombstones.generation = 0;
+}
+
+// Stop watching the tombstone file
+void close_tombstones(void)
+{
+    free(tombstones.data);
+
+    tombstones.path[0] = '\0';
+    tombstones.data = NULL;
+    tombstones.entries = NULL;
+    tombstones.num_entries = 0;
+    tombstones.generation = 0;
+    tombstones.kill_running = false;
+}
+
+// Order tombstones by hash, then length
+static int compare_tombstones(const void *a, const void *b)
+{
+    const tombstone *x = a, *y = b;
+
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->length != y->length) return x->length < y->length ? -1 : 1;
+
+    return 0;
+}
+
+/* Read a tombstone file
+
+   The file holds a header, then the tombstones sorted by hash and length,
+   then the task records that they refer to.
+
+   Arguments:
+
+     const char *path          path to tombstone file
+     tombstone_header *header  set to the header of the file (zeroed if there
+                               is none)
+
+   Returns:
+
+     char *                    contents of the file (caller must free), with
+                               the tombstones starting at TOMBSTONE_ENTRIES(),
+                               or NULL if there are none
+*/
+static char *read_tombstone_file(const char *path, tombstone_header *header)
+{
+    int fd;
+    char *data;
+    struct stat file_stats;
+
+    memset(header, 0, sizeof(*header));
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        if (errno == ENOENT) return NULL;
+
+        perror("[ERROR] open");
+        fail();
+    }
+
+    if (fstat(fd, &file_stats) == -1)
+    {
+        perror("[ERROR] fstat");
+        fail();
+    }
+
+    // a torn file can't occur, since the file is replaced by rename()
+    data = malloc(file_stats.st_size + 1);
+
+    if (pread(fd, data, file_stats.st_size, 0) != file_stats.st_size)
+    {
+        perror("[ERROR] pread");
+        fail();
+    }
+
+    close(fd);
+
+    if (file_stats.st_size >= (off_t) sizeof(tombstone_header)) memcpy(header, data, sizeof(tombstone_header));
+
+    if (header->num_entries < 0
+        || (off_t) (sizeof(tombstone_header) + header->num_entries * sizeof(tombstone)) > file_stats.st_size)
+    {
+        fprintf(stderr, "[ERROR]: Corrupt tombstone file %s\n", path);
+        fail();
+    }
+
+    return data;
+}
+
+/* Read the generation of a tombstone file
+
+   Arguments:
+
+     const char *path          path to tombstone file
+
+   Returns:
+
+     unsigned long long        generation of the file, or 0 if there is none
+*/
+static unsigned long long read_tombstone_generation(const char *path)
+{
+    int fd;
+    tombstone_header header;
+
+    if ((fd = open(path, O_RDONLY)) == -1) return 0;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) header.generation = 0;
+    close(fd);
+
+    return header.generation;
+}
+
+/* Write a tombstone file, leaving out tombstones that no longer do anything
+
+   The file is given a new generation (the time in microseconds, but always
+   later than the file it replaces), so that processes know to read it again.
+
+   Arguments:
+
+     const char *path          path to tombstone file
+     tombstone *entries        tombstones, sorted by hash, then length
+     long long num_entries     number of tombstones
+     const char *data          buffer holding the task records of the tombstones
+     unsigned long long generation
+                               generation of the file being replaced (or 0)
+
+   Returns:
+
+     long long                 number of tombstones written
+*/
+static long long write_tombstone_file(const char *path, tombstone *entries, long long num_entries,
+    const char *data, unsigned long long generation)
+{
+    long long i, n = 0;
+    size_t size = sizeof(tombstone_header);
+    char *buffer;
+    tombstone *out;
+    tombstone_header header;
+
+    for (i = 0; i < num_entries; i++)
+    {
+        if (entries[i].count == 0 && !(entries[i].flags & TOMBSTONE_SIGNAL)) continue;
+
+        entries[n++] = entries[i];
+        size += sizeof(tombstone) + entries[i].length;
+    }
+
+    if (n == 0)
+    {
+        if (unlink(path) == -1 && errno != ENOENT)
+        {
+            perror("[ERROR] unlink");
+            fail();
+        }
+
+        return 0;
+    }
+
+    header.num_entries = n;
+    header.generation = (unsigned long long) (1e6 * wall_time());
+    if (header.generation <= generation) header.generation = generation + 1;
+
+    buffer = malloc(size);
+    memcpy(buffer, &header, sizeof(header));
+    out = TOMBSTONE_ENTRIES(buffer);
+    size = sizeof(tombstone_header) + n * sizeof(tombstone);
+
+    // copy the records after the tombstones
+    for (i = 0; i < n; i++)
+    {
+        out[i] = entries[i];
+        out[i].offset = size;
+        memcpy(buffer + size, data + entries[i].offset, entries[i].length);
+        size += entries[i].length;
+    }
+
+    replace_file(path, buffer, size, 0644);
+    free(buffer);
+
+    return n;
+}
+
+/* Find the tombstone of a task record
+
+   Tombstones with the same hash and length are compared byte for byte with
+   the record, so a hash collision can't cancel the wrong task.
+
+   Arguments:
+
+     tombstone *entries        tombstones, sorted by hash, then length
+     long long num_entries     number of tombstones
+     const char *data          buffer holding the task records of the tombstones
+     const char *record        task record
+     size_t length             length of task record
+
+   Returns:
+
+     tombstone *               the task's tombstone, or NULL if there is none
+*/
+static tombstone *match_tombstone(tombstone *entries, long long num_entries, const char *data,
+    const char *record, size_t length)
+{
+    tombstone key, *stone;
+
+    if (num_entries == 0) return NULL;
+
+    key.length = length;
+    key.hash = hash_task(record, length);
+
+    if ((stone = bsearch(&key, entries, num_entries, sizeof(tombstone), compare_tombstones)) == NULL)
+        return NULL;
+
+    while (stone > entries && compare_tombstones(stone - 1, &key) == 0) stone--;
+
+    for (; stone < entries + num_entries && compare_tombstones(stone, &key) == 0; stone++)
+        if (memcmp(data + stone->offset, record, length) == 0) return stone;
+
+    return NULL;
+}
+
+// Read the tombstone file again, if it has been replaced since it was last read
+static void reload_tombstones(void)
+{
+    tombstone_header header;
+
+    if (read_tombstone_generation(tombstones.path) == tombstones.generation) return;
+
+    free(tombstones.data);
+    tombstones.data = read_tombstone_file(tombstones.path, &header);
+    tombstones.entries = tombstones.data ? TOMBSTONE_ENTRIES(tombstones.data) : NULL;
+    tombstones.num_entries = header.num_entries;
+    tombstones.generation = header.generation;
+}
+
+/* Look up the tombstone of a claimed task
+
+   The tombstone file is checked for changes at most once every
+   TOMBSTONE_CHECK_INTERVAL seconds, and only read again when it has been
+   replaced, so a lookup is usually just a binary search. The counts of the
+   tombstone may be out of date, so use consume_tombstone() to decide whether
+   a task is skipped.
+
+   Arguments:
+
+     const char *command       claimed task (with its macros expanded)
+
+   Returns:
+
+     const tombstone *         the task's tombstone, or NULL if it hasn't
+                               been cancelled
+*/
+const tombstone *find_tombstone(const char *command)
+{
+    if (tombstones.path[0] == '\0') return NULL;
+
+    if (wall_time() - tombstones.last_check >= TOMBSTONE_CHECK_INTERVAL)
+    {
+        tombstones.last_check = wall_time();
+        reload_tombstones();
+    }
+
+    return match_tombstone(tombstones.entries, tombstones.num_entries, tombstones.data,
+        command, record_length(command));
+}
+
+/* Skip a claimed task if a pending copy of it has been cancelled
+
+   Each tombstone skips as many copies of its task as were pending when they
+   were cancelled, so copies added later still run. Since other processes may
+   be skipping copies of the same task, the count is decremented in place in
+   the tombstone file under the task file lock, which is only held for the
+   read and write of the count. Tombstone files are only replaced under the
+   same lock, so the tombstone can't move while it is being used. The count
+   isn't synced to disk, since a count lost in a crash can at worst skip a
+   copy of the task added later.
+
+   Arguments:
+
+     queue_backend *queue      pointer to task file queue backend
+     const char *command       claimed task (with its macros expanded)
+
+   Returns:
+
+     bool                      whether the task should be skipped
+*/
+bool consume_tombstone(queue_backend *queue, const char *command)
+{
+    int fd, tombstone_fd;
+    bool skip = false;
+    long long count;
+    off_t position;
+    tombstone *stone;
+    struct flock fl;
+
+    if (find_tombstone(command) == NULL) return false;
+
+    fd = lock_task_file(queue, &fl);
+
+    // the tombstones may have been replaced, or removed, since they were read
+    reload_tombstones();
+    stone = match_tombstone(tombstones.entries, tombstones.num_entries, tombstones.data,
+        command, record_length(command));
+
+    if (stone != NULL && (tombstone_fd = open(tombstones.path, O_RDWR)) != -1)
+    {
+        position = sizeof(tombstone_header) + (stone - tombstones.entries) * sizeof(tombstone)
+            + offsetof(tombstone, count);
+
+        if (pread(tombstone_fd, &count, sizeof(count), position) != sizeof(count))
+        {
+            perror("[ERROR] pread");
+            fail();
+        }
+
+        if (count > 0)
+        {
+            count--;
+            skip = true;
+
+            if (pwrite(tombstone_fd, &count, sizeof(count), position) != sizeof(count))
+            {
+                perror("[ERROR] pwrite");
+                fail();
+            }
+        }
+
+        stone->count = count;
+        close(tombstone_fd);
+    }
+
+    unlock_task_file(queue, &fl, fd);
+
+    return skip;
+}
+
+/* Add tombstones for cancelled tasks to the tombstone file of a task file
+
+   The new tombstones are merged with those already in the tombstone file,
+   which is then replaced. Tombstones for the same task record are combined,
+   adding up their counts. The caller must hold the task file lock (see
+   lock_task_file()) from reading the tasks with read_queued_tasks() until
+   the tombstones have been added, so that no copy counted as pending is
+   claimed in between, and tombstones added, or used, at the same time by
+   another process aren't lost. The task file itself isn't changed.
+
+   Arguments:
+
+     queue_backend *queue      pointer to task file queue backend
+     const tombstone *entries  tombstones to add (in any order)
+     const char *records       buffer holding the task records of the tombstones
+     long long num_entries     number of tombstones to add
+
+   Returns:
+
+     long long                 number of tombstones in the tombstone file
+*/
+long long add_tombstones(queue_backend *queue, const tombstone *entries, const char *records, long long num_entries)
+{
+    long long i, j, n, num_merged;
+    size_t size, records_size = 0;
+    char path[1024 + 8], *data;
+    tombstone *merged;
+    tombstone_header header;
+
+    snprintf(path, sizeof(path), "%s.cancel", queue->task_file);
+
+    for (i = 0; i < num_entries; i++)
+        if (entries[i].offset + entries[i].length > records_size) records_size = entries[i].offset + entries[i].length;
+
+    // put the new records after the old file, so that offsets into it are unchanged
+    data = read_tombstone_file(path, &header);
+    n = header.num_entries;
+    size = data ? sizeof(tombstone_header) + n * sizeof(tombstone) : 0;
+
+    for (i = 0; i < n; i++)
+        if (TOMBSTONE_ENTRIES(data)[i].offset + TOMBSTONE_ENTRIES(data)[i].length > size)
+            size = TOMBSTONE_ENTRIES(data)[i].offset + TOMBSTONE_ENTRIES(data)[i].length;
+    data = realloc(data, size + records_size + 1);
+    memcpy(data + size, records, records_size);
+
+    merged = malloc((n + num_entries) * sizeof(tombstone) + 1);
+    if (n > 0) memcpy(merged, TOMBSTONE_ENTRIES(data), n * sizeof(tombstone));
+
+    for (i = 0; i < num_entries; i++)
+    {
+        merged[n + i] = entries[i];
+        merged[n + i].offset += size;
+    }
+
+    n += num_entries;
+
+    qsort(merged, n, sizeof(tombstone), compare_tombstones);
+
+    // combine tombstones for the same task
+    for (i = 0, num_merged = 0; i < n; i++)
+    {
+        for (j = num_merged - 1; j >= 0 && compare_tombstones(&merged[j], &merged[i]) == 0; j--)
+            if (memcmp(data + merged[j].offset, data + merged[i].offset, merged[i].length) == 0) break;
+
+        if (j < 0 || compare_tombstones(&merged[j], &merged[i]) != 0)
+        {
+            merged[num_merged++] = merged[i];
+            continue;
+        }
+
+        merged[j].count += merged[i].count;
+        merged[j].flags |= merged[i].flags;
+        if (merged[i].time > merged[j].time) merged[j].time = merged[i].time;
+    }
+
+    num_merged = write_tombstone_file(path, merged, num_merged, data, header.generation);
+
+    free(data);
+    free(merged);
+
+    return num_merged;
+}
+
+// Remove the tombstone file of a task file, so that no tasks are cancelled
+void clear_tombstones(queue_backend *queue)
+{
+    int fd;
+    char path[1024 + 8];
+    struct flock fl;
+
+    snprintf(path, sizeof(path), "%s.cancel", queue->task_file);
+
+    fd = lock_task_file(queue, &fl);
+
+    if (unlink(path) == -1 && errno != ENOENT)
+    {
+        perror("[ERROR] unlink");
+        fail();
+    }
+
+    unlock_task_file(queue, &fl, fd);
+}
+
+/* Open the shared object for a plugin task
+
+   Each shared object is only opened once per process and is kept open, so
+   that any state it sets up survives between tasks.
+
+   Arguments:
+
+     const char *path          path to the shared object
+
+   Returns:
+
+     void *                    handle for the shared object (or NULL)
+*/
+static void *open_plugin_library(const char *path)
+{
+    int i;
+    void *handle;
+
+    for (i=0;i<num_plugin_libraries;i++)
+    {
+        if (strcmp(plugin_libraries[i].path, path) == 0)
+            return plugin_libraries[i].handle;
+    }
+
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) return NULL;
+
+    plugin_libraries = realloc(plugin_libraries, (num_plugin_libraries + 1) * sizeof(*plugin_libraries));
+    plugin_libraries[num_plugin_libraries].path = strdup(path);
+    plugin_libraries[num_plugin_libraries].handle = handle;
+    num_plugin_libraries++;
+
+    return handle;
+}
+
+/* Run a plugin task in-process
+
+   A plugin task has the form "so:LIBRARY:SYMBOL ARGS...". SYMBOL is looked up
+   in the shared object LIBRARY and called as
+
+     int SYMBOL(int argc, char **argv)
+
+   with argv[0] set to SYMBOL and the arguments split on whitespace. No shell
+   processing is done, although anything after a "#" is ignored. There is no
+   fork, exec or shell, so a task costs little more than a function call, but
+   a plugin that crashes takes the process down with it.
+
+   Arguments:
+
+     const char *command       plugin task
+
+   Returns:
+
+     int                       exit status of the task, encoded as a wait
+                               status (as returned by system())
+*/
+int run_plugin_task(const char *command)
+{
+    int argc = 0, rc;
+    char *buffer, *library, *p;
+    char *argv[PLUGIN_MAX_ARGS + 1];
+    void *handle;
+    plugin_function function;
+
+    buffer = strdup(command + strlen(PLUGIN_PREFIX));
+    library = buffer;
+
+    // split the symbol and its arguments
+    if ((p = strchr(buffer, ':')) != NULL)
+    {
+        *p = '\0';
+
+        for (p = strtok(p + 1, " \t\r"); p != NULL && p[0] != '#'; p = strtok(NULL, " \t\r"))
+        {
+            if (argc == PLUGIN_MAX_ARGS) break;
+            argv[argc++] = p;
+        }
+    }
+
+    if (argc == 0 || (p != NULL && p[0] != '#'))
+    {
+        printf("[WARNING]: Malformed plugin task: %s\n", command);
+        free(buffer);
+        return 127 << 8;
+    }
+
+    argv[argc] = NULL;
+
+    if ((handle = open_plugin_library(library)) == NULL
+        || (*(void **) &function = dlsym(handle, argv[0])) == NULL)
+    {
+        printf("[WARNING]: Cannot load plugin task: %s\n", dlerror());
+        free(buffer);
+        return 127 << 8;
+    }
+
+    rc = function(argc, argv);
+
+    // the plugin shares our output streams
+    fflush(stdout);
+    fflush(stderr);
+
+    free(buffer);
+
+    return (rc & 0xff) << 8;
+}
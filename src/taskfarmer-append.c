@@ -0,0 +1,422 @@
+/*
+  Copyright (c) 2013, 2014 Lester Hedges <lester.hedges@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  TaskFarmer-Append: Safely add tasks to the task file of a running farm.
+  Run "taskfarmer-append -h" for help.
+
+  About:
+
+  Appending to a task file with "cat more_tasks >> tasks.txt" races with
+  the processes of a running farm, which rewrite or truncate the task file
+  while holding its lock, so appended tasks can be lost. TaskFarmer-Append
+  takes the same lock as TaskFarmer, using the same lock type and queue
+  backend, and appends the tasks with a single write while holding it.
+
+  Tasks are read from the listed files, or from standard input if there are
+  none, and appended in batches of up to APPEND_BATCH_SIZE bytes (64 MB),
+  each ending on a task boundary. Each batch is read (and, for compressed
+  task files, compressed) before the lock is taken, so the farm is only
+  held up for the time taken to write it. A final task without a newline
+  is terminated, and the task file is created if it doesn't exist.
+
+  Usage:
+
+  taskfarmer-append [-h] -f FILE [-q BACKEND] [-l LOCK_TYPE] [-t FORMAT] [-v]
+                    [INPUT ...]
+
+  TaskFarmer-Append supports the following short- and long-form command-line
+  options.
+
+   -h/--help                show help message and exit
+   -f FILE, --file FILE     location of task file (required)
+   -q BACKEND, --queue-backend BACKEND
+                            queue backend used by the farm
+   -l LOCK_TYPE, --lock-type LOCK_TYPE
+                            lock type used by the farm
+   -t FORMAT, --format FORMAT
+                            format of the tasks
+   -v, --verbose            report the number of tasks appended
+
+  The queue backend, lock type and task format must match those used by the
+  farm (the defaults are the same as TaskFarmer's, and "auto" makes the same
+  choice). TaskFarmer-Append is run without mpirun.
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "taskfarmer.h"
+
+// FUNCTION PROTOTYPES
+int parse_command_line_arguments(int, char**, taskfarmer_options*);
+void print_help_message();
+size_t last_task_end(const char*, size_t, bool);
+long long count_tasks(const char*, size_t, bool);
+long long append_stream(queue_backend*, FILE*, bool);
+
+// BEGIN MAIN FUNCTION
+int main(int argc, char **argv)
+{
+    int i, first_input, fd;
+    long long num_appended = 0;
+    bool argv0;
+    FILE *input;
+    queue_backend *queue;
+    taskfarmer_options options;
+
+    MPI_Init(&argc, &argv);
+
+    // set default parameters
+    taskfarmer_default_options(&options);
+
+    // parse all command-line arguments
+    first_input = parse_command_line_arguments(argc, argv, &options);
+
+    // create the task file, as a shell redirection would
+    if ((fd = open(options.task_file, O_WRONLY | O_CREAT, 0644)) == -1)
+    {
+        perror("[ERROR] open");
+        MPI_Finalize();
+        exit(1);
+    }
+
+    close(fd);
+
+    // resolve "auto" as the farm does
+    select_queue_strategy(&options, 0);
+    set_lock_type(options.lock_type);
+    set_task_format(options.format);
+    argv0 = strcmp(options.format, "argv0") == 0;
+
+    queue = open_queue_backend(options.queue_backend, options.task_file);
+
+    // read from standard input if no files are listed
+    if (first_input == argc) num_appended = append_stream(queue, stdin, argv0);
+
+    for (i=first_input;i<argc;i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+        {
+            num_appended += append_stream(queue, stdin, argv0);
+            continue;
+        }
+
+        if ((input = fopen(argv[i], "r")) == NULL)
+        {
+            perror("[ERROR] fopen");
+            MPI_Finalize();
+            exit(1);
+        }
+
+        num_appended += append_stream(queue, input, argv0);
+        fclose(input);
+    }
+
+    if (options.verbose)
+        printf("[INFO]: Appended %lld tasks to %s\n", num_appended, options.task_file);
+
+    queue->close(queue);
+    MPI_Finalize();
+
+    return 0;
+}
+// END MAIN FUNCTION
+
+// FUNCTION DECLARATIONS
+
+/* Parse arguments from command-line
+
+   Arguments:
+
+     int argc                  number of command-line arguments
+     char **argv               array of command-line arguments
+     taskfarmer_options *options
+                               pointer to run-time options
+
+   Returns:
+
+     int                       index of the first input file (argc if none)
+*/
+int parse_command_line_arguments(int argc, char **argv, taskfarmer_options *options)
+{
+    int i = 1;
+    bool file = false;
+
+    if (argc < 2)
+    {
+        print_help_message();
+        MPI_Finalize();
+        exit(0);
+    }
+
+    // input files follow the options
+    while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0')
+    {
+        // all other options take a value
+        if (strcmp(argv[i],"-h") == 0 || strcmp(argv[i],"--help") == 0)
+        {
+            print_help_message();
+            MPI_Finalize();
+            exit(0);
+        }
+
+        else if (strcmp(argv[i],"-v") == 0 || strcmp(argv[i],"--verbose") == 0)
+        {
+            options->verbose = true;
+            i++;
+            continue;
+        }
+
+        else if (i + 1 >= argc)
+        {
+            fprintf(stderr, "[ERROR]: Missing value for command-line option %s\n", argv[i]);
+            MPI_Finalize();
+            exit(1);
+        }
+
+        if (strcmp(argv[i],"-f") == 0 || strcmp(argv[i],"--file") == 0)
+        {
+            i++;
+            file = true;
+            snprintf(options->task_file, sizeof(options->task_file), "%s", argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-q") == 0 || strcmp(argv[i],"--queue-backend") == 0)
+        {
+            i++;
+
+            if (!valid_queue_backend(argv[i]) && strcmp(argv[i], "auto") != 0)
+            {
+                fprintf(stderr, "[ERROR]: Unknown queue backend %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->queue_backend, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-l") == 0 || strcmp(argv[i],"--lock-type") == 0)
+        {
+            i++;
+
+            if (!valid_lock_type(argv[i]) && strcmp(argv[i], "auto") != 0)
+            {
+                fprintf(stderr, "[ERROR]: Unknown lock type %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->lock_type, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-t") == 0 || strcmp(argv[i],"--format") == 0)
+        {
+            i++;
+
+            if (!valid_task_format(argv[i]))
+            {
+                fprintf(stderr, "[ERROR]: Unknown task format %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->format, argv[i]);
+        }
+
+        else
+        {
+            fprintf(stderr, "[ERROR]: Unknown command-line option %s\n", argv[i]);
+            fprintf(stderr, "For help run \"taskfarmer-append -h\"\n");
+            MPI_Finalize();
+            exit(1);
+        }
+
+        i++;
+    }
+
+    if (!file)
+    {
+        fprintf(stderr, "[ERROR]: A task file must be specified with \"-f/--file\"\n");
+        fprintf(stderr, "For help run \"taskfarmer-append -h\"\n");
+        MPI_Finalize();
+        exit(1);
+    }
+
+    return i;
+}
+
+// Print help message to stdout
+void print_help_message()
+{
+    puts("TaskFarmer-Append - safely add tasks to the task file of a running farm.\n\n"
+         "Usage: taskfarmer-append [-h] -f FILE [-q BACKEND] [-l LOCK_TYPE] [-t FORMAT] [-v]\n"
+         "                         [INPUT ...]\n\n"
+
+         "Tasks are read from the INPUT files, or standard input if there are none.\n\n"
+
+         "Available options:\n"
+         " -h/--help                 : Print this help information\n"
+         " -f/--file <string>        : Location of task file (required)\n"
+         " -q/--queue-backend <string>\n"
+         "                           : Queue backend used by the farm (rewrite, cursor,\n"
+         "                             journal, gzip, auto)\n"
+         " -l/--lock-type <string>   : Lock type used by the farm (fcntl, ofd, flock,\n"
+         "                             lockfile, auto)\n"
+         " -t/--format <string>      : Format of the tasks (line, argv0)\n"
+         " -v/--verbose              : Report the number of tasks appended\n");
+}
+
+/* Find the end of the last whole task in a buffer
+
+   Arguments:
+
+     const char *buffer        tasks
+     size_t length             size of buffer
+     bool argv0                whether tasks are argv0 records (ended by two NULs)
+
+   Returns:
+
+     size_t                    offset just past the last task terminator (0 if none)
+*/
+size_t last_task_end(const char *buffer, size_t length, bool argv0)
+{
+    size_t i;
+    const char *newline;
+
+    if (!argv0)
+    {
+        newline = memrchr(buffer, '\n', length);
+        return newline ? newline - buffer + 1 : 0;
+    }
+
+    // fields are never empty, so two NULs only end a record
+    for (i=length;i>=2;i--)
+        if (buffer[i-1] == '\0' && buffer[i-2] == '\0') return i;
+
+    return 0;
+}
+
+// Count the tasks in a buffer of whole tasks
+long long count_tasks(const char *buffer, size_t length, bool argv0)
+{
+    size_t i;
+    long long count = 0;
+
+    if (!argv0)
+    {
+        for (i=0;i<length;i++) count += buffer[i] == '\n';
+        return count;
+    }
+
+    for (i=1;i<length;i++)
+    {
+        // skip the second NUL so that it isn't counted again
+        if (buffer[i] == '\0' && buffer[i-1] == '\0')
+        {
+            count++;
+            i++;
+        }
+    }
+
+    return count;
+}
+
+/* Append the tasks read from a stream, in batches of whole tasks
+
+   Arguments:
+
+     queue_backend *queue      pointer to queue backend
+     FILE *input               stream to read tasks from
+     bool argv0                whether tasks are argv0 records
+
+   Returns:
+
+     long long                 number of tasks appended
+*/
+long long append_stream(queue_backend *queue, FILE *input, bool argv0)
+{
+    size_t n, end, length = 0;
+    long long count = 0;
+    char *buffer;
+
+    if ((buffer = malloc(APPEND_BATCH_SIZE + 2)) == NULL)
+    {
+        perror("[ERROR] malloc");
+        MPI_Finalize();
+        exit(1);
+    }
+
+    while (true)
+    {
+        n = fread(buffer + length, 1, APPEND_BATCH_SIZE - length, input);
+        length += n;
+
+        if (ferror(input))
+        {
+            perror("[ERROR] fread");
+            MPI_Finalize();
+            exit(1);
+        }
+
+        // terminate a final task that is missing its terminator
+        if (feof(input))
+        {
+            if (!argv0)
+            {
+                if (length > 0 && buffer[length - 1] != '\n') buffer[length++] = '\n';
+            }
+
+            // a record ends with an empty field, i.e. two NULs
+            else if (length > 0)
+            {
+                if (buffer[length - 1] != '\0') buffer[length++] = '\0';
+                if (length == 1 || buffer[length - 2] != '\0') buffer[length++] = '\0';
+            }
+
+            count += count_tasks(buffer, length, argv0);
+            append_tasks(queue, buffer, length);
+            break;
+        }
+
+        if (length < APPEND_BATCH_SIZE) continue;
+
+        // append the whole tasks, keeping the last partial one for the next batch
+        if ((end = last_task_end(buffer, length, argv0)) == 0)
+        {
+            fprintf(stderr, "[ERROR]: Task longer than %d bytes\n", APPEND_BATCH_SIZE);
+            MPI_Finalize();
+            exit(1);
+        }
+
+        count += count_tasks(buffer, end, argv0);
+        append_tasks(queue, buffer, end);
+
+        memmove(buffer, buffer + end, length - end);
+        length -= end;
+    }
+
+    free(buffer);
+
+    return count;
+}
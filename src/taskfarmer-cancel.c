@@ -0,0 +1,491 @@
+/*
+  Copyright (c) 2013, 2014 Lester Hedges <lester.hedges@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  TaskFarmer-Cancel: Cancel pending tasks of a running farm.
+  Run "taskfarmer-cancel -h" for help.
+
+  About:
+
+  Removing tasks from the task file of a running farm means rewriting it,
+  which is slow for large task files and races with the farm. Instead,
+  TaskFarmer-Cancel leaves the task file untouched and adds a tombstone for
+  each matching task to a file alongside it (e.g. tasks.txt.cancel). A
+  tombstone holds a copy of the task, its hash and length, and the number of
+  pending copies of the task that were cancelled. The tombstone file is kept
+  sorted by hash, so the farm checks each claimed task with a binary search,
+  then compares the task itself. Cancelled tasks are skipped when they are
+  claimed, and are recorded in the ledger with the status -2.
+
+  The tasks are read, and the tombstones added, under a single acquisition
+  of the task file lock, so no task is claimed in between, and tasks are
+  selected by a POSIX extended regular expression ("--regex"), a "#tf:TAG"
+  tag ("--tag"), or a range of positions in the queue ("--index", where 1 is
+  the next task to be claimed). A task must match all of the criteria given.
+  Tasks are matched as they are shown in the ledger, with their macros
+  expanded.
+
+  The farm checks for new tombstones at most once a second, so tasks claimed
+  in the meantime still run. With "--signal", running tasks are terminated
+  as well, as long as the farm was run with "--kill-cancelled", and claimed
+  tasks that are still held by the task file (all but the rewrite backend
+  keep them until the file is truncated or compacted) are matched too. Only
+  copies that were already running when they were cancelled are terminated.
+  Each tombstone only skips as many copies of its task as were cancelled, so
+  cancelling one position with "--index" leaves identical copies elsewhere in
+  the queue alone, and copies appended later still run.
+
+  Usage:
+
+  taskfarmer-cancel [-h] -f FILE [-q BACKEND] [-l LOCK_TYPE] [-t FORMAT]
+                    [-r REGEX] [-g TAG] [-i FIRST[-LAST]] [-s] [-n] [-c] [-v]
+
+  TaskFarmer-Cancel supports the following short- and long-form command-line
+  options.
+
+   -h/--help                show help message and exit
+   -f FILE, --file FILE     location of task file (required)
+   -q BACKEND, --queue-backend BACKEND
+                            queue backend used by the farm
+   -l LOCK_TYPE, --lock-type LOCK_TYPE
+                            lock type used by the farm
+   -t FORMAT, --format FORMAT
+                            format of the tasks
+   -r REGEX, --regex REGEX  cancel tasks matching a regular expression
+   -g TAG, --tag TAG        cancel tasks with a "#tf:TAG" tag
+   -i FIRST[-LAST], --index FIRST[-LAST]
+                            cancel tasks at these positions in the queue
+   -s, --signal             also terminate the tasks if they are running
+   -n, --dry-run            list the matching tasks without cancelling them
+   -c, --clear              remove all tombstones
+   -v, --verbose            report the number of tasks cancelled
+
+  The queue backend, lock type and task format must match those used by the
+  farm (the defaults are the same as TaskFarmer's, and "auto" makes the same
+  choice). TaskFarmer-Cancel is run without mpirun.
+*/
+
+#include <limits.h>
+#include <mpi.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskfarmer.h"
+
+// tasks to cancel
+typedef struct
+{
+    bool use_regex;                     // match tasks against regex
+    bool use_index;                     // match tasks by queue position
+    regex_t regex;
+    const char *tag;                    // tag of the tasks (or NULL)
+    long long first;                    // first queue position (from 1)
+    long long last;                     // last queue position
+    bool signal;                        // terminate running tasks
+    bool dry_run;                       // list the tasks without cancelling them
+    bool clear;                         // remove all tombstones
+} cancel_options;
+
+// FUNCTION PROTOTYPES
+void parse_command_line_arguments(int, char**, taskfarmer_options*, cancel_options*);
+void print_help_message();
+bool matches_task(const char*, long long, const cancel_options*);
+
+// BEGIN MAIN FUNCTION
+int main(int argc, char **argv)
+{
+    int fd;
+    size_t length, first_pending, n, records_size = 0, records_capacity = 65536;
+    long long position = 0, num_matched = 0, capacity = 1024, num_tombstones;
+    bool argv0;
+    double now = wall_time();
+    char *tasks, *p, *end, *record, *display, *records;
+    tombstone *entries;
+    queue_backend *queue;
+    taskfarmer_options options;
+    cancel_options cancel;
+    struct flock fl;
+
+    MPI_Init(&argc, &argv);
+
+    // set default parameters
+    taskfarmer_default_options(&options);
+
+    // parse all command-line arguments
+    parse_command_line_arguments(argc, argv, &options, &cancel);
+
+    // resolve "auto" as the farm does
+    select_queue_strategy(&options, 0);
+    set_lock_type(options.lock_type);
+    set_task_format(options.format);
+    argv0 = strcmp(options.format, "argv0") == 0;
+
+    queue = open_queue_backend(options.queue_backend, options.task_file);
+
+    if (cancel.clear)
+    {
+        clear_tombstones(queue);
+
+        if (options.verbose)
+            printf("[INFO]: Removed the tombstones of %s\n", options.task_file);
+
+        queue->close(queue);
+        MPI_Finalize();
+
+        return 0;
+    }
+
+    // no tasks can be claimed until the tombstones have been added
+    fd = lock_task_file(queue, &fl);
+    tasks = read_queued_tasks(queue, fd, &length, &first_pending);
+    entries = malloc(capacity * sizeof(tombstone));
+    records = malloc(records_capacity);
+
+    // running tasks can only be signalled once they have been claimed
+    p = cancel.signal ? tasks : tasks + first_pending;
+
+    for (; p < tasks + length && position <= cancel.last;)
+    {
+        // claimed tasks have no position in the queue
+        if (p >= tasks + first_pending) position++;
+
+        // find the end of the task, which may be unterminated
+        if (!argv0) end = memchr(p, '\n', tasks + length - p);
+        else for (end = p; (end = memchr(end, '\0', tasks + length - end)) != NULL && end[1] != '\0'; end++);
+
+        n = end ? (size_t) (end - p) : (size_t) (tasks + length - p);
+
+        // the farm checks tasks once their macros have been expanded
+        record = malloc(n + 2);
+        memcpy(record, p, n);
+        record[n] = record[n + 1] = '\0';
+        record = expand_macros(&queue->macros, record);
+        display = record_display(record);
+
+        if (matches_task(display, position, &cancel))
+        {
+            if (num_matched == capacity)
+            {
+                capacity *= 2;
+                entries = realloc(entries, capacity * sizeof(tombstone));
+            }
+
+            entries[num_matched].length = record_length(record);
+            entries[num_matched].hash = hash_task(record, entries[num_matched].length);
+            entries[num_matched].flags = cancel.signal ? TOMBSTONE_SIGNAL : 0;
+            entries[num_matched].time = now;
+
+            // only this copy is skipped, and a claimed copy can only be signalled
+            entries[num_matched].count = p >= tasks + first_pending;
+
+            // the farm compares the records of tombstones with the same hash
+            while (records_size + entries[num_matched].length > records_capacity)
+            {
+                records_capacity *= 2;
+                records = realloc(records, records_capacity);
+            }
+
+            entries[num_matched].offset = records_size;
+            memcpy(records + records_size, record, entries[num_matched].length);
+            records_size += entries[num_matched].length;
+            num_matched++;
+
+            if (cancel.dry_run) printf("%s\n", display);
+        }
+
+        free(record);
+        free(display);
+
+        p = end ? end + (argv0 ? 2 : 1) : tasks + length;
+    }
+
+    if (!cancel.dry_run && num_matched > 0)
+    {
+        num_tombstones = add_tombstones(queue, entries, records, num_matched);
+        unlock_task_file(queue, &fl, fd);
+
+        if (options.verbose)
+            printf("[INFO]: Cancelled %lld tasks in %s (%lld tombstones)\n",
+                num_matched, options.task_file, num_tombstones);
+    }
+
+    else
+    {
+        unlock_task_file(queue, &fl, fd);
+
+        if (options.verbose)
+            printf("[INFO]: %lld tasks in %s matched\n", num_matched, options.task_file);
+    }
+
+    if (cancel.use_regex) regfree(&cancel.regex);
+    free(entries);
+    free(records);
+    free(tasks);
+    queue->close(queue);
+    MPI_Finalize();
+
+    return 0;
+}
+// END MAIN FUNCTION
+
+// FUNCTION DECLARATIONS
+
+/* Parse arguments from command-line
+
+   Arguments:
+
+     int argc                  number of command-line arguments
+     char **argv               array of command-line arguments
+     taskfarmer_options *options
+                               pointer to run-time options
+     cancel_options *cancel    pointer to the tasks to cancel
+*/
+void parse_command_line_arguments(int argc, char **argv, taskfarmer_options *options, cancel_options *cancel)
+{
+    int i, status;
+    bool file = false;
+    char message[256], *end;
+
+    memset(cancel, 0, sizeof(*cancel));
+    cancel->first = 1;
+    cancel->last = LLONG_MAX;
+
+    if (argc < 2)
+    {
+        print_help_message();
+        MPI_Finalize();
+        exit(0);
+    }
+
+    for (i=1;i<argc;i++)
+    {
+        // options without a value
+        if (strcmp(argv[i],"-h") == 0 || strcmp(argv[i],"--help") == 0)
+        {
+            print_help_message();
+            MPI_Finalize();
+            exit(0);
+        }
+
+        else if (strcmp(argv[i],"-v") == 0 || strcmp(argv[i],"--verbose") == 0)
+        {
+            options->verbose = true;
+            continue;
+        }
+
+        else if (strcmp(argv[i],"-s") == 0 || strcmp(argv[i],"--signal") == 0)
+        {
+            cancel->signal = true;
+            continue;
+        }
+
+        else if (strcmp(argv[i],"-n") == 0 || strcmp(argv[i],"--dry-run") == 0)
+        {
+            cancel->dry_run = true;
+            continue;
+        }
+
+        else if (strcmp(argv[i],"-c") == 0 || strcmp(argv[i],"--clear") == 0)
+        {
+            cancel->clear = true;
+            continue;
+        }
+
+        else if (i + 1 >= argc)
+        {
+            fprintf(stderr, "[ERROR]: Missing value for command-line option %s\n", argv[i]);
+            MPI_Finalize();
+            exit(1);
+        }
+
+        if (strcmp(argv[i],"-f") == 0 || strcmp(argv[i],"--file") == 0)
+        {
+            i++;
+            file = true;
+            snprintf(options->task_file, sizeof(options->task_file), "%s", argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-q") == 0 || strcmp(argv[i],"--queue-backend") == 0)
+        {
+            i++;
+
+            if (!valid_queue_backend(argv[i]) && strcmp(argv[i], "auto") != 0)
+            {
+                fprintf(stderr, "[ERROR]: Unknown queue backend %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->queue_backend, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-l") == 0 || strcmp(argv[i],"--lock-type") == 0)
+        {
+            i++;
+
+            if (!valid_lock_type(argv[i]) && strcmp(argv[i], "auto") != 0)
+            {
+                fprintf(stderr, "[ERROR]: Unknown lock type %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->lock_type, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-t") == 0 || strcmp(argv[i],"--format") == 0)
+        {
+            i++;
+
+            if (!valid_task_format(argv[i]))
+            {
+                fprintf(stderr, "[ERROR]: Unknown task format %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            strcpy(options->format, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-r") == 0 || strcmp(argv[i],"--regex") == 0)
+        {
+            i++;
+
+            // the last expression given is used
+            if (cancel->use_regex) regfree(&cancel->regex);
+
+            if ((status = regcomp(&cancel->regex, argv[i], REG_EXTENDED | REG_NOSUB)) != 0)
+            {
+                regerror(status, &cancel->regex, message, sizeof(message));
+                fprintf(stderr, "[ERROR]: Invalid regular expression %s: %s\n", argv[i], message);
+                MPI_Finalize();
+                exit(1);
+            }
+
+            cancel->use_regex = true;
+        }
+
+        else if (strcmp(argv[i],"-g") == 0 || strcmp(argv[i],"--tag") == 0)
+        {
+            i++;
+            cancel->tag = argv[i];
+        }
+
+        else if (strcmp(argv[i],"-i") == 0 || strcmp(argv[i],"--index") == 0)
+        {
+            i++;
+
+            // a single position, or an inclusive range
+            cancel->use_index = true;
+            cancel->first = cancel->last = strtoll(argv[i], &end, 10);
+            if (*end == '-') cancel->last = strtoll(end + 1, &end, 10);
+
+            if (*end != '\0' || cancel->first < 1 || cancel->last < cancel->first)
+            {
+                fprintf(stderr, "[ERROR]: Invalid queue positions %s\n", argv[i]);
+                MPI_Finalize();
+                exit(1);
+            }
+        }
+
+        else
+        {
+            fprintf(stderr, "[ERROR]: Unknown command-line option %s\n", argv[i]);
+            fprintf(stderr, "For help run \"taskfarmer-cancel -h\"\n");
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+
+    if (!file)
+    {
+        fprintf(stderr, "[ERROR]: A task file must be specified with \"-f/--file\"\n");
+        fprintf(stderr, "For help run \"taskfarmer-cancel -h\"\n");
+        MPI_Finalize();
+        exit(1);
+    }
+
+    // never cancel every task by accident
+    if (!cancel->clear && !cancel->use_regex && cancel->tag == NULL && !cancel->use_index)
+    {
+        fprintf(stderr, "[ERROR]: Tasks must be selected with \"-r/--regex\", \"-g/--tag\" or \"-i/--index\"\n");
+        fprintf(stderr, "For help run \"taskfarmer-cancel -h\"\n");
+        MPI_Finalize();
+        exit(1);
+    }
+}
+
+// Print help message to stdout
+void print_help_message()
+{
+    puts("TaskFarmer-Cancel - cancel pending tasks of a running farm.\n\n"
+         "Usage: taskfarmer-cancel [-h] -f FILE [-q BACKEND] [-l LOCK_TYPE] [-t FORMAT]\n"
+         "                         [-r REGEX] [-g TAG] [-i FIRST[-LAST]] [-s] [-n] [-c] [-v]\n\n"
+
+         "Tasks matching all of the given criteria are cancelled.\n\n"
+
+         "Available options:\n"
+         " -h/--help                 : Print this help information\n"
+         " -f/--file <string>        : Location of task file (required)\n"
+         " -q/--queue-backend <string>\n"
+         "                           : Queue backend used by the farm (rewrite, cursor,\n"
+         "                             journal, gzip, auto)\n"
+         " -l/--lock-type <string>   : Lock type used by the farm (fcntl, ofd, flock,\n"
+         "                             lockfile, auto)\n"
+         " -t/--format <string>      : Format of the tasks (line, argv0)\n"
+         " -r/--regex <string>       : Cancel tasks matching this extended regular expression\n"
+         " -g/--tag <string>         : Cancel tasks tagged with \"#tf:TAG\"\n"
+         " -i/--index <range>        : Cancel tasks at positions FIRST[-LAST] in the queue,\n"
+         "                             where 1 is the next task to be claimed\n"
+         " -s/--signal               : Also terminate the tasks if they are running (needs\n"
+         "                             a farm run with --kill-cancelled)\n"
+         " -n/--dry-run              : List the matching tasks without cancelling them\n"
+         " -c/--clear                : Remove all tombstones, so that no tasks are cancelled\n"
+         " -v/--verbose              : Report the number of tasks cancelled\n");
+}
+
+/* Check whether a task should be cancelled
+
+   Arguments:
+
+     const char *display       task, as shown in the ledger
+     long long position        position of the task in the queue (from 1, or 0
+                               if it has been claimed)
+     const cancel_options *cancel
+                               pointer to the tasks to cancel
+
+   Returns:
+
+     bool                      whether the task matches all of the criteria
+*/
+bool matches_task(const char *display, long long position, const cancel_options *cancel)
+{
+    size_t length;
+    const char *tag;
+
+    if (cancel->use_index && (position < cancel->first || position > cancel->last)) return false;
+
+    if (cancel->tag != NULL && ((length = task_tag(display, &tag)) != strlen(cancel->tag)
+        || strncmp(tag, cancel->tag, length) != 0))
+        return false;
+
+    if (cancel->use_regex && regexec(&cancel->regex, display, 0, NULL, 0) != 0) return false;
+
+    return true;
+}
@@ -0,0 +1,976 @@
+/*
+  Copyright (c) 2013, 2014 Lester Hedges <lester.hedges@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  TaskFarmer-Sim: A makespan simulator for TaskFarmer.
+  Run "taskfarmer-sim -h" for help.
+
+  About:
+
+  Replay a task file against run time estimates to predict how a TaskFarmer
+  run would behave for a range of process counts before committing to an
+  allocation. A discrete-event model of the farmer is used: each process
+  repeatedly acquires the task file lock, claims the first unclaimed task,
+  releases the lock and runs the task, exactly as TaskFarmer does. The lock
+  is modelled as a single first-come-first-served server whose service time
+  depends on the queue backend:
+
+    rewrite   LOCK_TIME + BYTE_TIME * (size of the task file when the lock is taken)
+    cursor    LOCK_TIME + BYTE_TIME * (length of the claimed task)
+    journal   as cursor, plus SYNC_TIME for the claim record
+
+  Suitable values for LOCK_TIME, BYTE_TIME and SYNC_TIME can be measured on
+  the file system holding the task file with the "--measure" option. For the
+  cursor backend, LOCK_TIME is also roughly the reciprocal of the claim rate
+  reported by "taskfarmer --benchmark".
+
+  Usage:
+
+  taskfarmer-sim [-h] -f FILE [-g LEDGER] [-e ESTIMATES] [-d DISTRIBUTION]
+                 [-n RANKS] [-q BACKEND] [-l LOCK_TIME] [-b BYTE_TIME]
+                 [-s SYNC_TIME] [-M] [-S SEED]
+
+  TaskFarmer-Sim supports the following short- and long-form command-line
+  options.
+
+   -h/--help                show help message and exit
+   -f FILE, --file FILE     location of task file (required)
+   -g LEDGER, --ledger LEDGER
+                            completion ledger of earlier runs
+   -e ESTIMATES, --estimates ESTIMATES
+                            file of run time estimates, one per task
+   -d DISTRIBUTION, --distribution DISTRIBUTION
+                            run time distribution for tasks without estimates
+   -n RANKS, --ranks RANKS  comma separated list of process counts
+   -q BACKEND, --queue-backend BACKEND
+                            comma separated list of queue backends
+   -l LOCK_TIME, --lock-time LOCK_TIME
+                            fixed cost of a dequeue (seconds)
+   -b BYTE_TIME, --byte-time BYTE_TIME
+                            cost per byte of task file read/rewrite (seconds)
+   -s SYNC_TIME, --sync-time SYNC_TIME
+                            cost of a journal record and sync (seconds)
+   -M, --measure            measure LOCK_TIME, BYTE_TIME and SYNC_TIME on the
+                            file system holding the task file
+   -S SEED, --seed SEED     random number seed
+
+  The run time of each task is taken from (in order of preference) an
+  annotation in the task itself, i.e. a trailing shell comment containing
+  "runtime=SECONDS", the most recent successful run of the same task in the
+  ledger written by "taskfarmer --ledger", the mean run time of the tasks in
+  the ledger with the same "#tf:TAG", the corresponding line of the estimates
+  file, or a random sample from the distribution. Lines of a macro header
+  ("@def NAME=VALUE") at the start of the task file count towards its size,
+  but aren't tasks, and macros are expanded before tasks are looked up in the
+  ledger. Supported distributions are:
+
+   const:T                  every task takes T seconds (default const:60)
+   uniform:A:B              uniformly distributed between A and B
+   exp:MEAN                 exponentially distributed
+   lognormal:MU:SIGMA       log-normally distributed
+
+  For each combination of queue backend and process count the predicted
+  makespan, utilization (fraction of core time spent running tasks), tail idle
+  time (time between the last task starting and the run finishing) and mean
+  time spent waiting for the lock are reported.
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "taskfarmer.h"
+
+#define MAX_LIST 64                     // maximum entries in a list option
+
+// a single task
+typedef struct
+{
+    double run_time;                    // estimated run time (seconds)
+    size_t length;                      // length of the task line (bytes)
+} task;
+
+// run time distribution
+typedef struct
+{
+    char type[16];
+    double a, b;
+} distribution;
+
+// run times of earlier tasks, keyed by command or tag
+typedef struct
+{
+    char **keys;                        // open addressed table of keys
+    double *total;                      // total run time of each key
+    int *count;                         // number of runs of each key
+    size_t capacity;                    // table size (a power of two)
+    size_t size;                        // number of keys
+} history;
+
+// simulation results
+typedef struct
+{
+    double makespan;
+    double utilization;
+    double tail_idle;
+    double lock_wait;
+} result;
+
+// FUNCTION PROTOTYPES
+void parse_command_line_arguments(int, char**, char*, char*, char*, distribution*, int*, int*,
+    char[][16], int*, double*, double*, double*, bool*, long*);
+void print_help_message();
+int parse_list(const char*, int*);
+void parse_distribution(const char*, distribution*);
+double sample_distribution(const distribution*);
+void history_add(history*, const char*, size_t, double, bool);
+double history_find(const history*, const char*, size_t);
+void free_history(history*);
+void load_ledger(const char*, history*, history*);
+task *load_tasks(const char*, const char*, const char*, const distribution*, size_t*, size_t*);
+void simulate(const task*, size_t, size_t, int, const char*, double, double, double, result*);
+void measure_lock_time(const char*, double*, double*, double*);
+
+// BEGIN MAIN FUNCTION
+int main(int argc, char **argv)
+{
+    int i, j;
+    size_t num_tasks, total_bytes;
+    task *tasks;
+    result res;
+
+    // set default parameters
+    char task_file[1024];
+    char ledger_file[1024] = "";
+    char estimates_file[1024] = "";
+    distribution dist = { "const", 60, 0 };
+    int ranks[MAX_LIST] = { 16, 32, 64, 128, 256 };
+    int num_ranks = 5;
+    char backends[MAX_LIST][16] = { "rewrite", "cursor", "journal" };
+    int num_backends = 3;
+    double lock_time = 1e-3;
+    double byte_time = 1e-9;
+    double sync_time = 1e-3;
+    bool measure = false;
+    long seed = 42;
+
+    // parse all command-line arguments
+    parse_command_line_arguments(argc, argv, task_file, ledger_file, estimates_file, &dist, ranks,
+        &num_ranks, backends, &num_backends, &lock_time, &byte_time, &sync_time, &measure, &seed);
+
+    srand48(seed);
+
+    // measure the dequeue cost on the task file's file system
+    if (measure)
+    {
+        measure_lock_time(task_file, &lock_time, &byte_time, &sync_time);
+
+        printf("[INFO]: Measured lock time %.3e s, byte time %.3e s, sync time %.3e s\n",
+            lock_time, byte_time, sync_time);
+    }
+
+    tasks = load_tasks(task_file, ledger_file, estimates_file, &dist, &num_tasks, &total_bytes);
+
+    if (num_tasks == 0)
+    {
+        fprintf(stderr, "[ERROR]: Task file is empty!\n");
+        exit(1);
+    }
+
+    printf("[INFO]: Simulating %zu tasks (%zu bytes)\n\n", num_tasks, total_bytes);
+    printf("%-8s %8s %14s %12s %14s %14s\n", "backend", "ranks",
+        "makespan (s)", "utilization", "tail idle (s)", "lock wait (s)");
+
+    for (i=0;i<num_backends;i++)
+    {
+        for (j=0;j<num_ranks;j++)
+        {
+            simulate(tasks, num_tasks, total_bytes, ranks[j], backends[i],
+                lock_time, byte_time, sync_time, &res);
+
+            printf("%-8s %8d %14.1f %12.4f %14.1f %14.3e\n", backends[i], ranks[j],
+                res.makespan, res.utilization, res.tail_idle, res.lock_wait);
+        }
+    }
+
+    free(tasks);
+
+    return 0;
+}
+// END MAIN FUNCTION
+
+// FUNCTION DECLARATIONS
+
+/* Parse arguments from command-line
+
+   Arguments:
+
+     int argc                  number of command-line arguments
+     char **argv               array of command-line arguments
+     char *task_file           pointer to task file buffer
+     char *ledger_file         pointer to ledger file buffer
+     char *estimates_file      pointer to estimates file buffer
+     distribution *dist        pointer to run time distribution
+     int *ranks                array of process counts
+     int *num_ranks            pointer to number of process counts
+     char backends[][16]       array of queue backends
+     int *num_backends         pointer to number of queue backends
+     double *lock_time         pointer to lock time variable
+     double *byte_time         pointer to byte time variable
+     double *sync_time         pointer to sync time variable
+     bool *measure             pointer to measure flag
+     long *seed                pointer to random number seed
+*/
+void parse_command_line_arguments(int argc, char **argv, char *task_file, char *ledger_file,
+    char *estimates_file, distribution *dist, int *ranks, int *num_ranks, char backends[][16],
+    int *num_backends, double *lock_time, double *byte_time, double *sync_time, bool *measure,
+    long *seed)
+{
+    int i = 1;
+    bool file = false;
+    char *list, *token;
+
+    if (argc < 2)
+    {
+        print_help_message();
+        exit(0);
+    }
+
+    while (i < argc)
+    {
+        // all other options take a value
+        if (strcmp(argv[i],"-h") == 0 || strcmp(argv[i],"--help") == 0)
+        {
+            print_help_message();
+            exit(0);
+        }
+
+        else if (strcmp(argv[i],"-M") == 0 || strcmp(argv[i],"--measure") == 0)
+        {
+            *measure = true;
+            i++;
+            continue;
+        }
+
+        else if (i + 1 >= argc)
+        {
+            fprintf(stderr, "[ERROR]: Missing value for command-line option %s\n", argv[i]);
+            exit(1);
+        }
+
+        if (strcmp(argv[i],"-f") == 0 || strcmp(argv[i],"--file") == 0)
+        {
+            i++;
+            file = true;
+            strcpy(task_file, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-g") == 0 || strcmp(argv[i],"--ledger") == 0)
+        {
+            i++;
+            strcpy(ledger_file, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-e") == 0 || strcmp(argv[i],"--estimates") == 0)
+        {
+            i++;
+            strcpy(estimates_file, argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-d") == 0 || strcmp(argv[i],"--distribution") == 0)
+        {
+            i++;
+            parse_distribution(argv[i], dist);
+        }
+
+        else if (strcmp(argv[i],"-n") == 0 || strcmp(argv[i],"--ranks") == 0)
+        {
+            i++;
+            *num_ranks = parse_list(argv[i], ranks);
+        }
+
+        else if (strcmp(argv[i],"-q") == 0 || strcmp(argv[i],"--queue-backend") == 0)
+        {
+            i++;
+            *num_backends = 0;
+            list = strdup(argv[i]);
+
+            for (token = strtok(list, ","); token; token = strtok(NULL, ","))
+            {
+                if (strcmp(token, "rewrite") != 0 && strcmp(token, "cursor") != 0
+                    && strcmp(token, "journal") != 0)
+                {
+                    fprintf(stderr, "[ERROR]: Unknown queue backend %s\n", token);
+                    exit(1);
+                }
+
+                if (*num_backends < MAX_LIST)
+                    strcpy(backends[(*num_backends)++], token);
+            }
+
+            free(list);
+        }
+
+        else if (strcmp(argv[i],"-l") == 0 || strcmp(argv[i],"--lock-time") == 0)
+        {
+            i++;
+            *lock_time = atof(argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-b") == 0 || strcmp(argv[i],"--byte-time") == 0)
+        {
+            i++;
+            *byte_time = atof(argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-s") == 0 || strcmp(argv[i],"--sync-time") == 0)
+        {
+            i++;
+            *sync_time = atof(argv[i]);
+        }
+
+        else if (strcmp(argv[i],"-S") == 0 || strcmp(argv[i],"--seed") == 0)
+        {
+            i++;
+            *seed = atol(argv[i]);
+        }
+
+        else
+        {
+            fprintf(stderr, "[ERROR]: Unknown command-line option %s\n", argv[i]);
+            fprintf(stderr, "For help run \"taskfarmer-sim -h\"\n");
+            exit(1);
+        }
+
+        i++;
+    }
+
+    if (!file)
+    {
+        fprintf(stderr, "[ERROR]: A task file must be specified with \"-f/--file\"\n");
+        fprintf(stderr, "For help run \"taskfarmer-sim -h\"\n");
+        exit(1);
+    }
+
+    if (*num_ranks == 0 || *num_backends == 0)
+    {
+        fprintf(stderr, "[ERROR]: Process counts and queue backends must be non-empty!\n");
+        exit(1);
+    }
+
+    if (*lock_time < 0 || *byte_time < 0 || *sync_time < 0)
+    {
+        fprintf(stderr, "[ERROR]: Lock, byte and sync times must be non-negative!\n");
+        exit(1);
+    }
+}
+
+// Print help message to stdout
+void print_help_message()
+{
+    puts("TaskFarmer-Sim - a makespan simulator for TaskFarmer.\n\n"
+         "Usage: taskfarmer-sim [-h] -f FILE [-g LEDGER] [-e ESTIMATES] [-d DISTRIBUTION] [-n RANKS]\n"
+         "                      [-q BACKEND] [-l LOCK_TIME] [-b BYTE_TIME] [-s SYNC_TIME] [-M]\n"
+         "                      [-S SEED]\n\n"
+
+         "Available options:\n"
+         " -h/--help                 : Print this help information\n"
+         " -f/--file <string>        : Location of task file (required)\n"
+         " -g/--ledger <string>      : Completion ledger of earlier runs\n"
+         " -e/--estimates <string>   : File of run time estimates, one per task\n"
+         " -d/--distribution <string>: Run time distribution for tasks without estimates\n"
+         "                             const:T, uniform:A:B, exp:MEAN or lognormal:MU:SIGMA\n"
+         " -n/--ranks <list>         : Comma separated list of process counts\n"
+         " -q/--queue-backend <list> : Comma separated list of queue backends (rewrite, cursor,\n"
+         "                             journal)\n"
+         " -l/--lock-time <float>    : Fixed cost of a dequeue (seconds)\n"
+         " -b/--byte-time <float>    : Cost per byte of task file read/rewrite (seconds)\n"
+         " -s/--sync-time <float>    : Cost of a journal record and sync (seconds)\n"
+         " -M/--measure              : Measure lock, byte and sync times on the task file's\n"
+         "                             file system\n"
+         " -S/--seed <int>           : Random number seed\n");
+}
+
+/* Parse a comma separated list of positive integers
+
+   Arguments:
+
+     const char *string        comma separated list
+     int *values               array of values (MAX_LIST entries)
+
+   Returns:
+
+     int                       number of values
+*/
+int parse_list(const char *string, int *values)
+{
+    int n = 0;
+    char *list = strdup(string), *token;
+
+    for (token = strtok(list, ","); token && n < MAX_LIST; token = strtok(NULL, ","))
+    {
+        if ((values[n++] = atoi(token)) <= 0)
+        {
+            fprintf(stderr, "[ERROR]: List values must be greater than zero!\n");
+            exit(1);
+        }
+    }
+
+    free(list);
+
+    return n;
+}
+
+/* Parse a run time distribution of the form TYPE:A[:B]
+
+   Arguments:
+
+     const char *string        distribution string
+     distribution *dist        pointer to distribution
+*/
+void parse_distribution(const char *string, distribution *dist)
+{
+    int n;
+
+    dist->a = dist->b = 0;
+    n = sscanf(string, "%15[^:]:%lf:%lf", dist->type, &dist->a, &dist->b);
+
+    if (!((n == 2 && (strcmp(dist->type, "const") == 0 || strcmp(dist->type, "exp") == 0))
+        || (n == 3 && (strcmp(dist->type, "uniform") == 0 || strcmp(dist->type, "lognormal") == 0))))
+    {
+        fprintf(stderr, "[ERROR]: Invalid run time distribution %s\n", string);
+        exit(1);
+    }
+}
+
+/* Draw a run time from a distribution
+
+   Arguments:
+
+     const distribution *dist  pointer to distribution
+
+   Returns:
+
+     double                    run time (seconds)
+*/
+double sample_distribution(const distribution *dist)
+{
+    double u, v;
+
+    if (strcmp(dist->type, "uniform") == 0)
+    {
+        return dist->a + (dist->b - dist->a)*drand48();
+    }
+
+    else if (strcmp(dist->type, "exp") == 0)
+    {
+        return -dist->a*log(1.0 - drand48());
+    }
+
+    else if (strcmp(dist->type, "lognormal") == 0)
+    {
+        // Box-Muller transform
+        u = 1.0 - drand48();
+        v = drand48();
+
+        return exp(dist->a + dist->b*sqrt(-2.0*log(u))*cos(2.0*M_PI*v));
+    }
+
+    return dist->a;
+}
+
+/* Record the run time of a key
+
+   Arguments:
+
+     history *h                pointer to run time history
+     const char *key           key (command or tag)
+     size_t length             length of key
+     double run_time           run time (seconds)
+     bool accumulate           add to earlier runs, rather than replacing them
+*/
+void history_add(history *h, const char *key, size_t length, double run_time, bool accumulate)
+{
+    size_t i, j, old_capacity = h->capacity;
+    char **old_keys = h->keys;
+    double *old_total = h->total;
+    int *old_count = h->count;
+
+    // keep the table at most half full
+    if (2*(h->size + 1) > h->capacity)
+    {
+        h->capacity = h->capacity ? 2*h->capacity : 1024;
+        h->keys = calloc(h->capacity, sizeof(char *));
+        h->total = malloc(h->capacity * sizeof(double));
+        h->count = malloc(h->capacity * sizeof(int));
+
+        if (h->keys == NULL || h->total == NULL || h->count == NULL)
+        {
+            perror("[ERROR] malloc");
+            exit(1);
+        }
+
+        for (i=0;i<old_capacity;i++)
+        {
+            if (old_keys[i] == NULL) continue;
+
+            j = hash_task(old_keys[i], strlen(old_keys[i])) & (h->capacity - 1);
+            while (h->keys[j] != NULL) j = (j + 1) & (h->capacity - 1);
+
+            h->keys[j] = old_keys[i];
+            h->total[j] = old_total[i];
+            h->count[j] = old_count[i];
+        }
+
+        free(old_keys);
+        free(old_total);
+        free(old_count);
+    }
+
+    i = hash_task(key, length) & (h->capacity - 1);
+
+    while (h->keys[i] != NULL)
+    {
+        if (strlen(h->keys[i]) == length && memcmp(h->keys[i], key, length) == 0)
+        {
+            h->total[i] = accumulate ? h->total[i] + run_time : run_time;
+            h->count[i] = accumulate ? h->count[i] + 1 : 1;
+            return;
+        }
+
+        i = (i + 1) & (h->capacity - 1);
+    }
+
+    h->keys[i] = strndup(key, length);
+    h->total[i] = run_time;
+    h->count[i] = 1;
+    h->size++;
+}
+
+/* Look up the mean run time of a key
+
+   Arguments:
+
+     const history *h          pointer to run time history
+     const char *key           key (command or tag)
+     size_t length             length of key
+
+   Returns:
+
+     double                    mean run time (seconds), or -1 if unknown
+*/
+double history_find(const history *h, const char *key, size_t length)
+{
+    size_t i;
+
+    if (h->size == 0) return -1;
+
+    for (i = hash_task(key, length) & (h->capacity - 1); h->keys[i] != NULL; i = (i + 1) & (h->capacity - 1))
+    {
+        if (strlen(h->keys[i]) == length && memcmp(h->keys[i], key, length) == 0)
+            return h->total[i] / h->count[i];
+    }
+
+    return -1;
+}
+
+// Release a run time history
+void free_history(history *h)
+{
+    size_t i;
+
+    for (i=0;i<h->capacity;i++) free(h->keys[i]);
+
+    free(h->keys);
+    free(h->total);
+    free(h->count);
+    memset(h, 0, sizeof(history));
+}
+
+/* Read the run times of earlier tasks from a completion ledger
+
+   Each line of the ledger has the form "TAG STATUS RANK ELAPSED COMMAND".
+   Only tasks that succeeded are used, since failed, disallowed and
+   cancelled tasks may not have run to completion. The most recent run of
+   a command is kept, while the run times of tagged tasks are averaged.
+
+   Arguments:
+
+     const char *ledger_file   path to ledger file
+     history *commands         pointer to run time history of commands
+     history *tags             pointer to run time history of tags
+*/
+void load_ledger(const char *ledger_file, history *commands, history *tags)
+{
+    FILE *fp;
+    int status, n;
+    char *line = NULL;
+    size_t line_size = 0, tag_length;
+    ssize_t length;
+    double elapsed;
+
+    if ((fp = fopen(ledger_file, "r")) == NULL)
+    {
+        perror("[ERROR] fopen");
+        exit(1);
+    }
+
+    while ((length = getline(&line, &line_size, fp)) != -1)
+    {
+        if (sscanf(line, "%*s %d %*d %lf %n", &status, &elapsed, &n) != 2 || status != 0) continue;
+
+        while (length > n && (line[length - 1] == '\n' || line[length - 1] == '\r')) length--;
+
+        history_add(commands, line + n, length - n, elapsed, false);
+
+        // "-" marks an untagged task
+        tag_length = strcspn(line, " ");
+        if (tag_length != 1 || line[0] != '-') history_add(tags, line, tag_length, elapsed, true);
+    }
+
+    fclose(fp);
+    free(line);
+}
+
+/* Load tasks and their run time estimates
+
+   Lines of the macro header ("@def NAME=VALUE") at the start of the task
+   file count towards its size, but aren't tasks. The header is parsed, and
+   macros are expanded, by the same library functions TaskFarmer uses.
+
+   Arguments:
+
+     const char *task_file     path to task file
+     const char *ledger_file   path to ledger file (or empty string)
+     const char *estimates_file
+                               path to estimates file (or empty string)
+     const distribution *dist  pointer to fallback run time distribution
+     size_t *num_tasks         pointer to number of tasks
+     size_t *total_bytes       pointer to size of task file
+
+   Returns:
+
+     task *                    array of tasks (caller must free)
+*/
+task *load_tasks(const char *task_file, const char *ledger_file, const char *estimates_file,
+    const distribution *dist, size_t *num_tasks, size_t *total_bytes)
+{
+    FILE *fp, *fe = NULL;
+    char *line = NULL, *estimate = NULL, *comment, *command;
+    const char *tag;
+    size_t capacity = 1024, line_size = 0, estimate_size = 0, tag_length;
+    ssize_t length;
+    long long header_lines;
+    history commands = { 0 }, tags = { 0 };
+    macro_table macros = { 0 };
+    task *tasks = malloc(capacity * sizeof(task));
+
+    if ((fp = fopen(task_file, "r")) == NULL)
+    {
+        perror("[ERROR] fopen");
+        exit(1);
+    }
+
+    if (estimates_file[0] != '\0' && (fe = fopen(estimates_file, "r")) == NULL)
+    {
+        perror("[ERROR] fopen");
+        exit(1);
+    }
+
+    if (ledger_file[0] != '\0') load_ledger(ledger_file, &commands, &tags);
+
+    // macro definitions are read with every dequeue, but aren't tasks
+    *num_tasks = 0;
+    *total_bytes = load_macro_header(&macros, fileno(fp));
+
+    for (header_lines = 0; header_lines < macros.header_lines; header_lines++)
+        if (getline(&line, &line_size, fp) == -1) break;
+
+    while ((length = getline(&line, &line_size, fp)) != -1)
+    {
+        if (*num_tasks == capacity)
+        {
+            capacity *= 2;
+            tasks = realloc(tasks, capacity * sizeof(task));
+        }
+
+        tasks[*num_tasks].length = length;
+        tasks[*num_tasks].run_time = -1;
+        *total_bytes += length;
+
+        // annotated run time
+        if ((comment = strrchr(line, '#')) != NULL && (comment = strstr(comment, "runtime=")) != NULL)
+            tasks[*num_tasks].run_time = atof(comment + 8);
+
+        // earlier runs of the task, or failing that of tasks with the same tag
+        if (tasks[*num_tasks].run_time < 0 && commands.size > 0)
+        {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) length--;
+            command = expand_macros(&macros, strndup(line, length));
+
+            tasks[*num_tasks].run_time = history_find(&commands, command, strlen(command));
+
+            if (tasks[*num_tasks].run_time < 0 && (tag_length = task_tag(command, &tag)) > 0)
+                tasks[*num_tasks].run_time = history_find(&tags, tag, tag_length);
+
+            free(command);
+        }
+
+        // estimates file
+        if (fe != NULL && getline(&estimate, &estimate_size, fe) != -1 && tasks[*num_tasks].run_time < 0)
+            tasks[*num_tasks].run_time = atof(estimate);
+
+        // fall back to the distribution
+        if (tasks[*num_tasks].run_time < 0)
+            tasks[*num_tasks].run_time = sample_distribution(dist);
+
+        (*num_tasks)++;
+    }
+
+    fclose(fp);
+    if (fe != NULL) fclose(fe);
+    free(line);
+    free(estimate);
+    free_history(&commands);
+    free_history(&tags);
+    free_macro_table(&macros);
+
+    return tasks;
+}
+
+/* Simulate a TaskFarmer run
+
+   Processes are kept in a binary heap ordered by the time at which they
+   next become free. Since the lock is first-come-first-served, popping the
+   heap gives the order in which processes are served by the lock. As in
+   TaskFarmer, each process claims a single task in file order per lock
+   acquisition.
+
+   Arguments:
+
+     const task *tasks         array of tasks in file order
+     size_t num_tasks          number of tasks
+     size_t total_bytes        initial size of task file
+     int num_ranks             number of processes
+     const char *backend       queue backend (rewrite, cursor or journal)
+     double lock_time          fixed cost of a dequeue (seconds)
+     double byte_time          cost per byte of task file read/rewrite (seconds)
+     double sync_time          cost of a journal record and sync (seconds)
+     result *res               pointer to simulation results
+*/
+void simulate(const task *tasks, size_t num_tasks, size_t total_bytes, int num_ranks,
+    const char *backend, double lock_time, double byte_time, double sync_time, result *res)
+{
+    int parent, child;
+    size_t next, remaining = total_bytes;
+    double lock_free = 0, start, end, busy = 0, wait = 0, last_start = 0, makespan = 0, tmp;
+    bool rewrite = strcmp(backend, "rewrite") == 0;
+    double *heap;
+
+    // all processes are initially free
+    heap = calloc(num_ranks, sizeof(double));
+
+    for (next=0;next<num_tasks;next++)
+    {
+        // the next process to request the lock
+        start = heap[0] > lock_free ? heap[0] : lock_free;
+        wait += start - heap[0];
+
+        // read and rewrite the task file, or read the task and move the cursor
+        lock_free = start + lock_time + byte_time*(rewrite ? remaining : tasks[next].length);
+        if (strcmp(backend, "journal") == 0) lock_free += sync_time;
+
+        remaining -= tasks[next].length;
+        if (lock_free > last_start) last_start = lock_free;
+        end = lock_free + tasks[next].run_time;
+        busy += tasks[next].run_time;
+
+        if (end > makespan) makespan = end;
+
+        // sift the process back down the heap
+        heap[0] = end;
+        parent = 0;
+
+        while ((child = 2*parent + 1) < num_ranks)
+        {
+            if (child + 1 < num_ranks && heap[child + 1] < heap[child]) child++;
+            if (heap[parent] <= heap[child]) break;
+
+            tmp = heap[parent];
+            heap[parent] = heap[child];
+            heap[child] = tmp;
+            parent = child;
+        }
+    }
+
+    free(heap);
+
+    res->makespan = makespan;
+    res->utilization = makespan > 0 ? busy / (num_ranks*makespan) : 0;
+    res->tail_idle = makespan - last_start;
+    res->lock_wait = wait / num_tasks;
+}
+
+/* Measure the cost of a dequeue on the task file's file system
+
+   A scratch file is created alongside the task file. The fixed cost is
+   measured by repeatedly opening, locking, unlocking and closing the empty
+   file, the per-byte cost from the time taken to read and rewrite it once
+   it has been filled, and the sync cost from the time taken to append a
+   record to it and sync it.
+
+   Arguments:
+
+     const char *task_file     path to task file
+     double *lock_time         pointer to lock time variable
+     double *byte_time         pointer to byte time variable
+     double *sync_time         pointer to sync time variable
+*/
+void measure_lock_time(const char *task_file, double *lock_time, double *byte_time, double *sync_time)
+{
+    int i, j, fd;
+    int repeats = 100;
+    size_t size = 1 << 22;
+    double start, total;
+    char *buffer;
+    char scratch_file[1024 + 16];
+    struct flock fl = { .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+
+    snprintf(scratch_file, sizeof(scratch_file), "%s.sim.XXXXXX", task_file);
+
+    if ((fd = mkstemp(scratch_file)) == -1)
+    {
+        perror("[ERROR] mkstemp");
+        exit(1);
+    }
+
+    if (close(fd) == -1)
+    {
+        perror("[ERROR] close");
+        exit(1);
+    }
+
+    if ((buffer = malloc(size)) == NULL)
+    {
+        perror("[ERROR] malloc");
+        exit(1);
+    }
+    memset(buffer, 'x', size);
+
+    for (i=0;i<3;i++)
+    {
+        start = wall_time();
+
+        for (j=0;j<repeats;j++)
+        {
+            if ((fd = open(scratch_file, O_RDWR)) == -1)
+            {
+                perror("[ERROR] open");
+                exit(1);
+            }
+
+            fl.l_type = F_WRLCK;
+            if (fcntl(fd, F_SETLKW, &fl) == -1)
+            {
+                perror("[ERROR] fcntl");
+                exit(1);
+            }
+
+            // read and rewrite the file
+            if (i == 1)
+            {
+                if (pread(fd, buffer, size, 0) == -1
+                    || ftruncate(fd, 0) == -1
+                    || pwrite(fd, buffer, size, 0) == -1)
+                {
+                    perror("[ERROR] pwrite");
+                    exit(1);
+                }
+            }
+
+            // append a claim record and sync it, as for the journal backend
+            else if (i == 2)
+            {
+                if (pwrite(fd, buffer, 32, size + 32*j) == -1 || fdatasync(fd) == -1)
+                {
+                    perror("[ERROR] fdatasync");
+                    exit(1);
+                }
+            }
+
+            fl.l_type = F_UNLCK;
+            if (fcntl(fd, F_SETLK, &fl) == -1)
+            {
+                perror("[ERROR] fcntl");
+                exit(1);
+            }
+
+            if (close(fd) == -1)
+            {
+                perror("[ERROR] close");
+                exit(1);
+            }
+        }
+
+        total = (wall_time() - start) / repeats;
+
+        if (i == 0)
+        {
+            *lock_time = total;
+
+            // fill the file for the rewrite measurement
+            fd = open(scratch_file, O_WRONLY);
+            if (fd == -1 || pwrite(fd, buffer, size, 0) == -1)
+            {
+                perror("[ERROR] pwrite");
+                exit(1);
+            }
+
+            if (close(fd) == -1)
+            {
+                perror("[ERROR] close");
+                exit(1);
+            }
+
+            repeats = 10;
+        }
+
+        else if (i == 1)
+        {
+            *byte_time = total > *lock_time ? (total - *lock_time) / size : 0;
+        }
+
+        else
+        {
+            *sync_time = total > *lock_time ? total - *lock_time : 0;
+        }
+    }
+
+    if (unlink(scratch_file) == -1)
+    {
+        perror("[ERROR] unlink");
+        exit(1);
+    }
+
+    free(buffer);
+}
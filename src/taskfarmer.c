@@ -59,6 +59,27 @@
                             sleep duration when idle (seconds)
    -m MAX_RETRIES, --max-retries MAX_RETRIES
                             maximum number of times to retry failed tasks
+   -x FACTOR, --speculate FACTOR
+                            duplicate straggling tasks on idle processes
+   -p, --preflight          validate and clean the task file before launching
+   -c, --check-inputs       as --preflight, also checking input files exist
+   -d [DISALLOWED [DISALLOWED ...]], --disallowed [DISALLOWED [DISALLOWED ...]]
+                            list of disallowed commands
+   -q BACKEND, --queue-backend BACKEND
+                            how tasks are removed from the task file
+   -g LEDGER, --ledger LEDGER
+                            file to which task completions are appended
+   -l LOCK_TYPE, --lock-type LOCK_TYPE
+                            how files are locked
+   -e ENGINE, --io-engine ENGINE
+                            how queue and ledger I/O is issued
+   -t FORMAT, --format FORMAT
+                            how tasks are written in the task file
+   -F, --fair-lock          grant file locks in first-come, first-served order
+   -C, --combine            claim tasks for all processes on a node at once
+   -k, --kill-cancelled     terminate running tasks cancelled with --signal
+   -b NUM_TASKS, --benchmark NUM_TASKS
+                            benchmark and check the queue backend and locks
 
   It is possible to change the state of idle cores using the "--wait-on-idle"
   option. When set, a core will sleep for a specified period of time if it
@@ -72,6 +93,227 @@
   The "--retry" and "--max-retries" options allow TaskFarmer to retry failed
   tasks up to a maximum number of attempts. The default number of retries is 10.
 
+  The "--speculate" option reduces the time spent waiting for a few slow
+  tasks at the end of a run. Once the task file is empty, an idle process will
+  duplicate any task that has been running for more than FACTOR times its
+  predicted run time, given as "runtime=SECONDS" in a trailing comment (as
+  for taskfarmer-sim), or failing that, the median run time of the tasks
+  completed so far. The first copy to finish wins and the other is
+  terminated. Running tasks are recorded in a file alongside the task file
+  (e.g. tasks.txt.running), which is reset at start up, so the task file
+  should only be used by a single TaskFarmer run in this mode. Tasks must be
+  safe to run twice concurrently. Each copy is given its own empty scratch
+  directory, TASKFARMER_SCRATCH, under a directory alongside the task file
+  (e.g. tasks.txt.scratch). The directory of the copy that finishes first is
+  kept as tasks.txt.scratch/TASK_ID, unless it is empty, and that of the
+  other copy is removed.
+
+  The "--preflight" option scans the task file in parallel before any task
+  is launched. The file is split evenly between the processes and each line
+  is checked for unterminated quotes, trailing line continuations and null
+  characters. Blank lines, comment lines and exact duplicates (all but the
+  first occurrence) are removed and DOS line endings are converted. With
+  "--check-inputs" the files that tasks redirect their standard input from
+  are also checked for existence. TaskFarmer exits without launching any
+  tasks if an error is found.
+
+  Commands from the task file can be checked against a "--disallowed" list
+  before being executed. This avoids undesired consequences if the task file
+  is corrupted, or if an I/O error is encountered. A task is skipped if any
+  disallowed command appears in it as a separate word, where words are
+  delimited by whitespace and the shell control characters ;|&(). All of the
+  commands are compiled into a single Aho-Corasick automaton at start up, so
+  the check costs a single pass over the task, however many commands are
+  listed.
+
+  The "--queue-backend" option selects how tasks are removed from the task
+  file. The default, "rewrite", reads the task file and rewrites it without its
+  first line, so the cost of each dequeue grows with the size of the file. The
+  "cursor" backend instead leaves the task file untouched and records the byte
+  offset of the next unclaimed task in a file alongside it (e.g.
+  tasks.txt.offset), so each dequeue only reads a single line. The task file is
+  truncated once all of its tasks have been claimed. The offset file is shared
+  with the Python implementation, so both can work on the same queue. Delete
+  the offset file if the task file is replaced, rather than appended to.
+
+  Neither backend survives a crash at the wrong moment: "rewrite" truncates
+  the task file before writing it back, and nothing is synced to disk. The
+  "journal" backend reads tasks like "cursor", but records each claim by
+  appending the inode and offset of the task file to a claim journal (e.g.
+  tasks.txt.journal) followed by fdatasync(). One record and one sync cover
+  all of the tasks claimed under the lock (with "--combine", a task for every
+  waiting process on the node). Once the first megabyte and half of the task
+  file, or all of it, has been claimed, the unclaimed tasks are written to a
+  temporary file that is synced and renamed over the task file, and the
+  journal is started afresh the same way. The task file can therefore never
+  be lost, and only tasks that were running at the time of a crash are lost
+  from the queue. The journal is tied to the task file by its inode, so a
+  replaced task file is read from the start. Since the task file is
+  replaced, claims are serialised by locking a guard file alongside it (e.g.
+  tasks.txt.guard) rather than the task file itself. The Python
+  implementation doesn't support this backend.
+
+  The "gzip" backend reads a compressed task file made of independent gzip
+  members (frames) holding whole lines, e.g. made with
+
+   split -l 10000 --filter=gzip tasks.txt > tasks.txt.gz
+
+  The frames are found once and listed in an index file alongside the task
+  file (e.g. tasks.txt.gz.idx), after which each process only reads and
+  decompresses the frame holding the task it claims, keeping it for the next
+  claim. The line number of the next unclaimed task is kept in the offset
+  file, and requeued tasks are appended as a new frame. The task file is
+  never rewritten. This backend needs TaskFarmer to be built with zlib (the
+  default).
+
+  The "--io-engine" option selects how I/O on the queue files and ledger is
+  issued. The default, "sync", uses plain system calls. "uring" uses an
+  io_uring owned by each process: writes that must reach the disk (journal
+  records, requeued tasks and compacted files with the journal backend) are
+  linked to their fdatasync() and issued with a single system call, and
+  ledger lines are appended asynchronously, so a slow file system doesn't
+  hold up the next task. If io_uring is unavailable (old kernels, or blocked
+  by a seccomp filter) a warning is printed and plain system calls are used.
+
+  The "--format" option selects how tasks are written in the task file. The
+  default, "line", runs each line as a shell command. With "argv0" each task
+  is a record of NUL-terminated fields ended by an extra NUL, e.g.
+
+   printf 'grep\0-c\0two words\0\001<in.txt\0\001>out.txt\0\0' >> tasks.bin
+
+  The first field is the program (searched for on the PATH) and the rest are
+  its arguments, passed as they are, so nothing needs to be quoted. Fields
+  starting with the byte 0x01 are tagged by the byte that follows: "e" sets an
+  environment variable (NAME=VALUE), "<" redirects standard input from a
+  file, ">" and "+" truncate or append standard output to a file, and "2"
+  truncates standard error to a file. The program is started directly with
+  posix_spawnp(), without a shell, and arguments can't be empty. Tasks are
+  shown (e.g. in the ledger and for "--disallowed") with their fields joined
+  by spaces. Speculation and preflight aren't supported with this format, nor
+  is it supported by the Python implementation.
+
+  Task files in the line format can start with a header of "@def NAME=VALUE"
+  lines. The header is kept at the start of the file by every queue backend
+  (for "gzip" it must be held by the first frame), and each "@{NAME}" in a
+  task is replaced by VALUE once the task has been claimed, so long prefixes
+  shared by many tasks are only stored, read and rewritten once. Values
+  aren't expanded again, and references to undefined macros are left as they
+  are. The Python implementation doesn't support macros.
+
+  The "--ledger" option appends a line of the form
+
+   TAG STATUS RANK ELAPSED COMMAND
+
+  to a completion ledger as each task finishes (after any retries). TAG is
+  taken from a trailing "#tf:TAG" comment on the task ("-" if there isn't
+  one), STATUS is the exit status of the task (128 plus the signal number if
+  it was killed, -1 if it was disallowed, or -2 if it was cancelled) and ELAPSED is its wall time in
+  seconds. The ledger format is shared with the Python implementation, whose
+  Farm object uses it to report results to programs that submit tasks.
+
+  Pending tasks can be cancelled, without touching the task file, with
+  taskfarmer-cancel, which adds tombstones for the tasks matching a regular
+  expression, tag or range of queue positions to a file alongside the task
+  file (e.g. tasks.txt.cancel). Each tombstone holds a copy of a task, its
+  hash and length, and the number of pending copies that were cancelled,
+  and the file is kept sorted by hash, so a claimed task is checked with a
+  binary search and then compared with the copy. The file is checked for
+  changes at most once a second, and cancelled tasks are skipped when they
+  are claimed, until as many copies as were cancelled have been skipped. With
+  "--kill-cancelled", tasks are polled while they run (as for "--fair-lock")
+  and a task that was running when it was cancelled with
+  "taskfarmer-cancel --signal" is terminated (with SIGTERM, then SIGKILL)
+  and not retried.
+
+  Each queue backend implements the same small interface (see queue_backend
+  in taskfarmer.h): claim up to n tasks, report a task as complete, requeue a
+  task, count the unclaimed tasks, and close. The "--benchmark" option checks
+  and times the backend selected with "--queue-backend" on the current file
+  system. The task file is overwritten with NUM_TASKS synthetic tasks, which
+  all processes then claim as fast as possible, in batches of varying size.
+  The backend passes if every task, and every task index, is claimed exactly
+  once, the queue is then empty, and a requeued task can be claimed again.
+  The claim rate is reported. Each lock type is then timed and checked for
+  mutual exclusion, by having every process repeatedly increment a counter in
+  a scratch file under the lock. TaskFarmer exits with a non-zero status if
+  the backend, or the lock type selected with "--lock-type", fails, e.g.
+
+   mpirun -np 64 taskfarmer -f bench.txt -q cursor -l ofd -b 100000
+
+  The "--lock-type" option selects the primitive used for all file locking.
+  The default, "fcntl", uses POSIX record locks. These belong to the process,
+  which is fine for TaskFarmer, and are the most widely supported by network
+  file systems, but can be slow. "ofd" uses Linux open file description locks,
+  which conflict with POSIX locks, so can be mixed with the Python
+  implementation (which uses fcntl locks). "flock" uses BSD locks, which only
+  work across nodes on some file systems. "lockfile" creates a lock file
+  alongside the locked file (e.g. tasks.txt.lock) with O_EXCL, which works
+  on file systems without any lock support, at the cost of polling. The lock
+  file holds the host name and process id of its holder, which touches it
+  every 15 seconds while it holds the lock. It is assumed to be abandoned,
+  and is removed, once its holder has exited (if on the same host) or it
+  hasn't been touched for a minute (otherwise). All processes sharing a task
+  file must use the same lock type. Use
+  "--benchmark" to find the fastest lock type that is correct on your
+  cluster.
+
+  Either option can be set to "auto", in which case the type of file system
+  holding the task file is looked up with statfs() at start up and the choice
+  is made for you, and printed. Local file systems (tmpfs, ext4, xfs) get the
+  cursor backend with ofd locks. NFS, Lustre and GPFS get the cursor backend
+  with fcntl locks, which they support across nodes. BeeGFS only honours
+  fcntl locks within a node unless global file locks are enabled, so gets
+  lock files. Other file systems get the defaults. Since the Python
+  implementation doesn't support "auto", give the resolved values to any
+  Python farmers sharing the task file.
+
+  None of the lock types guarantee fairness, so under heavy contention some
+  processes (e.g. those closest to the lock manager) can win the lock over
+  and over while others wait. The "--fair-lock" option adds a queue lock,
+  held in MPI one-sided memory, which every process joins before taking the
+  file lock, so the file lock is granted in first-come, first-served order
+  and no process waits for more than one turn of every other process. The
+  file lock is still taken, to exclude other programs (e.g. the Python
+  implementation). Since not all MPI implementations make progress on
+  one-sided operations in the background, tasks are run with fork() and
+  polled while this option is set, and idle processes poll rather than
+  sleep.
+
+  With many processes per node, most of the time spent claiming tasks goes
+  on processes from the same node queueing for the file lock. The
+  "--combine" option uses flat combining: processes post their requests to
+  node shared memory, and whichever process first finds the node's combiner
+  flag free takes the file lock once, claims a task for every pending
+  request and hands them out. Only one process per node then contends for
+  the lock at a time. Tasks longer than COMBINE_COMMAND_SIZE are handed over
+  in parts.
+
+  Tasks of the form "so:LIBRARY:SYMBOL ARGS..." are plugin tasks. The shared
+  object LIBRARY is loaded with dlopen() (once per process) and SYMBOL is
+  called in-process as "int SYMBOL(int argc, char **argv)", with argv[0] set
+  to SYMBOL and the arguments split on whitespace. The return value is used
+  as the exit status of the task. There is no fork, exec or shell, so short
+  tasks run at close to function-call speed, but a plugin that crashes takes
+  the process down with it, and speculative copies can't be cancelled.
+
+  All of the scheduling logic lives in libtaskfarmer (src/libtaskfarmer.c),
+  whose interface is declared in taskfarmer.h. This file only parses the
+  command-line and calls taskfarmer_run().
+
+  Each task is launched with the following environment variables set:
+
+   TASKFARMER_TASK_ID       global task index, assigned when the task is read
+   TASKFARMER_RANK          rank of the launching process
+   TASKFARMER_LOCAL_RANK    index of the launching process on its node
+   TASKFARMER_SLOT          execution slot within the launching process
+   TASKFARMER_ATTEMPT       number of previous failed attempts
+   TASKFARMER_COPY          1 for a speculative duplicate, otherwise 0
+   TASKFARMER_SCRATCH       scratch directory of this copy (--speculate only)
+   TASKFARMER_NODE          name of the node on which the task is running
+
+  Task indices are shared by all processes using the same task file and are
+  stored in a small counter file alongside it (e.g. tasks.txt.id).
+
   As an example, try running the following
 
    shuf tests/commands.txt | head -n 100 > tasks.txt
@@ -111,7 +353,9 @@
      TaskFarmer's I/O. The file should only be modified when all cores are
      active (running tasks) or in an idle state (task file is emtpy). It is
      recommended to modify the task file using a redirection, rather than
-     opening it and editing directly, e.g. cat more_task >> tasks.txt.
+     opening it and editing directly, e.g. cat more_task >> tasks.txt, or
+     with taskfarmer-append, which takes the task file lock and is safe at
+     any time.
 
    - Clusters that use InfiniBand interconnects can cause problems when
      using fork() in OpenMPI. A workaround can be achieved by disabling
@@ -142,201 +386,45 @@
      allocation. Use your new power wisely!
 */
 
-#include <errno.h>
-#include <fcntl.h>
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
-typedef enum { false, true } bool;
+#include "taskfarmer.h"
 
 // FUNCTION PROTOTYPES
-void parse_command_line_arguments(int, char**, int, char*, bool*, bool*, bool*, int*, int*);
+void parse_command_line_arguments(int, char**, int, taskfarmer_options*);
 void print_help_message();
-void lock_file(struct flock*, int);
-void unlock_file(struct flock*, int);
 
 // BEGIN MAIN FUNCTION
 int main(int argc, char **argv)
 {
-    int i, attempts;
-    int rank, size;
+    int rank, status;
+    taskfarmer_options options;
 
     MPI_Init(&argc, &argv);                 // start MPI
     MPI_Barrier(MPI_COMM_WORLD);            // wait for all processes to start
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);   // get current process id
-    MPI_Comm_size(MPI_COMM_WORLD, &size);   // get number of processes
 
     // set default parameters
-    char task_file[1024];
-    bool verbose = false;
-    bool wait_on_idle = false;
-    int sleep_time = 300;
-    bool retry = false;
-    int max_retries = 10;
-
-    // initialize buffer pointers
-    char *buffer_in;
-    char *buffer_out;
-    char *system_command;
-
-    // file statistics struct
-    struct stat file_stats;
+    taskfarmer_default_options(&options);
 
     // parse all command-line arguments
-    parse_command_line_arguments(argc, argv, rank, task_file,
-        &verbose, &wait_on_idle, &retry, &sleep_time, &max_retries);
-
-    // initialize file lock structure
-    struct flock fl;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
-    fl.l_pid = getpid();
-
-    // file descriptor
-    int fd;
-
-    // loop indefinitely
-    while (true)
-    {
-        // try to open the task file
-        if ((fd = open(task_file, O_RDWR)) == -1)
-        {
-            perror("[ERROR] open");
-            MPI_Finalize();
-            exit(1);
-        }
+    parse_command_line_arguments(argc, argv, rank, &options);
 
-        // attempt to lock file
-        lock_file(&fl, fd);
-
-        // get file statistics
-        if (fstat(fd, &file_stats) == -1)
-        {
-            perror("[ERROR] fstat");
-            MPI_Finalize();
-            exit(1);
-        }
-
-        // check that there are tasks to process
-        if (file_stats.st_size > 0)
-        {
-            // allocate buffer memory
-            buffer_in = calloc(1+file_stats.st_size, sizeof(char));
-            buffer_out = calloc(1+file_stats.st_size, sizeof(char));
-
-            // read task file into buffer
-            read(fd, buffer_in, file_stats.st_size);
-
-            // read first task
-            for (i=0;i<file_stats.st_size;i++)
-            {
-                // found newline
-                if (buffer_in[i] == '\n') break;
-            }
-
-            // allocate memory for system command
-            system_command = calloc((i+1), sizeof(char));
-
-            // copy task into system command buffer
-            strncpy(system_command, buffer_in, i);
-
-            // copy remaining tasks into output buffer
-            strcpy(buffer_out, buffer_in+i+1);
-
-            // return to start of file
-            lseek(fd, 0, SEEK_SET);
-
-            // truncate file
-            ftruncate(fd, 0);
-
-            // write truncated task list buffer to file
-            write(fd, buffer_out, strlen(buffer_out));
-
-            // attempt to unlock file
-            unlock_file(&fl, fd);
-
-            // close file descriptor
-            close(fd);
-
-            // free task file buffers
-            free(buffer_in);
-            free(buffer_out);
-
-            // zero attempts
-            attempts = 0;
-
-            // report task launch
-            if (verbose)
-                printf("[INFO]: Rank %04d launching: %s\n", rank, system_command);
-
-            // retry if task fails
-            while (attempts < max_retries && system(system_command) != 0)
-            {
-                attempts++;
-
-                if (verbose)
-                {
-                    if (retry)
-                        printf("[WARNING]: system command failed, %s (%d/%d)\n", system_command, attempts, max_retries);
-                    else
-                        printf("[WARNING]: system command failed, %s\n", system_command);
-                }
-            }
-
-            // task was successful
-            if (attempts < max_retries)
-            {
-                if (verbose)
-                    printf("[INFO]: Rank %04d completed: %s\n", rank, system_command);
-            }
-
-            // free system command buffer
-            free(system_command);
-        }
-
-        else
-        {
-            if (wait_on_idle)
-            {
-                // report process wait
-                if (verbose)
-                    printf("[INFO]: Rank %04d waiting for more tasks\n", rank);
-
-                // attempt to unlock file
-                unlock_file(&fl, fd);
-
-                // close file descriptor
-                close(fd);
-
-                // sleep for wait period
-                sleep(sleep_time);
-            }
-
-            else
-            {
-                // report that task file is empty
-                if (verbose)
-                    printf("[INFO]: Task file is empty: Rank %04d exiting\n", rank);
-
-                // attempt to unlock file
-                unlock_file(&fl, fd);
+    // check the queue backend, or run tasks until the task file is empty
+    if (options.benchmark > 0)
+        status = taskfarmer_benchmark(&options);
+    else
+        status = taskfarmer_run(&options);
 
-                // close file descriptor
-                close(fd);
+    // other processes may be waiting for this one
+    if (status == TASKFARMER_ERROR) MPI_Abort(MPI_COMM_WORLD, 1);
 
-                // clean up and exit
-                MPI_Finalize();
-                exit(0);
-            }
-        }
-    }
+    MPI_Finalize();
 
-    return 0;
+    return status;
 }
 // END MAIN FUNCTION
 
@@ -349,15 +437,10 @@ int main(int argc, char **argv)
      int argc                  number of command-line arguments
      char **argv               array of command-line arguments
      int rank                  process id
-     char *task_file           pointer to task file buffer
-     bool *verbose             pointer to verbose flag
-     bool *wait_on_idle        pointer to wait flag
-     bool *retry               pointer to retry flag
-     int *sleep_time           pointer to sleep duration variable
-     int *max_retries          pointer to maximum retries variable
+     taskfarmer_options *options
+                               pointer to run-time options
 */
-void parse_command_line_arguments(int argc, char **argv, int rank, char *task_file,
-    bool *verbose, bool *wait_on_idle, bool* retry, int *sleep_time, int *max_retries)
+void parse_command_line_arguments(int argc, char **argv, int rank, taskfarmer_options *options)
 {
     int i = 1;
     bool file;
@@ -397,34 +480,186 @@ void parse_command_line_arguments(int argc, char **argv, int rank, char *task_fi
                 {
                     i++;
                     file = true;
-                    strcpy(task_file, argv[i]);
+                    strcpy(options->task_file, argv[i]);
                 }
 
                 else if (strcmp(argv[i],"-v") == 0 || strcmp(argv[i],"--verbose") == 0)
                 {
-                    *verbose = true;
+                    options->verbose = true;
                 }
 
                 else if (strcmp(argv[i],"-w") == 0 || strcmp(argv[i],"--wait-on-idle") == 0)
                 {
-                    *wait_on_idle = true;
+                    options->wait_on_idle = true;
                 }
 
                 else if (strcmp(argv[i],"-r") == 0 || strcmp(argv[i],"--retry") == 0)
                 {
-                    *retry = true;
+                    options->retry = true;
                 }
 
                 else if (strcmp(argv[i],"-s") == 0 || strcmp(argv[i],"--sleep-time") == 0)
                 {
                     i++;
-                    *sleep_time = atof(argv[i]);
+                    options->sleep_time = atof(argv[i]);
                 }
 
                 else if (strcmp(argv[i],"-m") == 0 || strcmp(argv[i],"--max-retries") == 0)
                 {
                     i++;
-                    *max_retries = atof(argv[i]);
+                    options->max_retries = atof(argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-x") == 0 || strcmp(argv[i],"--speculate") == 0)
+                {
+                    i++;
+                    options->speculate = atof(argv[i]);
+
+                    // make sure the speculation factor is positive
+                    if (options->speculate <= 0)
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Speculation factor must be greater than zero!\n");
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
+                }
+
+                else if (strcmp(argv[i],"-p") == 0 || strcmp(argv[i],"--preflight") == 0)
+                {
+                    options->preflight = true;
+                }
+
+                else if (strcmp(argv[i],"-c") == 0 || strcmp(argv[i],"--check-inputs") == 0)
+                {
+                    options->preflight = true;
+                    options->check_inputs = true;
+                }
+
+                else if (strcmp(argv[i],"-d") == 0 || strcmp(argv[i],"--disallowed") == 0)
+                {
+                    // commands are listed up to the next option
+                    options->disallowed = &argv[i+1];
+
+                    while (i+1 < argc && argv[i+1][0] != '-')
+                    {
+                        i++;
+                        options->num_disallowed++;
+                    }
+                }
+
+                else if (strcmp(argv[i],"-q") == 0 || strcmp(argv[i],"--queue-backend") == 0)
+                {
+                    i++;
+
+                    if (!valid_queue_backend(argv[i]) && strcmp(argv[i], "auto") != 0)
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Unknown queue backend %s\n", argv[i]);
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
+
+                    strcpy(options->queue_backend, argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-g") == 0 || strcmp(argv[i],"--ledger") == 0)
+                {
+                    i++;
+                    strcpy(options->ledger_file, argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-l") == 0 || strcmp(argv[i],"--lock-type") == 0)
+                {
+                    i++;
+
+                    if (!valid_lock_type(argv[i]) && strcmp(argv[i], "auto") != 0)
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Unknown lock type %s\n", argv[i]);
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
+
+                    strcpy(options->lock_type, argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-e") == 0 || strcmp(argv[i],"--io-engine") == 0)
+                {
+                    i++;
+
+                    if (!valid_io_engine(argv[i]))
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Unknown I/O engine %s\n", argv[i]);
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
+
+                    strcpy(options->io_engine, argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-t") == 0 || strcmp(argv[i],"--format") == 0)
+                {
+                    i++;
+
+                    if (!valid_task_format(argv[i]))
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Unknown task format %s\n", argv[i]);
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
+
+                    strcpy(options->format, argv[i]);
+                }
+
+                else if (strcmp(argv[i],"-F") == 0 || strcmp(argv[i],"--fair-lock") == 0)
+                {
+                    options->fair_lock = true;
+                }
+
+                else if (strcmp(argv[i],"-C") == 0 || strcmp(argv[i],"--combine") == 0)
+                {
+                    options->combine = true;
+                }
+
+                else if (strcmp(argv[i],"-k") == 0 || strcmp(argv[i],"--kill-cancelled") == 0)
+                {
+                    options->kill_cancelled = true;
+                }
+
+                else if (strcmp(argv[i],"-b") == 0 || strcmp(argv[i],"--benchmark") == 0)
+                {
+                    i++;
+                    options->benchmark = atoll(argv[i]);
+
+                    // make sure the number of tasks is positive
+                    if (options->benchmark <= 0)
+                    {
+                        if (rank == 0)
+                        {
+                            fprintf(stderr, "[ERROR]: Number of benchmark tasks must be greater than zero!\n");
+                        }
+
+                        MPI_Finalize();
+                        exit(1);
+                    }
                 }
 
                 else if (strcmp(argv[i],"-h") == 0 || strcmp(argv[i],"--help") == 0)
@@ -468,11 +703,11 @@ void parse_command_line_arguments(int argc, char **argv, int rank, char *task_fi
     }
 
     // only attempt to launch tasks once if retry option is unset
-    if (!*retry) *max_retries = 1;
+    if (!options->retry) options->max_retries = 1;
     else
     {
         // make sure number of retries is a positive, non-zero integer
-        if (*max_retries <= 0)
+        if (options->max_retries <= 0)
         {
             if (rank == 0)
             {
@@ -484,10 +719,10 @@ void parse_command_line_arguments(int argc, char **argv, int rank, char *task_fi
         }
     }
 
-    if (*wait_on_idle)
+    if (options->wait_on_idle)
     {
         // make sure sleep time is a positive, non-zero integer
-        if (*sleep_time <= 0)
+        if (options->sleep_time <= 0)
         {
             if (rank == 0)
             {
@@ -504,7 +739,10 @@ void parse_command_line_arguments(int argc, char **argv, int rank, char *task_fi
 void print_help_message()
 {
     puts("TaskFarmer - a simple task farmer for running serial tasks with mpirun.\n\n"
-         "Usage: mpirun -np CORES taskfarmer [-h] -f FILE [-v] [-w] [-r] [-s SLEEP_TIME] [-m MAX_RETRIES]\n\n"
+         "Usage: mpirun -np CORES taskfarmer [-h] -f FILE [-v] [-w] [-r] [-s SLEEP_TIME] [-m MAX_RETRIES]\n"
+         "                                   [-x FACTOR] [-p] [-c] [-d [DISALLOWED ...]] [-q BACKEND]\n"
+         "                                   [-g LEDGER] [-l LOCK_TYPE] [-e ENGINE] [-t FORMAT] [-F]\n"
+         "                                   [-C] [-k] [-b NUM_TASKS]\n\n"
 
          "Available options:\n"
          " -h/--help                 : Print this help information\n"
@@ -513,47 +751,25 @@ void print_help_message()
          " -w/--wait-on-idle         : Wait for more tasks when idle\n"
          " -r/--retry                : Retry failed tasks\n"
          " -s/--sleep-time <int>     : Sleep duration when idle (seconds)\n"
-         " -m/--max-retries <int>    : Maximum number of retries for failed tasks\n");
-}
-
-/* Attempt to acquire a file lock
-
-   Arguments:
-
-     struct flock *fl          pointer to file lock structure
-     int fd                    file descriptor
-*/
-void lock_file(struct flock *fl, int fd)
-{
-    // set to write/exclusive lock
-    fl->l_type = F_WRLCK;
-
-    // try to lock file
-    if (fcntl(fd, F_SETLKW, fl) == -1)
-    {
-        perror("[ERROR] fcntl");
-        MPI_Finalize();
-        exit(1);
-    }
+         " -m/--max-retries <int>    : Maximum number of retries for failed tasks\n"
+         " -x/--speculate <float>    : Duplicate tasks running FACTOR times longer than\n"
+         "                             the median once the task file is empty\n"
+         " -p/--preflight            : Validate and clean the task file before launching\n"
+         " -c/--check-inputs         : As --preflight, also checking that input files exist\n"
+         " -d/--disallowed <list>    : Skip tasks that run any of the listed commands\n"
+         " -q/--queue-backend <string>\n"
+         "                           : How tasks are removed from the task file (rewrite, cursor,\n"
+         "                             journal, gzip, auto)\n"
+         " -g/--ledger <string>      : Append a line to this file as each task completes\n"
+         " -l/--lock-type <string>   : How files are locked (fcntl, ofd, flock, lockfile,\n"
+         "                             auto)\n"
+         " -e/--io-engine <string>   : How queue and ledger I/O is issued (sync, uring)\n"
+         " -t/--format <string>      : How tasks are written in the task file (line, argv0)\n"
+         " -F/--fair-lock            : Grant file locks to processes in the order they ask\n"
+         " -C/--combine              : Claim tasks for all processes on a node under one lock\n"
+         " -k/--kill-cancelled       : Terminate running tasks cancelled with\n"
+         "                             \"taskfarmer-cancel --signal\"\n"
+         " -b/--benchmark <int>      : Benchmark and check the queue backend and lock types\n"
+         "                             with this many synthetic tasks (overwrites the task file)\n");
 }
 
-/* Attempt to release a file lock
-
-   Arguments:
-
-     struct flock *fl          pointer to file lock structure
-     int fd                    file descriptor
-*/
-void unlock_file(struct flock *fl, int fd)
-{
-    // set to unlocked
-    fl->l_type = F_UNLCK;
-
-    // try to unlock file
-    if (fcntl(fd, F_SETLK, fl) == -1)
-    {
-        perror("[ERROR] fcntl");
-        MPI_Finalize();
-        exit(1);
-    }
-}
@@ -0,0 +1,346 @@
+/*
+  Copyright (c) 2013, 2014 Lester Hedges <lester.hedges@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  libtaskfarmer: the scheduling logic of TaskFarmer as a library.
+
+  The taskfarmer executable is a thin wrapper around taskfarmer_run(), which
+  can also be called from any MPI program that wants to work through a task
+  file. The building blocks used by taskfarmer_run() (claiming tasks from the
+  task file, launching them, the speculation registry, etc.) are declared
+  here too, so that they can be reused and tested individually.
+
+  After an error, taskfarmer_run() and taskfarmer_benchmark() return
+  TASKFARMER_ERROR, having released this process's file locks. Other
+  processes may be waiting for this one, so the caller will usually want to
+  call MPI_Abort(). The building blocks exit on errors, unless called from
+  within those entry points.
+
+  Link with -ltaskfarmer -ldl -pthread (and -lz, unless built with ZLIB=0).
+*/
+
+#ifndef _TASKFARMER_H
+#define _TASKFARMER_H
+
+#include <fcntl.h>
+#include <mpi.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// returned by taskfarmer_run() and taskfarmer_benchmark() after an error
+#define TASKFARMER_ERROR        -1
+
+// speculative execution parameters
+#define SPECULATE_POLL_TIME     5       // idle check interval (seconds)
+#define SPECULATE_SAMPLES       1024    // number of run times kept for median
+#define CANCEL_POLL_INTERVAL    10000   // child poll interval (microseconds)
+#define CANCEL_GRACE_TIME       10      // time before SIGKILL (seconds)
+#define CANCEL_TAG              1       // MPI tag for cancellation messages
+#define RUNTIME_ANNOTATION      "runtime=" // predicted run time, in a trailing comment
+
+// lock types
+enum { LOCK_TYPE_FCNTL, LOCK_TYPE_OFD, LOCK_TYPE_FLOCK, LOCK_TYPE_LOCKFILE };
+extern const char *lock_type_names[];
+#define MAX_HELD_LOCKS          8       // most file locks held by a process at once
+
+// task file formats
+enum { TASK_FORMAT_LINE, TASK_FORMAT_ARGV0 };
+extern const char *task_format_names[];
+
+// tags of the fields of argv0 records (following ARGV0_TAG)
+#define ARGV0_TAG               '\x01'  // marks a field as other than an argument
+#define ARGV0_ENV               'e'     // NAME=VALUE environment variable
+#define ARGV0_STDIN             '<'     // read standard input from a file
+#define ARGV0_STDOUT            '>'     // write standard output to a file
+#define ARGV0_APPEND            '+'     // append standard output to a file
+#define ARGV0_STDERR            '2'     // write standard error to a file
+
+// I/O engines
+enum { IO_ENGINE_SYNC, IO_ENGINE_URING };
+extern const char *io_engine_names[];
+
+// io_uring engine parameters
+#define IO_URING_ENTRIES        64      // submission queue size (and most asynchronous writes)
+
+// lock file parameters (lockfile lock type only)
+#define LOCKFILE_MIN_DELAY      1000    // initial retry interval (microseconds)
+#define LOCKFILE_MAX_DELAY      100000  // maximum retry interval (microseconds)
+#define LOCKFILE_STALE_TIME     60      // age of an abandoned lock file (seconds)
+#define LOCKFILE_TOUCH_INTERVAL 15      // time between touches of a held lock file (seconds)
+
+// file system magic numbers (see statfs(2)), used to pick the queue strategy
+#define FS_MAGIC_TMPFS          0x01021994
+#define FS_MAGIC_EXT4           0xef53  // also ext2 and ext3
+#define FS_MAGIC_XFS            0x58465342
+#define FS_MAGIC_NFS            0x6969
+#define FS_MAGIC_LUSTRE         0x0bd00bd0
+#define FS_MAGIC_GPFS           0x47504653
+#define FS_MAGIC_BEEGFS         0x19830326
+
+// fair lock window layout (MCS queue lock)
+enum { FAIR_LOCK_TAIL, FAIR_LOCK_NEXT, FAIR_LOCK_BLOCKED, FAIR_LOCK_SIZE };
+
+// claim journal parameters (journal backend only)
+#define JOURNAL_COMPACT_SIZE    1048576 // claimed bytes before compacting the task file
+#define JOURNAL_MAX_SIZE        1048576 // journal bytes before compacting the task file
+
+// compressed task file parameters (gzip backend only)
+#define GZIP_FRAME_SIZE         1048576 // uncompressed bytes per frame written by TaskFarmer
+#define GZIP_READ_SIZE          1048576 // compressed bytes read at a time
+
+// bulk appends (taskfarmer-append)
+#define APPEND_BATCH_SIZE       67108864 // bytes of tasks appended under one lock
+
+// cancelling tasks (taskfarmer-cancel)
+#define TOMBSTONE_CHECK_INTERVAL 1      // time between checks of the tombstone file (seconds)
+#define TOMBSTONE_SIGNAL        1       // flag: also terminate the task if it is running
+#define TASK_CANCELLED          -2      // status of a cancelled task
+
+// flat combining parameters
+#define COMBINE_COMMAND_SIZE    65536   // longest task handed over in one part
+#define COMBINE_POLL_INTERVAL   50      // request poll interval (microseconds)
+
+// queue backend benchmark
+#define BENCHMARK_MAX_BATCH     4       // largest number of tasks claimed at once
+
+// task file macros (line format only)
+#define MACRO_PREFIX            "@def " // starts a "@def NAME=VALUE" line of the header
+#define MACRO_OPEN              "@{"    // starts a "@{NAME}" reference in a task
+#define MACRO_CLOSE             '}'     // ends a reference
+
+// plugin tasks
+#define PLUGIN_PREFIX           "so:"   // marks a plugin task
+#define PLUGIN_MAX_ARGS         256     // maximum number of plugin arguments
+
+// options controlling a run
+typedef struct
+{
+    char task_file[1024];               // location of task file
+    bool verbose;                       // print status updates to stdout
+    bool wait_on_idle;                  // wait for more tasks when idle
+    bool retry;                         // retry failed tasks
+    int sleep_time;                     // sleep duration when idle (seconds)
+    int max_retries;                    // maximum number of attempts
+    double speculate;                   // speculation factor (0 to disable)
+    bool preflight;                     // validate the task file first
+    bool check_inputs;                  // also check that input files exist
+    char **disallowed;                  // array of disallowed commands
+    int num_disallowed;                 // number of disallowed commands
+    char queue_backend[16];             // how tasks are removed from the file
+    char ledger_file[1024];             // completion ledger (empty to disable)
+    char lock_type[16];                 // primitive used for file locking
+    char io_engine[16];                 // how queue and ledger I/O is issued
+    char format[16];                    // format of the tasks in the task file
+    bool fair_lock;                     // take file locks in FIFO order
+    bool combine;                       // combine the claims of each node
+    bool kill_cancelled;                // terminate running tasks cancelled with --signal
+    long long benchmark;                // number of benchmark tasks (0 to disable)
+} taskfarmer_options;
+
+// a task claimed from a queue
+typedef struct
+{
+    long long id;                       // global task index
+    char *command;                      // system command (caller must free)
+} queue_task;
+
+// macros defined by the header of a task file
+typedef struct
+{
+    int num_macros;
+    char **names;                       // NAME of each "@def NAME=VALUE" line
+    char **values;                      // VALUE of each line
+    off_t header_length;                // bytes taken by the header
+    long long header_lines;             // lines taken by the header
+    bool loaded;                        // whether the header has been read
+    char *expansion;                    // reusable buffer tasks are expanded into
+    size_t expansion_size;              // size of the expansion buffer
+} macro_table;
+
+// interface implemented by each queue backend
+typedef struct queue_backend
+{
+    const char *name;
+
+    // claim up to n tasks, returning the number claimed (0 if the queue is empty)
+    int (*claim)(struct queue_backend*, int, queue_task*);
+
+    // report that a claimed task has finished with the given exit status
+    void (*complete)(struct queue_backend*, long long, int);
+
+    // return a claimed task to the queue
+    void (*requeue)(struct queue_backend*, const queue_task*);
+
+    // number of unclaimed tasks
+    long long (*size)(struct queue_backend*);
+
+    // release the backend
+    void (*close)(struct queue_backend*);
+
+    // backend wrapped by this one (or NULL)
+    struct queue_backend *inner;
+
+    // backend specific state
+    void *data;
+
+    // state shared by the task file backends
+    char *(*take)(struct queue_backend*, int);
+    char task_file[1024];
+    char id_file[1024 + 8];
+    char offset_file[1024 + 8];
+    char journal_file[1024 + 8];
+    char index_file[1024 + 8];
+    char guard_file[1024 + 8];
+
+    // descriptors kept open between claims (-1 until first used)
+    int task_fd;
+    int id_fd;
+    int offset_fd;
+    int journal_fd;
+    int guard_fd;
+
+    // offset of the first unclaimed task during a claim (journal backend)
+    long long journal_head;
+
+    // macros defined by the task file header
+    macro_table macros;
+} queue_backend;
+
+// a cancelled task, as stored in the tombstone file (native byte order)
+typedef struct
+{
+    unsigned long long hash;            // hash_task() of the task record
+    unsigned long long offset;          // offset of the task record in the file
+    unsigned int length;                // length of the task record
+    unsigned int flags;                 // TOMBSTONE_SIGNAL
+    long long count;                    // number of pending copies still to skip
+    double time;                        // wall time of the last "--signal" request
+} tombstone;
+
+// environment variables exported to each task
+typedef struct
+{
+    char task_id[64];
+    char rank[64];
+    char local_rank[64];
+    char slot[64];
+    char attempt[64];
+    char copy[64];
+    char node[64 + MPI_MAX_PROCESSOR_NAME];
+    char scratch[64 + 1024 + 64];       // scratch directory of each copy (speculative mode only)
+    char scratch_root[1024 + 16];       // directory holding them (empty if not in use)
+} task_environment;
+
+// Aho-Corasick automaton for matching disallowed commands
+typedef struct
+{
+    int num_states;
+    int (*next)[256];                   // transition table
+    bool *match;                        // whether a state ends a pattern
+} command_matcher;
+
+// signature of a plugin task function
+typedef int (*plugin_function)(int, char**);
+
+// FUNCTION PROTOTYPES
+
+// running a task farm
+void taskfarmer_default_options(taskfarmer_options*);
+int taskfarmer_run(const taskfarmer_options*);
+
+// benchmarking and checking queue backends
+int taskfarmer_benchmark(const taskfarmer_options*);
+
+// task file locking
+void init_fair_lock(void);
+void free_fair_lock(void);
+void acquire_fair_lock(void);
+void release_fair_lock(void);
+void progress_sleep(double);
+bool set_lock_type(const char*);
+bool valid_lock_type(const char*);
+
+// I/O
+bool set_io_engine(const char*);
+bool valid_io_engine(const char*);
+void close_io_engine(void);
+void lock_file(struct flock*, int, const char*);
+void unlock_file(struct flock*, int, const char*);
+
+// claiming tasks
+bool set_task_format(const char*);
+bool valid_task_format(const char*);
+size_t record_length(const char*);
+char *record_display(const char*);
+bool valid_queue_backend(const char*);
+void select_queue_strategy(taskfarmer_options*, int);
+queue_backend *open_queue_backend(const char*, const char*);
+queue_backend *open_combining_queue(queue_backend*, MPI_Comm);
+long long next_task_id(int);
+long long claimed_offset(queue_backend*, int);
+int lock_task_file(queue_backend*, struct flock*);
+void unlock_task_file(queue_backend*, struct flock*, int);
+void append_tasks(queue_backend*, const char*, size_t);
+off_t parse_macro_header(macro_table*, const char*, size_t);
+off_t load_macro_header(macro_table*, int);
+char *expand_macros(macro_table*, char*);
+void free_macro_table(macro_table*);
+char *claim_task_rewrite(int, macro_table*);
+char *claim_task_cursor(int, int, macro_table*);
+long long read_queue_offset(int);
+void write_queue_offset(int, long long);
+char *read_locked_file(int, off_t*);
+void write_locked_file(int, const char*, size_t);
+
+// launching tasks
+void init_task_environment(task_environment*, int, int, const char*);
+void update_task_environment(task_environment*, long long, int);
+void init_scratch_directory(task_environment*, const char*, int);
+int execute_task(const char*, long long, int, const char*, task_environment*, int, bool, bool, int);
+int launch_task(const char*, long long, bool, bool*);
+int run_plugin_task(const char*);
+double wall_time(void);
+
+// speculative execution
+void register_running_task(const char*, long long, int, const char*);
+int complete_running_task(const char*, long long, int, double);
+int claim_straggler(const char*, int, double, long long*, char**);
+double predicted_run_time(const char*, size_t);
+
+// checking tasks
+bool preflight_task_file(const char*, int, int, bool, queue_backend*);
+const char *check_task(const char*, size_t, bool);
+unsigned long long hash_task(const char*, size_t);
+void build_command_matcher(command_matcher*, char**, int);
+void free_command_matcher(command_matcher*);
+bool is_allowed(const command_matcher*, const char*);
+
+// completion ledger
+size_t task_tag(const char*, const char**);
+void record_completion(const char*, const char*, int, int, double);
+
+// cancelling tasks
+void open_tombstones(const char*, bool);
+void close_tombstones(void);
+const tombstone *find_tombstone(const char*);
+bool consume_tombstone(queue_backend*, const char*);
+long long add_tombstones(queue_backend*, const tombstone*, const char*, long long);
+void clear_tombstones(queue_backend*);
+char *read_queued_tasks(queue_backend*, int, size_t*, size_t*);
+
+#endif /* _TASKFARMER_H */